@@ -0,0 +1,102 @@
+# Compares threads and memory of the thread-per-connection server against
+# the epoll reactor while holding many idle clients.
+#
+#   python3 bench/connbench.py --clients 5000
+#   python3 bench/connbench.py --clients 5000 --open
+#
+# Run from P4/ after make. With --open every client sends OPEN, so pairs are
+# matched into games that then sit idle waiting for a move.
+
+import argparse
+import resource
+import socket
+import subprocess
+import time
+
+
+def frame(body):
+    return ("0|%02d|%s" % (len(body), body)).encode()
+
+
+def proc_status(pid):
+    stats = {}
+    with open("/proc/%d/status" % pid) as f:
+        for line in f:
+            key, _, value = line.partition(":")
+            if key in ("Threads", "VmRSS", "VmSize"):
+                stats[key] = int(value.split()[0])
+    return stats
+
+
+def wait_for_port(port):
+    for _ in range(100):
+        try:
+            socket.create_connection(("127.0.0.1", port)).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    raise SystemExit("server did not start on port %d" % port)
+
+
+def run(mode, args):
+    cmd = ["./nimd"]
+    if mode == "epoll":
+        cmd += ["--epoll"]
+    cmd += ["--lobby", str(max(args.clients, 2)), str(args.port)]
+    server = subprocess.Popen(cmd, stdout=subprocess.DEVNULL)
+    try:
+        wait_for_port(args.port)
+        time.sleep(0.2)
+        base = proc_status(server.pid)
+
+        start = time.time()
+        clients = []
+        for i in range(args.clients):
+            c = socket.create_connection(("127.0.0.1", args.port))
+            if args.open:
+                c.sendall(frame("OPEN|bench%d|" % i))
+            clients.append(c)
+        elapsed = time.time() - start
+        time.sleep(args.settle)
+        loaded = proc_status(server.pid)
+
+        for c in clients:
+            c.close()
+    finally:
+        server.terminate()
+        server.wait()
+
+    return {
+        "mode": mode,
+        "clients": args.clients,
+        "threads": loaded["Threads"],
+        "rss_kb": loaded["VmRSS"] - base["VmRSS"],
+        "vsz_kb": loaded["VmSize"] - base["VmSize"],
+        "connect_s": elapsed,
+    }
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--clients", type=int, default=1000)
+    ap.add_argument("--port", type=int, default=9300)
+    ap.add_argument("--open", action="store_true", help="send OPEN on every connection")
+    ap.add_argument("--settle", type=float, default=1.0, help="seconds to wait before sampling")
+    ap.add_argument("--mode", choices=["threads", "epoll", "both"], default="both")
+    args = ap.parse_args()
+
+    # both this script and the server need a descriptor per client
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+
+    modes = ["threads", "epoll"] if args.mode == "both" else [args.mode]
+    print("%-8s %8s %8s %12s %12s %10s" % ("mode", "clients", "threads", "rss_kb", "vsz_kb", "connect_s"))
+    for i, mode in enumerate(modes):
+        args.port += i
+        r = run(mode, args)
+        print("%-8s %8d %8d %12d %12d %10.3f" % (r["mode"], r["clients"], r["threads"],
+                                               r["rss_kb"], r["vsz_kb"], r["connect_s"]))
+
+
+if __name__ == "__main__":
+    main()
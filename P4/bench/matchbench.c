@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "../lobby.h"
+
+// matchbench: the lobby's match latency against queue size.
+//
+// The first table fills the lobby straight to each size with lobby_add,
+// ratings spread over the whole range, then times arrivals one at a time:
+// each joins and tries to match the way reactor_open does, and whoever
+// leaves is replaced so the queue stays at its size. For comparison the
+// same arrivals are matched by scanning a flat FIFO for the nearest
+// rating in reach, as a lobby without the bucket index would have to, and
+// a lobby_sweep of the full queue is timed with windows that never widen,
+// so it only pairs equal ratings.
+//
+// The second table runs the server's own windows on a simulated clock:
+// players arrive at a steady rate with ratings around 1500, matched on
+// arrival and by a sweep every LOBBY_RETRY_MS, and it reports how big the
+// queue got and how long players waited for a match.
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long rng = 88172645463325252ULL;
+
+static unsigned next_rand(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (unsigned)(rng >> 32);
+}
+
+static int uniform_rating(void) {
+    return next_rand() % (LOBBY_BUCKETS * LOBBY_BUCKET_WIDTH);
+}
+
+// roughly normal around 1500, sd 350
+static int normal_rating(void) {
+    int sum = 0;
+    for (int i = 0; i < 12; i++) sum += next_rand() % 1000;
+    return 1500 + (sum - 6000) * 350 / 1000;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double *v, int n, double pct) {
+    int i = (int)(n * pct / 100);
+    return v[i < n ? i : n - 1];
+}
+
+// players come from a free stack, so the queue never allocates
+static Player *players;
+static Player **spare;
+static int nspare;
+
+static Player *take_player(int rating) {
+    Player *p = spare[--nspare];
+    p->rating = rating;
+    p->queued = p->registered = 0;
+    return p;
+}
+
+static void give_back(Player *p) {
+    spare[nspare++] = p;
+}
+
+static void drop(Lobby *l, Player *p) {
+    remove_player(l, p);
+    give_back(p);
+}
+
+static void fill(Lobby *l, int size) {
+    for (int i = 0; i < size; i++) lobby_add(l, take_player(uniform_rating()), 0);
+}
+
+static double scan_sink;
+
+// the flat FIFO: the nearest rating within the window, which means
+// looking at every one
+static int scan_match(const int *ratings, int size, int rating, long window) {
+    int best = -1;
+    long gap = window + 1;
+    for (int i = 0; i < size; i++) {
+        if (abs(ratings[i] - rating) < gap) {
+            gap = abs(ratings[i] - rating);
+            best = i;
+        }
+    }
+    return best;
+}
+
+static Player **swept;
+static int nswept;
+
+static void collect(void *ctx, Player *p1, Player *p2) {
+    (void)ctx;
+    swept[nswept++] = p1;
+    swept[nswept++] = p2;
+}
+
+static void bench_size(int size, int arrivals) {
+    Lobby l;
+    lobby_init(&l, 0);
+    fill(&l, size);
+
+    double *lat = malloc(sizeof(double) * arrivals);
+    int matched = 0;
+    for (int i = 0; i < arrivals; i++) {
+        Player *p = take_player(uniform_rating());
+        Player *p1, *p2;
+        double t0 = now_ns();
+        lobby_add(&l, p, 0);
+        int m = lobby_match(&l, p, 0, &p1, &p2);
+        lat[i] = now_ns() - t0;
+        if (m) {
+            // one of the queue went, a newcomer takes its place
+            matched++;
+            drop(&l, p1);
+            drop(&l, p2);
+            lobby_add(&l, take_player(uniform_rating()), 0);
+        } else {
+            drop(&l, p);
+        }
+    }
+    qsort(lat, arrivals, sizeof(double), cmp_double);
+
+    // the same arrivals against a flat queue of the same ratings
+    int *ratings = malloc(sizeof(int) * size);
+    for (int i = 0; i < size; i++) ratings[i] = uniform_rating();
+    int scans = arrivals < 20000 ? arrivals : 20000;
+    double t0 = now_ns();
+    for (int i = 0; i < scans; i++) {
+        int at = scan_match(ratings, size, uniform_rating(), lobby_window(0));
+        scan_sink += at;
+        if (at >= 0) ratings[at] = uniform_rating();
+    }
+    double scan = (now_ns() - t0) / scans;
+
+    // a sweep of the whole queue, nobody's window wider than their rating
+    int base = lobby_window_base, growth = lobby_window_growth;
+    lobby_window_base = lobby_window_growth = 0;
+    int sweeps = 200;
+    double sweep_total = 0;
+    long pairs = 0;
+    for (int i = 0; i < sweeps; i++) {
+        nswept = 0;
+        t0 = now_ns();
+        lobby_sweep(&l, 1000, collect, NULL);
+        sweep_total += now_ns() - t0;
+        pairs += nswept / 2;
+        for (int j = 0; j < nswept; j++) {
+            drop(&l, swept[j]);
+            lobby_add(&l, take_player(uniform_rating()), 0);
+        }
+    }
+    lobby_window_base = base;
+    lobby_window_growth = growth;
+
+    printf("%8d %10.1f %10.1f %10.1f %9.1f%% %12.1f %12.1f %8.1f\n", size, percentile(lat, arrivals, 50),
+           percentile(lat, arrivals, 99), lat[arrivals - 1], 100.0 * matched / arrivals, scan,
+           sweep_total / sweeps, (double)pairs / sweeps);
+
+    for (int b = 0; b < LOBBY_BUCKETS; b++)
+        while (l.bucket[b].head) drop(&l, l.bucket[b].head);
+    lobby_free(&l);
+    free(lat);
+    free(ratings);
+}
+
+static double *waits;
+static int nwaits;
+
+static void record(void *ctx, Player *p1, Player *p2) {
+    uint64_t now = *(uint64_t *)ctx;
+    waits[nwaits++] = now - p1->queued_at;
+    waits[nwaits++] = now - p2->queued_at;
+    give_back(p1);
+    give_back(p2);
+}
+
+// rate players a second for seconds of simulated time
+static void simulate(int rate, int seconds) {
+    Lobby l;
+    lobby_init(&l, 0);
+    long total = (long)rate * seconds;
+    nwaits = 0;
+    double queue_sum = 0;
+    int queue_max = 0;
+    uint64_t next_sweep = LOBBY_RETRY_MS;
+    for (long i = 0; i < total; i++) {
+        uint64_t now = i * 1000 / rate;
+        while (now >= next_sweep) {
+            lobby_sweep(&l, next_sweep, record, &next_sweep);
+            next_sweep += LOBBY_RETRY_MS;
+        }
+        Player *p = take_player(normal_rating());
+        lobby_add(&l, p, now);
+        Player *p1, *p2;
+        if (lobby_match(&l, p, now, &p1, &p2)) record(&now, p1, p2);
+        queue_sum += l.waiting;
+        if (l.waiting > queue_max) queue_max = l.waiting;
+    }
+    qsort(waits, nwaits, sizeof(double), cmp_double);
+    printf("%8d %10.1f %10d %10.1f %10.1f %10.1f\n", rate, queue_sum / total, queue_max,
+           percentile(waits, nwaits, 50), percentile(waits, nwaits, 99), waits[nwaits - 1]);
+    for (int b = 0; b < LOBBY_BUCKETS; b++)
+        while (l.bucket[b].head) drop(&l, l.bucket[b].head);
+    lobby_free(&l);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--arrivals N] [--max-size N] [--seconds N]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    static struct option long_opts[] = {
+        {"arrivals", required_argument, NULL, 'a'},
+        {"max-size", required_argument, NULL, 'm'},
+        {"seconds", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}
+    };
+    int arrivals = 200000;
+    int max_size = 65536;
+    int seconds = 20;
+    int c;
+    while ((c = getopt_long(argc, argv, "a:m:s:", long_opts, NULL)) != -1) {
+        if (c == 'a') arrivals = atoi(optarg);
+        else if (c == 'm') max_size = atoi(optarg);
+        else if (c == 's') seconds = atoi(optarg);
+        else usage(argv[0]);
+    }
+    if (optind != argc || arrivals < 1 || max_size < 1 || seconds < 1) usage(argv[0]);
+
+    // the simulation holds at most one second's arrivals of the fastest rate
+    int count = (max_size > 100000 ? max_size : 100000) + 16;
+    players = calloc(count, sizeof(Player));
+    spare = malloc(sizeof(Player *) * count);
+    swept = malloc(sizeof(Player *) * count);
+    waits = malloc(sizeof(double) * 100000 * (long)seconds);
+    if (!players || !spare || !swept || !waits) {
+        perror("matchbench");
+        return 1;
+    }
+    for (int i = 0; i < count; i++) give_back(&players[i]);
+
+    printf("match latency, ns per arrival (window %d)\n", lobby_window_base);
+    printf("%8s %10s %10s %10s %10s %12s %12s %8s\n", "queue", "p50", "p99", "max", "matched", "flat scan",
+           "sweep", "pairs");
+    for (int size = 16; size <= max_size; size *= 4) bench_size(size, arrivals);
+
+    printf("\nwait for a match, ms (window %d + %d/s, sweep every %d ms)\n", lobby_window_base,
+           lobby_window_growth, LOBBY_RETRY_MS);
+    printf("%8s %10s %10s %10s %10s %10s\n", "per sec", "queue", "max queue", "p50", "p99", "max");
+    for (int rate = 10; rate <= 100000; rate *= 10) simulate(rate, seconds);
+    return 0;
+}
@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include "../player.h"
+#include "../game.h"
+#include "../ngp.h"
+
+// microbench: times the codec and game core on fixed message corpora.
+// Every case reports ns/op, heap allocations/op (malloc and friends are
+// wrapped at link time, see the Makefile) and ops/s; --csv prints the
+// same as one line per case, and --compare reads such a file back and
+// fails when a case got slower than the tolerance allows.
+
+static long allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    allocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocs++;
+    return __real_realloc(ptr, size);
+}
+
+static volatile long sink;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the corpora: ordinary traffic plus the shapes that hit the slow or
+// failing paths
+static char max_name[73];
+static char open_max[NGP_BUF_SIZE];
+static const char *parse_cases[][2] = {
+    { "move", "0|09|MOVE|1|3|" },
+    { "open", "0|11|OPEN|alice|" },
+    { "open_max_name", open_max },
+    { "play", "0|17|PLAY|1|1 3 5 7 9|" },
+    { "over_forfeit", "0|25|OVER|1|0 0 0 7 9|Forfeit|" },
+    { "extra_fields", "0|17|MOVE|1|3|4|5|6|7|" },
+    { "garbage_suffix", "0|09|MOVE|1|3|garbage" },
+    { "no_bars", "0|09|MOVEx1x3x" },
+};
+#define PARSE_CASES (int)(sizeof(parse_cases) / sizeof(parse_cases[0]))
+
+typedef struct {
+    const char *name;
+    double ns;
+    double allocs;
+    double ops;
+} Result;
+
+static Result results[64];
+static int nresults;
+static double min_time = 0.2;
+static const char *only;
+
+typedef void (*BenchFn)(const void *arg, long iters);
+
+// grows the iteration count until one run takes min_time, then
+// reports that run
+static void run(const char *name, BenchFn fn, const void *arg) {
+    if (only && !strstr(name, only)) return;
+    long iters = 1;
+    fn(arg, 1);
+    for (;;) {
+        long before = allocs;
+        double t0 = now_sec();
+        fn(arg, iters);
+        double elapsed = now_sec() - t0;
+        if (elapsed >= min_time || iters >= (1L << 40)) {
+            Result *r = &results[nresults++];
+            r->name = name;
+            r->ns = elapsed * 1e9 / iters;
+            r->allocs = (double)(allocs - before) / iters;
+            r->ops = iters / elapsed;
+            return;
+        }
+        iters *= elapsed > 0.01 ? (long)(min_time / elapsed * 1.2) + 1 : 10;
+    }
+}
+
+static void bench_parse(const void *arg, long iters) {
+    const char *msg = arg;
+    int len = strlen(msg);
+    NgpMsg m;
+    for (long i = 0; i < iters; i++) sink += ngp_parse(msg, len, &m) + m.type;
+}
+
+// NGP-B MOVE, the binary counterpart of parse/move
+static const char binary_move[4] = { NGP_MOVE, 2, 1, 3 };
+
+static void bench_parse_binary(const void *arg, long iters) {
+    (void)arg;
+    NgpMsg m;
+    for (long i = 0; i < iters; i++)
+        sink += ngpb_parse(binary_move, sizeof(binary_move), &m) + ngp_int(&m, 3) + ngp_int(&m, 4);
+}
+
+// the encoder the server used before ngp.c, kept here as the baseline
+// the build cases measure the ngp encoders against: a heap buffer per
+// frame and strncat for each field
+static char *legacy_build(const char *type, const char fields[][128], int count) {
+    char body[105];
+    body[0] = '\0';
+    size_t remaining = 104;
+    if (fields != NULL) {
+        for (int i = 0; i < count; i++) {
+            size_t fl = strnlen(fields[i], 128);
+            if (fl + 1 > remaining)
+                break;
+            strncat(body, fields[i], remaining);
+            remaining -= fl;
+            strncat(body, "|", remaining);
+            remaining -= 1;
+        }
+    }
+
+    int length = strlen(type) + 1 + strlen(body);
+    char *buf = malloc(105);
+    if (!buf)
+        return NULL;
+    // a long type and body are cut off at the buffer, as they always were
+    if (snprintf(buf, 105, "0|%02d|%s|%s", length, type, body) >= 105)
+        buf[104] = '\0';
+    return buf;
+}
+
+static void bench_build(const void *arg, long iters) {
+    (void)arg;
+    char fields[2][128] = { "1", "3" };
+    for (long i = 0; i < iters; i++) {
+        char *s = legacy_build("MOVE", fields, 2);
+        sink += s[0];
+        free(s);
+    }
+}
+
+static void bench_build_max(const void *arg, long iters) {
+    (void)arg;
+    char fields[1][128];
+    strcpy(fields[0], max_name);
+    for (long i = 0; i < iters; i++) {
+        char *s = legacy_build("OPEN", fields, 1);
+        sink += s[0];
+        free(s);
+    }
+}
+
+// player_next_frame over a buffer packed with copies of one frame: the
+// header and length checks, in place termination and type check. Bad
+// frames also pay for the FAIL send, which fails at once on no socket.
+static Player *framer;
+static int framer_len;
+
+static void load_frames(const char *frame, int len) {
+    framer_len = 0;
+    while (framer_len + len <= RBUF_SIZE) {
+        memcpy(framer->rbuf + framer_len, frame, len);
+        framer_len += len;
+    }
+}
+
+static void run_frames(long iters) {
+    long done = 0;
+    while (done < iters) {
+        framer->rstart = 0;
+        framer->rend = framer_len;
+        framer->rhold = -1;
+        NgpMsg msg;
+        int status;
+        while (done < iters && (status = player_next_frame(framer, &msg)) != 0) {
+            done++;
+            sink += status;
+            // a bad frame is not consumed, start the buffer over
+            if (status < 0) break;
+        }
+    }
+    framer->rhold = -1;
+}
+
+static void bench_frames(const void *arg, long iters) {
+    load_frames(arg, strlen(arg));
+    run_frames(iters);
+}
+
+static void bench_frames_binary(const void *arg, long iters) {
+    (void)arg;
+    framer->binary = 1;
+    load_frames(binary_move, sizeof(binary_move));
+    run_frames(iters);
+    framer->binary = 0;
+}
+
+// one whole game: a fixed five move game with the game_over check
+// after every move, on a game from the pool and its table row
+static Player player_a, player_b;
+static Game *game;
+
+static const int script[][2] = {
+    {4, 9}, {3, 7}, {2, 5}, {1, 3}, {0, 1},
+};
+
+static void bench_game(const void *arg, long iters) {
+    (void)arg;
+    for (long i = 0; i < iters; i++) {
+        game_reset(game, &game_layout);
+        int moves = 0;
+        for (int m = 0; m < 5 && !game_over(game); m++) {
+            if (game_move(game, game->turn, script[m][0], script[m][1]) == 0) {
+                game->turn = 3 - game->turn;
+                moves++;
+            }
+        }
+        sink += moves;
+    }
+}
+
+static void bench_game_move_invalid(const void *arg, long iters) {
+    (void)arg;
+    game_reset(game, &game_layout);
+    for (long i = 0; i < iters; i++) {
+        sink += game_move(game, 2, 0, 1);     // 31, not your turn
+        sink += game_move(game, 1, 7, 1);     // 32, no such pile
+        sink += game_move(game, 1, 0, 2);     // 33, too many
+    }
+}
+
+static void bench_game_over(const void *arg, long iters) {
+    memcpy(game_board(game), arg, GAME_MAX_PILES);
+    for (long i = 0; i < iters; i++) sink += game_over(game);
+}
+
+static void bench_encode_play(const void *arg, long iters) {
+    (void)arg;
+    static const uint8_t board[5] = {1, 2, 0, 7, 4};
+    char buf[NGP_BUF_SIZE];
+    for (long i = 0; i < iters; i++) sink += ngp_play(buf, 1 + (i & 1), board, 5);
+}
+
+static void bench_encode_over(const void *arg, long iters) {
+    (void)arg;
+    static const uint8_t board[5] = {0, 0, 0, 7, 9};
+    char buf[NGP_BUF_SIZE];
+    for (long i = 0; i < iters; i++) sink += ngp_over(buf, 1, board, 5, 1);
+}
+
+// a board off the PLAY frame table goes through the general encoder
+static void bench_encode_play_wide(const void *arg, long iters) {
+    (void)arg;
+    static const uint8_t board[16] = {12, 200, 3, 0, 45, 6, 78, 9, 1, 0, 0, 255, 7, 7, 7, 31};
+    char buf[NGP_BUF_SIZE];
+    for (long i = 0; i < iters; i++) sink += ngp_play(buf, 1 + (i & 1), board, 16);
+}
+
+static void bench_encode_play_binary(const void *arg, long iters) {
+    (void)arg;
+    static const uint8_t board[5] = {1, 2, 0, 7, 4};
+    char buf[NGP_BUF_SIZE];
+    for (long i = 0; i < iters; i++) sink += ngpb_play(buf, 1 + (i & 1), board, 5);
+}
+
+static void bench_encode_over_binary(const void *arg, long iters) {
+    (void)arg;
+    static const uint8_t board[5] = {0, 0, 0, 7, 9};
+    char buf[NGP_BUF_SIZE];
+    for (long i = 0; i < iters; i++) sink += ngpb_over(buf, 1, board, 5, 1);
+}
+
+static void bench_encode_name(const void *arg, long iters) {
+    const char *name = arg;
+    char buf[NGP_BUF_SIZE];
+    for (long i = 0; i < iters; i++) sink += ngp_name(buf, 2, name);
+}
+
+static void print_text(void) {
+    printf("%-32s %12s %12s %14s\n", "benchmark", "ns/op", "allocs/op", "ops/s");
+    for (int i = 0; i < nresults; i++) {
+        Result *r = &results[i];
+        printf("%-32s %12.1f %12.2f %14.0f\n", r->name, r->ns, r->allocs, r->ops);
+    }
+}
+
+static void print_csv(void) {
+    printf("benchmark,ns_per_op,allocs_per_op,ops_per_sec\n");
+    for (int i = 0; i < nresults; i++) {
+        Result *r = &results[i];
+        printf("%s,%.2f,%.2f,%.0f\n", r->name, r->ns, r->allocs, r->ops);
+    }
+}
+
+// 1 if any case is more than tolerance percent slower than the baseline,
+// or allocates more
+static int compare(const char *path, double tolerance) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return 2;
+    }
+    char line[256];
+    int worse = 0;
+    printf("%-32s %12s %12s %8s\n", "benchmark", "base ns/op", "ns/op", "change");
+    while (fgets(line, sizeof(line), f)) {
+        char name[128];
+        double ns, al;
+        if (sscanf(line, "%127[^,],%lf,%lf", name, &ns, &al) != 3) continue;
+        for (int i = 0; i < nresults; i++) {
+            Result *r = &results[i];
+            if (strcmp(r->name, name) != 0) continue;
+            double change = (r->ns - ns) / ns * 100;
+            int bad = change > tolerance || r->allocs > al + 0.005;
+            printf("%-32s %12.1f %12.1f %+7.1f%%%s\n", name, ns, r->ns, change,
+                   bad ? "  REGRESSION" : "");
+            worse |= bad;
+        }
+    }
+    fclose(f);
+    return worse;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--csv] [--time SEC] [--filter TEXT]\n"
+                    "          [--compare BASE.csv [--tolerance PCT]]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    static struct option long_opts[] = {
+        {"csv", no_argument, NULL, 'c'},
+        {"time", required_argument, NULL, 't'},
+        {"filter", required_argument, NULL, 'f'},
+        {"compare", required_argument, NULL, 'b'},
+        {"tolerance", required_argument, NULL, 'p'},
+        {NULL, 0, NULL, 0}
+    };
+    int csv = 0;
+    const char *base = NULL;
+    double tolerance = 10;
+    int c;
+    while ((c = getopt_long(argc, argv, "ct:f:b:p:", long_opts, NULL)) != -1) {
+        if (c == 'c') csv = 1;
+        else if (c == 't') min_time = atof(optarg);
+        else if (c == 'f') only = optarg;
+        else if (c == 'b') base = optarg;
+        else if (c == 'p') tolerance = atof(optarg);
+        else usage(argv[0]);
+    }
+    if (optind != argc || min_time <= 0) usage(argv[0]);
+
+    ngp_init();
+    memset(max_name, 'n', 72);
+    max_name[72] = '\0';
+    snprintf(open_max, sizeof(open_max), "0|%02d|OPEN|%s|", (int)(strlen(max_name) + 6), max_name);
+
+    // bad frames answer with a FAIL, which goes nowhere
+    framer = player_create(-1);
+
+    static char names[PARSE_CASES][2][64];
+    for (int i = 0; i < PARSE_CASES; i++) {
+        snprintf(names[i][0], 64, "parse/%s", parse_cases[i][0]);
+        run(names[i][0], bench_parse, parse_cases[i][1]);
+    }
+    run("parse/move_binary", bench_parse_binary, NULL);
+    run("build/move", bench_build, NULL);
+    run("build/open_max_name", bench_build_max, NULL);
+    for (int i = 0; i < PARSE_CASES; i++) {
+        snprintf(names[i][1], 64, "frame/%s", parse_cases[i][0]);
+        run(names[i][1], bench_frames, parse_cases[i][1]);
+    }
+    run("frame/bad_header", bench_frames, "0|9x|MOVE|1|3|");
+    run("frame/unknown_type", bench_frames, "0|09|JUMP|1|3|");
+    run("frame/move_binary", bench_frames_binary, NULL);
+
+    game = game_create(&player_a, &player_b);
+    static const uint8_t full[GAME_MAX_PILES] = {1, 3, 5, 7, 9};
+    static const uint8_t last[GAME_MAX_PILES] = {0, 0, 0, 0, 1};
+    static const uint8_t empty[GAME_MAX_PILES] = {0};
+    run("game/full_game", bench_game, NULL);
+    run("game/move_invalid_x3", bench_game_move_invalid, NULL);
+    run("game/over_full", bench_game_over, full);
+    run("game/over_last_pile", bench_game_over, last);
+    run("game/over_empty", bench_game_over, empty);
+
+    run("encode/play", bench_encode_play, NULL);
+    run("encode/over_forfeit", bench_encode_over, NULL);
+    run("encode/play_16_piles", bench_encode_play_wide, NULL);
+    run("encode/play_binary", bench_encode_play_binary, NULL);
+    run("encode/over_binary", bench_encode_over_binary, NULL);
+    run("encode/name_max", bench_encode_name, max_name);
+
+    game_free(game);
+    player_destroy(framer);
+
+    if (base) {
+        int status = compare(base, tolerance);
+        return status;
+    }
+    if (csv) print_csv();
+    else print_text();
+    return 0;
+}
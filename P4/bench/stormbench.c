@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+// stormbench: how fast a running server takes new connections.
+//
+// Each thread connects, sends OPEN with a name nobody else uses, waits
+// for the WAIT and hangs up, over and over, so the server sees nothing
+// but arrivals. Whoever is matched before hanging up forfeits at once.
+// With --idle PCT that share of connections never send anything and hang
+// up straight after connecting, as a port scan or a broken client would;
+// under --defer-accept the server should never see those at all.
+// Sockets close with a reset so the client runs out of neither ports nor
+// TIME_WAIT slots. It reports arrivals a second and the time from
+// starting the connect to reading the WAIT. The client shares the machine
+// with the server, so with --pid it also reports the server's own CPU time
+// per connection, from /proc, which is what the accept path costs.
+//
+//   ./nimd --epoll --lobby 100000 4000 &
+//   bench/stormbench --threads 32 --seconds 10 --pid $! 4000
+
+typedef struct {
+    int id;
+    double *lat;
+    long count;
+    long cap;
+    long idle;
+    long failed;
+} Client;
+
+static struct addrinfo *server;
+static double deadline;
+static int idle_pct;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double *v, long n, double pct) {
+    long i = (long)(n * pct / 100);
+    return v[i < n ? i : n - 1];
+}
+
+// the process's user and system time in seconds, or -1
+static double cpu_seconds(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    unsigned long utime, stime;
+    // the command can hold spaces, the fields after it cannot
+    int n = fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    fclose(f);
+    return n == 2 ? (double)(utime + stime) / sysconf(_SC_CLK_TCK) : -1;
+}
+
+static void hang_up(int fd) {
+    struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+}
+
+// 1 once the WAIT is read, 0 when anything else came back
+static int open_one(int fd, const char *name) {
+    char body[96], frame[128];
+    int len = snprintf(body, sizeof(body), "OPEN|%s|", name);
+    len = snprintf(frame, sizeof(frame), "0|%02d|%s", len, body);
+    if (send(fd, frame, len, MSG_NOSIGNAL) != len) return 0;
+
+    char buf[256];
+    int got = 0;
+    while (got < (int)sizeof(buf) - 1) {
+        ssize_t n = recv(fd, buf + got, sizeof(buf) - 1 - got, 0);
+        if (n <= 0) return 0;
+        got += n;
+        buf[got] = '\0';
+        if (strstr(buf, "WAIT|")) return 1;
+        if (strstr(buf, "FAIL|")) return 0;
+    }
+    return 0;
+}
+
+static void *client_main(void *arg) {
+    Client *c = arg;
+    unsigned seed = 2463534242u + c->id;
+    struct timeval tv = { .tv_sec = 5 };
+    for (long i = 0; now_ns() < deadline; i++) {
+        double t0 = now_ns();
+        int fd = socket(server->ai_family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            c->failed++;
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (connect(fd, server->ai_addr, server->ai_addrlen) < 0) {
+            c->failed++;
+            hang_up(fd);
+            continue;
+        }
+        seed = seed * 1103515245 + 12345;
+        if ((int)((seed >> 16) % 100) < idle_pct) {
+            c->idle++;
+            hang_up(fd);
+            continue;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "s%dn%ld", c->id, i);
+        if (open_one(fd, name)) {
+            if (c->count == c->cap) {
+                c->cap = c->cap ? c->cap * 2 : 4096;
+                c->lat = realloc(c->lat, sizeof(double) * c->cap);
+                if (!c->lat) {
+                    perror("stormbench");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            c->lat[c->count++] = now_ns() - t0;
+        } else {
+            c->failed++;
+        }
+        hang_up(fd);
+    }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--threads N] [--seconds N] [--idle PCT] [--host HOST] [--pid PID] port\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    static struct option long_opts[] = {
+        {"threads", required_argument, NULL, 't'},
+        {"seconds", required_argument, NULL, 's'},
+        {"idle", required_argument, NULL, 'i'},
+        {"host", required_argument, NULL, 'h'},
+        {"pid", required_argument, NULL, 'p'},
+        {NULL, 0, NULL, 0}
+    };
+    int threads = 32;
+    int seconds = 10;
+    const char *host = "127.0.0.1";
+    int pid = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "t:s:i:h:p:", long_opts, NULL)) != -1) {
+        if (c == 't') threads = atoi(optarg);
+        else if (c == 's') seconds = atoi(optarg);
+        else if (c == 'i') idle_pct = atoi(optarg);
+        else if (c == 'h') host = optarg;
+        else if (c == 'p') pid = atoi(optarg);
+        else usage(argv[0]);
+    }
+    if (optind != argc - 1 || threads < 1 || seconds < 1 || idle_pct < 0 || idle_pct > 100) usage(argv[0]);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, argv[optind], &hints, &server) != 0) {
+        fprintf(stderr, "stormbench: cannot resolve %s\n", host);
+        return 1;
+    }
+
+    Client *clients = calloc(threads, sizeof(Client));
+    pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+    if (!clients || !tids) {
+        perror("stormbench");
+        return 1;
+    }
+    double cpu_start = pid ? cpu_seconds(pid) : -1;
+    double start = now_ns();
+    deadline = start + seconds * 1e9;
+    for (int i = 0; i < threads; i++) {
+        clients[i].id = i;
+        if (pthread_create(&tids[i], NULL, client_main, &clients[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    long opened = 0, idle = 0, failed = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        opened += clients[i].count;
+        idle += clients[i].idle;
+        failed += clients[i].failed;
+    }
+    double secs = (now_ns() - start) / 1e9;
+    double cpu = cpu_start >= 0 ? cpu_seconds(pid) - cpu_start : -1;
+
+    double *lat = malloc(sizeof(double) * (opened ? opened : 1));
+    long n = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(lat + n, clients[i].lat, sizeof(double) * clients[i].count);
+        n += clients[i].count;
+        free(clients[i].lat);
+    }
+    qsort(lat, n, sizeof(double), cmp_double);
+
+    printf("%d threads, %.1f s, %d%% idle\n", threads, secs, idle_pct);
+    printf("%10s %10s %10s %8s %10s %10s %10s %12s\n", "opens/s", "idle/s", "total/s", "failed", "p50 us",
+           "p99 us", "max us", "server us");
+    printf("%10.0f %10.0f %10.0f %8ld %10.1f %10.1f %10.1f", opened / secs, idle / secs, (opened + idle) / secs,
+           failed, n ? percentile(lat, n, 50) / 1e3 : 0, n ? percentile(lat, n, 99) / 1e3 : 0,
+           n ? lat[n - 1] / 1e3 : 0);
+    // server CPU per connection made, idle ones included
+    if (cpu >= 0 && opened + idle > 0) printf(" %12.2f\n", cpu * 1e6 / (opened + idle));
+    else printf(" %12s\n", "-");
+    free(lat);
+    free(clients);
+    free(tids);
+    freeaddrinfo(server);
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "bot.h"
+#include "evlog.h"
+#include "ngp.h"
+
+// One entry per board, indexed as ngp.h has it: the nim-sum,
+// the move that brings it to zero (NO_MOVE when there is none, i.e. the
+// bot is losing) and the number of legal moves to pick a random one from.
+// Boards of other layouts get their entry worked out on the spot.
+#define NO_MOVE 0xff
+
+typedef struct {
+    unsigned char nimsum;
+    unsigned char pile;
+    unsigned char count;
+    unsigned short moves;
+} BotEntry;
+
+int bot_skill = 100;
+
+static BotEntry table[NGP_BOARDS];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+static __thread uint64_t rng;
+
+static void solve(const uint8_t *board, int piles, BotEntry *e) {
+    e->nimsum = 0;
+    e->moves = 0;
+    for (int i = 0; i < piles; i++) {
+        e->nimsum ^= board[i];
+        e->moves += board[i];
+    }
+    e->pile = NO_MOVE;
+    e->count = 0;
+    // a pile that shrinks to pile ^ nimsum leaves a nim-sum of zero;
+    // the first such pile is as good as any
+    for (int i = 0; e->nimsum && i < piles; i++) {
+        int want = board[i] ^ e->nimsum;
+        if (want < board[i]) {
+            e->pile = i;
+            e->count = board[i] - want;
+            break;
+        }
+    }
+}
+
+static void build_table(void) {
+    uint8_t b[5];
+    for (int idx = 0; idx < NGP_BOARDS; idx++) {
+        ngp_board_at(idx, b);
+        solve(b, 5, &table[idx]);
+    }
+}
+
+void bot_init(void) {
+    pthread_once(&table_once, build_table);
+}
+
+// the calling thread's stream starts from seed rather than the clock, so
+// a run that replays by seed (--simulate) replays the bot's moves too
+void bot_seed(uint64_t seed) {
+    rng = seed * 0x2545f4914f6cdd1dULL | 1;
+}
+
+// xorshift64*, one stream per thread
+static uint32_t bot_random(void) {
+    if (!rng) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        rng = ((uint64_t)ts.tv_nsec << 20) ^ (uintptr_t)&rng ^ 0x9e3779b97f4a7c15ULL;
+    }
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (rng * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+// picks a move for board; -1 if the board is empty
+int bot_choose(const uint8_t *board, int piles, int skill, int *pile, int *count) {
+    int idx = ngp_board_index(board, piles);
+    BotEntry off;
+    const BotEntry *e = &off;
+    if (idx >= 0) e = &table[idx];
+    else solve(board, piles, &off);
+    if (e->moves == 0) return -1;
+
+    if (e->pile != NO_MOVE && (skill >= 100 || (int)(bot_random() % 100) < skill)) {
+        *pile = e->pile;
+        *count = e->count;
+        return 0;
+    }
+    // every legal move equally likely: the k-th stone counted across the piles
+    int k = bot_random() % e->moves;
+    for (int i = 0; i < piles; i++) {
+        if (k < board[i]) {
+            *pile = i;
+            *count = k + 1;
+            return 0;
+        }
+        k -= board[i];
+    }
+    return -1;
+}
+
+// plays the bot's turn in g; the caller passes the turn on as usual
+int bot_move(Game *g) {
+    int pile, count;
+    if (bot_choose(game_board(g), game_piles(g), bot_skill, &pile, &count) < 0) return -1;
+    int err = game_move(g, g->turn, pile, count);
+    if (err == 0) evlog_move(g, g->turn, pile, count);
+    return err;
+}
+
+// the bot's side of a game: no socket, no name registration, and writes
+// to it go nowhere (see player_write)
+Player *bot_create(void) {
+    Player *p = player_create(-1);
+    if (!p) return NULL;
+    p->bot = 1;
+    p->name = BOT_NAME;
+    p->has_opened = 1;
+    return p;
+}
+
+// bot against bot on one Game dealt again and again from layout, no
+// sockets involved; returns the moves played and counts player 1's wins
+long bot_selfplay(const GameLayout *layout, long games, int skill, long *p1_wins) {
+    Player *a = bot_create();
+    Player *b = bot_create();
+    Game *g = a && b ? game_create_layout(a, b, layout) : NULL;
+    if (!g) {
+        player_destroy(a);
+        player_destroy(b);
+        return -1;
+    }
+
+    long moves = 0;
+    *p1_wins = 0;
+    for (long n = 0; n < games && moves >= 0; n++) {
+        game_reset(g, layout);
+        while (!game_over(g)) {
+            int pile, count;
+            if (bot_choose(game_board(g), game_piles(g), skill, &pile, &count) < 0 ||
+                game_move(g, g->turn, pile, count) != 0) {
+                moves = -1;
+                break;
+            }
+            g->turn = 3 - g->turn;
+            moves++;
+        }
+        // whoever took the last stone just passed the turn on
+        if (g->turn == 2) (*p1_wins)++;
+    }
+    game_destroy(g);
+    return moves;
+}
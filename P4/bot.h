@@ -0,0 +1,23 @@
+#ifndef BOT_H
+#define BOT_H
+
+#include "game.h"
+
+// The house bot: an opponent with no socket that plays straight off a
+// table of every board reachable from 1 3 5 7 9 (other layouts are worked
+// out move by move), for a player who has waited too long for a human.
+
+#define BOT_NAME "HouseBot"
+
+// percent of turns the bot takes the winning move when it has one; the
+// rest of the time it plays a random legal move
+extern int bot_skill;
+
+void bot_init(void);
+void bot_seed(uint64_t seed);
+Player *bot_create(void);
+int bot_choose(const uint8_t *board, int piles, int skill, int *pile, int *count);
+int bot_move(Game *g);
+long bot_selfplay(const GameLayout *layout, long games, int skill, long *p1_wins);
+
+#endif
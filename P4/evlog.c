@@ -0,0 +1,428 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "evlog.h"
+#include "metrics.h"
+
+// one ring per producing thread; head is only written by its thread and
+// tail only by the writer, each on its own cache line
+#define RING_BYTES (64 * 1024)
+#define RING_MASK (RING_BYTES - 1)
+// how often the writer drains when nobody kicks it
+#define DRAIN_MS 10
+#define BATCH_BYTES (1024 * 1024)
+
+typedef struct EvRing {
+    uint64_t head;
+    int kicked;
+    char pad1[52];
+    uint64_t tail;
+    char pad2[56];
+    int retired;
+    struct EvRing *next;
+    char data[RING_BYTES];
+} EvRing;
+
+int evlog_on = 0;
+
+static __thread EvRing *ring_local;
+static pthread_mutex_t registry = PTHREAD_MUTEX_INITIALIZER;
+static EvRing *live;
+static EvRing *spare;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static int started;
+static int stopping;
+
+static const char *log_path;
+static long log_sync_ms;
+static int log_fd = -1;
+static int log_segment;
+static long log_size;
+static char *batch;
+static int batch_len;
+// a write failed; the file ends at the last whole batch and takes no more
+static int log_failed;
+
+// what evlog_report prints, written by the writer only
+static uint64_t bytes_written;
+static uint64_t syncs;
+
+// a thread that exits leaves its ring for the writer, which drains it and
+// hands it on to the next thread
+static void ring_retire(void *arg) {
+    EvRing *r = arg;
+    __atomic_store_n(&r->retired, 1, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init(void) {
+    pthread_key_create(&ring_key, ring_retire);
+}
+
+// first event on a thread; rings are mapped, so pages a quiet thread
+// never writes cost nothing
+static EvRing *ring_attach(void) {
+    pthread_once(&ring_once, ring_key_init);
+    pthread_mutex_lock(&registry);
+    EvRing *r = spare;
+    if (r) {
+        spare = r->next;
+    } else {
+        r = mmap(NULL, sizeof(EvRing), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (r == MAP_FAILED) r = NULL;
+    }
+    if (r) {
+        r->retired = 0;
+        r->kicked = 0;
+        r->next = live;
+        live = r;
+    }
+    pthread_mutex_unlock(&registry);
+    if (r) pthread_setspecific(ring_key, r);
+    ring_local = r;
+    return r;
+}
+
+// copies one record into the thread's ring, or drops it when the ring is
+// full; a ring past half full wakes the writer early
+static void ring_put(const void *rec, int size) {
+    EvRing *r = ring_local ? ring_local : ring_attach();
+    if (!r) {
+        metrics_add(M_LOG_DROPS, 1);
+        return;
+    }
+    uint64_t head = r->head;
+    uint64_t used = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (used + size > RING_BYTES) {
+        metrics_add(M_LOG_DROPS, 1);
+        return;
+    }
+    int off = head & RING_MASK;
+    int first = size < RING_BYTES - off ? size : RING_BYTES - off;
+    memcpy(r->data + off, rec, first);
+    memcpy(r->data, (const char *)rec + first, size - first);
+    __atomic_store_n(&r->head, head + size, __ATOMIC_RELEASE);
+    metrics_add(M_LOG_EVENTS, 1);
+
+    if (used + size > RING_BYTES / 2 && !__atomic_load_n(&r->kicked, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&r->kicked, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&writer_wake);
+    }
+}
+
+static uint64_t wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// a record is built on the stack and copied into the ring whole
+typedef struct {
+    EvRecord head;
+    char payload[EVLOG_RECORD_MAX - sizeof(EvRecord)];
+} EvBuf;
+
+static void rec_init(EvBuf *b, int type, uint64_t game, int player, uint32_t arg) {
+    b->head.size = sizeof(EvRecord);
+    b->head.type = type;
+    b->head.player = player;
+    b->head.arg = arg;
+    b->head.time = wall_ns();
+    b->head.game = game;
+}
+
+static void rec_add(EvBuf *b, const void *data, int len) {
+    int room = EVLOG_RECORD_MAX - b->head.size;
+    if (len > room) len = room;
+    memcpy((char *)b + b->head.size, data, len);
+    b->head.size += len;
+}
+
+static void rec_str(EvBuf *b, const char *s, int nul) {
+    rec_add(b, s ? s : "", (s ? strlen(s) : 0) + nul);
+}
+
+static void rec_board(EvBuf *b, const Game *g) {
+    uint8_t n = game_piles(g);
+    rec_add(b, &n, 1);
+    rec_add(b, game_board(g), n);
+}
+
+void evlog_open(const char *name) {
+    if (!__atomic_load_n(&evlog_on, __ATOMIC_RELAXED)) return;
+    EvBuf b;
+    rec_init(&b, EV_OPEN, 0, 0, 0);
+    rec_str(&b, name, 0);
+    ring_put(&b, b.head.size);
+}
+
+void evlog_match(const Game *g) {
+    if (!__atomic_load_n(&evlog_on, __ATOMIC_RELAXED)) return;
+    EvBuf b;
+    rec_init(&b, EV_MATCH, g->serial, 0, 0);
+    rec_board(&b, g);
+    rec_str(&b, g->p1->name, 1);
+    rec_str(&b, g->p2->name, 1);
+    ring_put(&b, b.head.size);
+}
+
+void evlog_move(const Game *g, int player, int pile, int count) {
+    if (!__atomic_load_n(&evlog_on, __ATOMIC_RELAXED)) return;
+    EvRecord r;
+    r.size = sizeof(r);
+    r.type = EV_MOVE;
+    r.player = player;
+    r.arg = (uint32_t)pile << 8 | (count & 0xff);
+    r.time = wall_ns();
+    r.game = g->serial;
+    ring_put(&r, sizeof(r));
+}
+
+void evlog_fail(const Player *p, const char *reason) {
+    if (!__atomic_load_n(&evlog_on, __ATOMIC_RELAXED)) return;
+    EvBuf b;
+    const Game *g = p->game;
+    rec_init(&b, EV_FAIL, g ? g->serial : 0, g ? p->player_number : 0, atoi(reason));
+    rec_str(&b, p->name, 1);
+    rec_str(&b, reason, 0);
+    ring_put(&b, b.head.size);
+}
+
+void evlog_over(const Game *g, int winner, int forfeit) {
+    if (!__atomic_load_n(&evlog_on, __ATOMIC_RELAXED)) return;
+    EvBuf b;
+    rec_init(&b, EV_OVER, g->serial, 0, winner | (forfeit ? 1 : 0) << 8);
+    rec_board(&b, g);
+    ring_put(&b, b.head.size);
+}
+
+// the writer's side
+
+static int segment_open(void) {
+    char name[4096];
+    // a new segment after the last one there is
+    for (;;) {
+        snprintf(name, sizeof(name), "%s.%06d", log_path, log_segment);
+        struct stat st;
+        if (stat(name, &st) < 0) break;
+        log_segment++;
+    }
+    int fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    char header[EVLOG_HEADER];
+    uint32_t version = EVLOG_VERSION;
+    memset(header, 0, sizeof(header));
+    memcpy(header, EVLOG_MAGIC, 8);
+    memcpy(header + 8, &version, 4);
+    if (write(fd, header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        close(fd);
+        return -1;
+    }
+    log_fd = fd;
+    log_size = sizeof(header);
+    return 0;
+}
+
+// A batch lands whole or not at all. Records run on from one batch into
+// the next, so after a failed write (ENOSPC, EIO) nothing later could be
+// parsed either: the partial batch is cut off and the log stops, as it
+// does when a segment cannot be opened.
+static void batch_write(void) {
+    if (log_failed) {
+        batch_len = 0;
+        return;
+    }
+    for (int off = 0; off < batch_len;) {
+        ssize_t n = write(log_fd, batch + off, batch_len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("evlog write");
+            if (ftruncate(log_fd, log_size) < 0) perror("evlog truncate");
+            log_failed = 1;
+            __atomic_store_n(&evlog_on, 0, __ATOMIC_RELAXED);
+            batch_len = 0;
+            return;
+        }
+        off += n;
+    }
+    log_size += batch_len;
+    bytes_written += batch_len;
+    batch_len = 0;
+}
+
+// moves what r holds into the batch; a record the batch cuts in two still
+// lands in the file whole, and segments only change between passes
+static void ring_drain(EvRing *r) {
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = r->tail;
+    while (tail < head) {
+        if (batch_len == BATCH_BYTES) batch_write();
+        int off = tail & RING_MASK;
+        int len = head - tail;
+        if (len > RING_BYTES - off) len = RING_BYTES - off;
+        if (len > BATCH_BYTES - batch_len) len = BATCH_BYTES - batch_len;
+        memcpy(batch + batch_len, r->data + off, len);
+        batch_len += len;
+        tail += len;
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->kicked, 0, __ATOMIC_RELAXED);
+}
+
+// One pass over every ring. Rings only join at the head of the list and
+// only the writer takes them off, so the walk needs the lock just to read
+// the head; retired rings are drained one last time and go to the spares.
+static void drain_all(void) {
+    pthread_mutex_lock(&registry);
+    EvRing *r = live;
+    pthread_mutex_unlock(&registry);
+
+    int retired = 0;
+    for (; r; r = r->next) {
+        if (__atomic_load_n(&r->retired, __ATOMIC_ACQUIRE) == 1) {
+            __atomic_store_n(&r->retired, 2, __ATOMIC_RELAXED);
+            retired++;
+        }
+        ring_drain(r);
+    }
+
+    if (retired) {
+        pthread_mutex_lock(&registry);
+        for (EvRing **link = &live; *link;) {
+            EvRing *d = *link;
+            // a thread may be retiring another ring right now
+            if (__atomic_load_n(&d->retired, __ATOMIC_RELAXED) == 2) {
+                *link = d->next;
+                d->head = d->tail = 0;
+                d->next = spare;
+                spare = d;
+            } else {
+                link = &d->next;
+            }
+        }
+        pthread_mutex_unlock(&registry);
+    }
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    uint64_t last_sync = metrics_now();
+    int dirty = 0;
+    for (;;) {
+        pthread_mutex_lock(&writer_lock);
+        if (!stopping) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += DRAIN_MS * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&writer_wake, &writer_lock, &until);
+        }
+        int stop = stopping;
+        pthread_mutex_unlock(&writer_lock);
+
+        drain_all();
+        if (batch_len > 0) {
+            batch_write();
+            dirty = 1;
+        }
+        // what made it whole is synced before the writer gives up
+        if (log_failed) stop = 1;
+
+        // group commit: one fsync for everything written since the last
+        uint64_t now = metrics_now();
+        if (dirty && (stop || (log_sync_ms > 0 && now - last_sync >= (uint64_t)log_sync_ms * 1000000))) {
+            if (fdatasync(log_fd) < 0) perror("evlog fsync");
+            syncs++;
+            last_sync = now;
+            dirty = 0;
+        }
+        if (stop) break;
+        if (log_size >= EVLOG_SEGMENT) {
+            // the next sync is on the new segment's fd and would not cover this one
+            if (dirty) {
+                if (fdatasync(log_fd) < 0) perror("evlog fsync");
+                syncs++;
+                last_sync = metrics_now();
+                dirty = 0;
+            }
+            close(log_fd);
+            log_fd = -1;
+            log_segment++;
+            if (segment_open() < 0) {
+                perror("evlog segment");
+                __atomic_store_n(&evlog_on, 0, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+// sync_ms 0 leaves syncing to the kernel
+int evlog_start(const char *path, long sync_ms) {
+    log_path = path;
+    log_sync_ms = sync_ms;
+    batch = malloc(BATCH_BYTES);
+    if (!batch) return -1;
+    if (segment_open() < 0) {
+        int saved = errno;
+        free(batch);
+        batch = NULL;
+        errno = saved;
+        return -1;
+    }
+    // the writer never takes the shutdown signals
+    sigset_t block, old;
+    sigfillset(&block);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    int err = pthread_create(&writer, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        close(log_fd);
+        log_fd = -1;
+        free(batch);
+        batch = NULL;
+        errno = err;
+        return -1;
+    }
+    started = 1;
+    __atomic_store_n(&evlog_on, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// drains what is left, syncs and closes; threads still logging after
+// this are ignored
+void evlog_stop(void) {
+    if (!started) return;
+    started = 0;
+    __atomic_store_n(&evlog_on, 0, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&writer_lock);
+    stopping = 1;
+    pthread_cond_signal(&writer_wake);
+    pthread_mutex_unlock(&writer_lock);
+    pthread_join(writer, NULL);
+    if (log_fd >= 0) close(log_fd);
+    log_fd = -1;
+}
+
+void evlog_report(FILE *out) {
+    if (!log_path) return;
+    fprintf(out, "event log   %s.%06d  %llu bytes  %llu fsyncs\n", log_path, log_segment,
+            (unsigned long long)bytes_written, (unsigned long long)syncs);
+}
@@ -0,0 +1,52 @@
+#ifndef EVLOG_H
+#define EVLOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "game.h"
+
+// The game event log (--log PATH): OPEN, MATCH, MOVE, FAIL and OVER as
+// compact binary records. A thread appends to a ring of its own with no
+// lock and never waits; when the ring is full the event is dropped and
+// counted. A background writer drains every ring into the current segment
+// file with one O_APPEND write, and fsyncs once per --log-sync interval,
+// so one fsync commits whatever every game logged in that interval.
+//
+// Segments are PATH.000000, PATH.000001, ...: a new one at every start and
+// every EVLOG_SEGMENT bytes. Each opens with a 16 byte header, the magic
+// and the version as a uint32, then holds records back to back. Fields are
+// in host byte order. Records from one thread are in order; across threads
+// they may be out of order by up to one drain, and carry their time.
+
+#define EVLOG_MAGIC "NIMLOG1\n"
+#define EVLOG_VERSION 1
+#define EVLOG_HEADER 16
+#define EVLOG_SEGMENT (64L * 1024 * 1024)
+#define EVLOG_RECORD_MAX 256
+
+enum { EV_OPEN = 1, EV_MATCH, EV_MOVE, EV_FAIL, EV_OVER };
+
+// payloads: OPEN the name; MATCH the number of piles, the piles, then both
+// names each ending in NUL; MOVE none; FAIL the name (may be empty) ending
+// in NUL, then the reason; OVER the number of piles and the final piles
+typedef struct {
+    uint16_t size;      // the whole record, payload included
+    uint8_t type;
+    uint8_t player;     // 1 or 2 in a game, else 0
+    uint32_t arg;       // MOVE pile << 8 | count, FAIL its code, OVER winner | forfeit << 8
+    uint64_t time;      // CLOCK_REALTIME, ns
+    uint64_t game;      // the game's serial, 0 outside a game
+} EvRecord;
+
+extern int evlog_on;
+
+int evlog_start(const char *path, long sync_ms);
+void evlog_stop(void);
+void evlog_report(FILE *out);
+void evlog_open(const char *name);
+void evlog_match(const Game *g);
+void evlog_move(const Game *g, int player, int pile, int count);
+void evlog_fail(const Player *p, const char *reason);
+void evlog_over(const Game *g, int winner, int forfeit);
+
+#endif
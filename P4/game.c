@@ -0,0 +1,164 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "game.h"
+#include "metrics.h"
+
+GameChunk *game_table[GAME_CHUNKS];
+GameLayout game_layout = { 5, {1, 3, 5, 7, 9} };
+
+// rows are handed out in order as the Game pool grows, which already
+// holds the pool lock; table_lock only guards new chunks
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t table_rows = 0;
+static uint64_t serials = 0;
+
+static int game_init(void *obj) {
+    Game *g = obj;
+    pthread_mutex_lock(&table_lock);
+    uint32_t id = table_rows;
+    int chunk = id >> GAME_CHUNK_BITS;
+    if (chunk >= GAME_CHUNKS) {
+        pthread_mutex_unlock(&table_lock);
+        return -1;
+    }
+    if (!game_table[chunk]) {
+        void *mem;
+        if (posix_memalign(&mem, 64, sizeof(GameChunk)) != 0) {
+            pthread_mutex_unlock(&table_lock);
+            return -1;
+        }
+        memset(mem, 0, sizeof(GameChunk));
+        game_table[chunk] = mem;
+    }
+    table_rows++;
+    pthread_mutex_unlock(&table_lock);
+    g->id = id;
+    g->board = game_table[chunk]->piles[id & (GAME_CHUNK - 1)];
+    g->watchers = NULL;
+    g->watch_intro = NULL;
+    g->watch_deferred = 0;
+    return pthread_mutex_init(&g->watch_lock, NULL) == 0 ? 0 : -1;
+}
+
+Pool game_pool = POOL_INITIALIZER_INIT("game", Game, game_init);
+
+// "1,3,5,7,9": 1 to 16 piles of 1 to 255
+int game_parse_layout(const char *spec, GameLayout *layout) {
+    GameLayout l;
+    l.count = 0;
+    memset(l.piles, 0, sizeof(l.piles));
+    const char *s = spec;
+    for (;;) {
+        char *end;
+        long n = strtol(s, &end, 10);
+        if (end == s || n < 1 || n > 255 || l.count == GAME_MAX_PILES) return -1;
+        l.piles[l.count++] = n;
+        if (*end == '\0') break;
+        if (*end != ',') return -1;
+        s = end + 1;
+    }
+    *layout = l;
+    return 0;
+}
+
+void game_reset(Game *g, const GameLayout *layout) {
+    memcpy(g->board, layout->piles, GAME_MAX_PILES);
+    g->piles = layout->count;
+    g->turn = 1;
+}
+
+Game *game_create_layout(Player *p1, Player *p2, const GameLayout *layout) {
+    Game *g = pool_alloc(&game_pool);
+    if (!g) return NULL;
+    g->p1 = p1;
+    g->p2 = p2;
+    game_reset(g, layout);
+    p1->in_game = 1;
+    p2->in_game = 1;
+    g->started = metrics_now();
+    g->serial = __atomic_add_fetch(&serials, 1, __ATOMIC_RELAXED);
+    metrics_add(M_GAMES, 1);
+    metrics_add(M_ACTIVE_GAMES, 1);
+    return g;
+}
+
+Game *game_create(Player *p1, Player *p2) {
+    return game_create_layout(p1, p2, &game_layout);
+}
+
+// returns the game to the pool, leaving its players alone
+void game_free(Game *g) {
+    metrics_add(M_ACTIVE_GAMES, -1);
+    metrics_record(H_GAME, metrics_now() - g->started);
+    pool_free(&game_pool, g);
+}
+
+void game_destroy(Game *g) {
+    if (!g) return;
+    g->p1->in_game = 0;
+    g->p2->in_game = 0;
+    player_destroy(g->p1);
+    player_destroy(g->p2);
+
+    game_free(g);
+}
+
+// A move only ever touches one pile, so checking it is two byte compares.
+// The row is written back whole: game_over reads it as one vector right
+// after, and a wide load over a fresh byte store stalls store forwarding.
+int game_move(Game *g, int player_num, int pile, int count) {
+    if (player_num != g->turn) return 31;
+    if (pile < 0 || pile >= game_piles(g)) return 32;
+    uint8_t *board = game_board(g);
+    if (count <= 0 || count > board[pile]) return 33;
+#ifdef __SSE2__
+    static const uint8_t lanes[2 * GAME_MAX_PILES - 1] = { [GAME_MAX_PILES - 1] = 0xff };
+    __m128i lane = _mm_loadu_si128((const __m128i *)(lanes + GAME_MAX_PILES - 1 - pile));
+    __m128i take = _mm_and_si128(_mm_set1_epi8((char)count), lane);
+    __m128i row = _mm_load_si128((const __m128i *)board);
+    _mm_store_si128((__m128i *)board, _mm_sub_epi8(row, take));
+#else
+    board[pile] -= count;
+#endif
+    return 0;
+}
+
+// the whole row against zero at once
+int game_over(Game *g) {
+    const uint8_t *board = game_board(g);
+#ifdef __SSE2__
+    __m128i row = _mm_load_si128((const __m128i *)board);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(row, _mm_setzero_si128())) == 0xffff;
+#else
+    uint64_t lo, hi;
+    memcpy(&lo, board, 8);
+    memcpy(&hi, board + 8, 8);
+    return (lo | hi) == 0;
+#endif
+}
+
+uint64_t game_last_serial(void) {
+    return __atomic_load_n(&serials, __ATOMIC_RELAXED);
+}
+
+// games handed over from another process keep their serials, so new ones
+// start past them
+void game_serial_floor(uint64_t serial) {
+    uint64_t seen = __atomic_load_n(&serials, __ATOMIC_RELAXED);
+    while (seen < serial &&
+           !__atomic_compare_exchange_n(&serials, &seen, serial, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void game_table_report(FILE *out) {
+    pthread_mutex_lock(&table_lock);
+    long chunks = (table_rows + GAME_CHUNK - 1) >> GAME_CHUNK_BITS;
+    fprintf(out, "game table  rows %8u  chunks %4ld  %ld KB\n", table_rows, chunks,
+            chunks * (long)sizeof(GameChunk) / 1024);
+    pthread_mutex_unlock(&table_lock);
+}
@@ -0,0 +1,76 @@
+#ifndef GAME_H
+#define GAME_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "player.h"
+
+// Boards live apart from the Game, in a table of 16-byte rows: one byte
+// per pile, unused piles held at zero, so a whole board is one vector and
+// a million of them take 16 MB. Each Game owns its row for as long as
+// the Game pool has it, so making a game never touches the table.
+#define GAME_MAX_PILES 16
+#define GAME_CHUNK_BITS 12
+#define GAME_CHUNK (1 << GAME_CHUNK_BITS)
+#define GAME_CHUNKS 4096
+
+typedef struct {
+    uint8_t piles[GAME_CHUNK][GAME_MAX_PILES];
+} GameChunk;
+
+extern GameChunk *game_table[GAME_CHUNKS];
+
+typedef struct {
+    int count;
+    uint8_t piles[GAME_MAX_PILES];
+} GameLayout;
+
+// what game_create deals, 1 3 5 7 9 unless --piles says otherwise
+extern GameLayout game_layout;
+
+typedef struct Game {
+    Player *p1;
+    Player *p2;
+    int turn;
+    int piles;
+    // the game's row, which never moves; saves walking the table per move
+    uint8_t *board;
+    uint32_t id;
+    uint64_t started;
+    // numbers games for the event log, never reused unlike id
+    uint64_t serial;
+    // thread mode: lobby threads yet to let go of p1 and p2, see nimd.c
+    int handing;
+    // spectators, see watch.h. watch_lock is made with the Game and kept
+    // across reuse; the turn and board are what a new watcher is shown
+    pthread_mutex_t watch_lock;
+    struct Watcher *watchers;
+    struct WatchFrame *watch_intro;
+    int watch_turn;
+    int watch_deferred;
+    uint8_t watch_board[GAME_MAX_PILES];
+} Game;
+
+extern Pool game_pool;
+
+static inline uint8_t *game_board(const Game *g) {
+    return g->board;
+}
+
+static inline int game_piles(const Game *g) {
+    return g->piles;
+}
+
+int game_parse_layout(const char *spec, GameLayout *layout);
+Game *game_create(Player *p1, Player *p2);
+Game *game_create_layout(Player *p1, Player *p2, const GameLayout *layout);
+void game_reset(Game *g, const GameLayout *layout);
+void game_free(Game *g);
+void game_destroy(Game *g);
+int game_move(Game *g, int player_num, int pile, int count);
+int game_over(Game *g);
+void game_table_report(FILE *out);
+uint64_t game_last_serial(void);
+void game_serial_floor(uint64_t serial);
+
+#endif
@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include "handoff.h"
+
+// the wire side of the hot upgrade; what goes in the records is up to the
+// event loop, see reactor_hand_over and reactor_take_over
+
+#define HANDOFF_MAX_FDS 4
+
+static int handoff_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// neither side can hang the other: the old one has stopped serving
+// while it waits, the new one has not started
+static void handoff_timeouts(int sock) {
+    struct timeval tv = { HANDOFF_TIMEOUT_MS / 1000, HANDOFF_TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// replaces whatever is at path, which by now is the old process's socket
+// or a stale one; a non blocking listener, so the event loop can poll it
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_addr(path, &addr) < 0) return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// the connection to a server already at path, or -1 with errno ENOENT or
+// ECONNREFUSED when there is none and this one starts fresh
+int handoff_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_addr(path, &addr) < 0) return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    handoff_timeouts(fd);
+    return fd;
+}
+
+// the new process on the other end, or -1
+int handoff_accept(int listener) {
+    int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) return -1;
+    handoff_timeouts(fd);
+    return fd;
+}
+
+// the first record a new process gets: the old one's listener, and its
+// admin listener or -1
+int handoff_hello(int sock, HandoffHello *h, int *listener, int *admin) {
+    int fds[2], nfds;
+    int n = handoff_recv(sock, h, sizeof(*h), fds, 2, &nfds);
+    *listener = nfds > 0 ? fds[0] : -1;
+    *admin = nfds > 1 ? fds[1] : -1;
+    if (n == (int)sizeof(*h) && h->type == HANDOFF_HELLO && h->magic == HANDOFF_MAGIC &&
+        h->version == HANDOFF_VERSION && *listener >= 0)
+        return 0;
+    if (*listener >= 0) close(*listener);
+    if (*admin >= 0) close(*admin);
+    if (n >= 0) errno = EPROTO;
+    return -1;
+}
+
+// one record, with up to HANDOFF_MAX_FDS descriptors riding along
+int handoff_send(int sock, const void *buf, int len, const int *fds, int nfds) {
+    struct iovec iov = { (void *)buf, len };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (nfds > 0) {
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+    }
+    for (;;) {
+        ssize_t n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        return n == len ? 0 : -1;
+    }
+}
+
+// the next record into buf and its descriptors into fds; the record's
+// length, or -1 (a closed connection is EPIPE)
+int handoff_recv(int sock, void *buf, int cap, int *fds, int maxfds, int *nfds) {
+    struct iovec iov = { buf, cap };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    *nfds = 0;
+    // a failed recvmsg (the SO_RCVTIMEO's EAGAIN among them) leaves the
+    // control buffer as it was, uninitialized
+    if (n < 0) return -1;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (count > HANDOFF_MAX_FDS) count = HANDOFF_MAX_FDS;
+        // more than the caller asked for are closed rather than leaked
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + sizeof(int) * i, sizeof(int));
+            if (*nfds < maxfds) fds[(*nfds)++] = fd;
+            else close(fd);
+        }
+    }
+    if (n == 0) errno = EPIPE;
+    if (n <= 0) return -1;
+    if (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return n;
+}
+
+int handoff_send_type(int sock, uint32_t type) {
+    return handoff_send(sock, &type, sizeof(type), NULL, 0);
+}
+
+// 0 once a bare record of type arrives
+int handoff_expect(int sock, uint32_t type) {
+    uint32_t got;
+    int nfds;
+    if (handoff_recv(sock, &got, sizeof(got), NULL, 0, &nfds) != (int)sizeof(got)) return -1;
+    if (got != type) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
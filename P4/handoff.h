@@ -0,0 +1,89 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+#include "player.h"
+#include "game.h"
+
+// Hot upgrade (--handoff PATH). A running event loop listens on the unix
+// socket PATH; a new nimd started with the same PATH connects to it and
+// the old one hands over its listener and every live connection, fds
+// passed with SCM_RIGHTS, one message per record:
+//
+//   HELLO        with the listener, and the admin listener if there is one
+//   RATING ...   each rated name and its rating
+//   PLAYER ...   each lobby player, bucket by bucket in queue order
+//   OPENING and game records for everyone else: a GAME is followed by its
+//                player 1 and then its player 2, unless that is the house bot
+//   PLAYER ...   each spectator still following a game, named by the name
+//                it follows
+//   END
+//
+// A PLAYER's input not yet parsed into a frame travels with it, its
+// queued output follows in DATA messages. The new process answers END
+// with ACK once it holds everything, and only then does the old one let
+// go of its copies and exit; without an ACK the old one carries on.
+
+#define HANDOFF_MAGIC 0x4e494d48
+#define HANDOFF_VERSION 3
+// queued output goes over in pieces of at most this
+#define HANDOFF_CHUNK 16384
+// how long either side waits on the other before giving up
+#define HANDOFF_TIMEOUT_MS 5000
+
+enum { HANDOFF_HELLO = 1, HANDOFF_PLAYER, HANDOFF_GAME, HANDOFF_DATA, HANDOFF_END, HANDOFF_ACK, HANDOFF_RATING };
+
+typedef struct {
+    uint32_t type;
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    // the newest game serial, so the event log never sees one twice
+    uint64_t serial;
+    // what the admin listener serves, empty when there is none
+    char admin[128];
+} HandoffHello;
+
+typedef struct {
+    uint32_t type;
+    int32_t state;
+    int32_t binary;
+    int32_t has_opened;
+    int32_t player_number;
+    // time left on the player's deadline, -1 for none
+    int32_t timer_ms;
+    int32_t inbound;
+    int32_t outbound;
+    int32_t rating;
+    // how long a lobby player has waited, which its match window goes by
+    int32_t waited_ms;
+    char name[NAME_BUF];
+    // followed by the inbound bytes
+} HandoffPlayer;
+
+typedef struct {
+    uint32_t type;
+    int32_t turn;
+    int32_t piles;
+    int32_t bot;
+    uint8_t board[GAME_MAX_PILES];
+    uint64_t started;
+    uint64_t serial;
+} HandoffGame;
+
+typedef struct {
+    uint32_t type;
+    int32_t rating;
+    char name[NAME_BUF];
+} HandoffRating;
+
+int handoff_listen(const char *path);
+int handoff_connect(const char *path);
+int handoff_accept(int listener);
+int handoff_hello(int sock, HandoffHello *h, int *listener, int *admin);
+int handoff_send(int sock, const void *buf, int len, const int *fds, int nfds);
+int handoff_recv(int sock, void *buf, int cap, int *fds, int maxfds, int *nfds);
+int handoff_send_type(int sock, uint32_t type);
+int handoff_expect(int sock, uint32_t type);
+
+#endif
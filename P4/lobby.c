@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lobby.h"
+#include "metrics.h"
+
+// callers hold queue_mutex unless the lobby is owned by a single thread
+
+int lobby_window_base = 50;
+int lobby_window_growth = 100;
+
+// capacity caps the number of opened players, 0 means no limit
+int lobby_init(Lobby *l, int capacity) {
+    memset(l->bucket, 0, sizeof(l->bucket));
+    memset(l->occupied, 0, sizeof(l->occupied));
+    l->waiting = 0;
+    l->count = 0;
+    l->capacity = capacity;
+    pthread_mutex_init(&l->queue_mutex, NULL);
+    return 0;
+}
+
+void lobby_free(Lobby *l) {
+    memset(l->bucket, 0, sizeof(l->bucket));
+    memset(l->occupied, 0, sizeof(l->occupied));
+    l->waiting = 0;
+    l->count = 0;
+    pthread_mutex_destroy(&l->queue_mutex);
+}
+
+// ratings past either end share the end buckets
+static int bucket_of(int rating) {
+    int b = rating / LOBBY_BUCKET_WIDTH;
+    if (b < 0) return 0;
+    return b < LOBBY_BUCKETS ? b : LOBBY_BUCKETS - 1;
+}
+
+// the nearest occupied bucket at or above b, or -1
+static int occupied_above(const Lobby *l, int b) {
+    while (b < LOBBY_BUCKETS) {
+        uint64_t bits = l->occupied[b / 64] >> (b % 64);
+        if (bits) return b + __builtin_ctzll(bits);
+        b = (b / 64 + 1) * 64;
+    }
+    return -1;
+}
+
+// the nearest occupied bucket at or below b, or -1
+static int occupied_below(const Lobby *l, int b) {
+    while (b >= 0) {
+        uint64_t bits = l->occupied[b / 64] << (63 - b % 64);
+        if (bits) return b - __builtin_clzll(bits);
+        b = b / 64 * 64 - 1;
+    }
+    return -1;
+}
+
+static void queue_unlink(Lobby *l, Player *p) {
+    int b = bucket_of(p->rating);
+    LobbyBucket *q = &l->bucket[b];
+    if (p->lobby_prev) p->lobby_prev->lobby_next = p->lobby_next;
+    else q->head = p->lobby_next;
+    if (p->lobby_next) p->lobby_next->lobby_prev = p->lobby_prev;
+    else q->tail = p->lobby_prev;
+    if (!q->head) l->occupied[b / 64] &= ~(1ULL << (b % 64));
+    p->lobby_prev = p->lobby_next = NULL;
+    p->queued = 0;
+    l->waiting--;
+    metrics_add(M_LOBBY_WAITING, -1);
+}
+
+// registers p and puts it at the back of its rating's bucket, waiting
+// since now
+int lobby_add(Lobby *l, Player *p, uint64_t now) {
+    if (l->capacity > 0 && l->count >= l->capacity) return -1;
+
+    p->registered = 1;
+    l->count++;
+
+    int b = bucket_of(p->rating);
+    LobbyBucket *q = &l->bucket[b];
+    p->lobby_next = NULL;
+    p->lobby_prev = q->tail;
+    if (q->tail) q->tail->lobby_next = p;
+    else q->head = p;
+    q->tail = p;
+    l->occupied[b / 64] |= 1ULL << (b % 64);
+    p->queued = 1;
+    p->queued_at = now;
+    l->waiting++;
+    metrics_add(M_LOBBY_WAITING, 1);
+    return 0;
+}
+
+// how far apart two ratings may be once one player has waited this long
+long lobby_window(uint64_t waited_ms) {
+    return lobby_window_base + (long)(waited_ms * lobby_window_growth / 1000);
+}
+
+static uint64_t waited(const Player *p, uint64_t now) {
+    return now > p->queued_at ? now - p->queued_at : 0;
+}
+
+// a and b may meet: the longer of them has waited long enough for the gap
+static int fits(const Player *a, const Player *b, uint64_t now) {
+    uint64_t longest = a->queued_at < b->queued_at ? waited(a, now) : waited(b, now);
+    return abs(a->rating - b->rating) <= lobby_window(longest);
+}
+
+// p and the nearest player in rating it may meet now, looking no further
+// than reach buckets either side
+static int match(Lobby *l, Player *p, uint64_t now, int reach, Player **p1, Player **p2) {
+    if (!p->queued || l->waiting < 2) return 0;
+    int home = bucket_of(p->rating);
+    // in p's own bucket the head, or who came after p when that is p
+    Player *c = l->bucket[home].head == p ? p->lobby_next : l->bucket[home].head;
+    Player *found = c && fits(p, c, now) ? c : NULL;
+    int lo = occupied_below(l, home - 1);
+    int hi = occupied_above(l, home + 1);
+    if (lo >= 0 && home - lo > reach) lo = -1;
+    if (hi >= 0 && hi - home > reach) hi = -1;
+    while (!found && (lo >= 0 || hi >= 0)) {
+        int b;
+        if (hi < 0 || (lo >= 0 && home - lo <= hi - home)) {
+            b = lo;
+            lo = occupied_below(l, lo - 1);
+            if (lo >= 0 && home - lo > reach) lo = -1;
+        } else {
+            b = hi;
+            hi = occupied_above(l, hi + 1);
+            if (hi >= 0 && hi - home > reach) hi = -1;
+        }
+        if (fits(p, l->bucket[b].head, now)) found = l->bucket[b].head;
+    }
+    if (!found) return 0;
+
+    int first = found->queued_at <= p->queued_at;
+    *p1 = first ? found : p;
+    *p2 = first ? p : found;
+    metrics_record(H_MATCH_WAIT, waited(*p1, now) * 1000000);
+    metrics_record(H_MATCH_WAIT, waited(*p2, now) * 1000000);
+    queue_unlink(l, found);
+    queue_unlink(l, p);
+    return 1;
+}
+
+// takes p, which is waiting, and the nearest player in rating it may meet
+// now, if there is one; whoever waited longer is player 1. They stay
+// registered. Every bucket is looked at, since someone who has waited
+// long may reach p from far off.
+int lobby_match(Lobby *l, Player *p, uint64_t now, Player **p1, Player **p2) {
+    return match(l, p, now, LOBBY_BUCKETS, p1, p2);
+}
+
+// tries every bucket's head again, for windows that have widened since it
+// joined; fn gets each pair with the lobby still held. The matches made.
+// Each head only looks as far as its own window: of two heads that may
+// meet, the one with the wider window finds the other.
+int lobby_sweep(Lobby *l, uint64_t now, LobbyMatchFn fn, void *ctx) {
+    int matches = 0;
+    for (int b = occupied_above(l, 0); b >= 0 && l->waiting >= 2; b = occupied_above(l, b + 1)) {
+        Player *p1, *p2, *h;
+        while ((h = l->bucket[b].head) &&
+               match(l, h, now, lobby_window(waited(h, now)) / LOBBY_BUCKET_WIDTH + 1, &p1, &p2)) {
+            fn(ctx, p1, p2);
+            matches++;
+        }
+    }
+    return matches;
+}
+
+// takes p out of the queue on its own, for a match made outside the
+// lobby; it stays registered
+int lobby_take(Lobby *l, Player *p) {
+    if (!p->queued) return -1;
+    queue_unlink(l, p);
+    return 0;
+}
+
+void remove_player(Lobby *l, Player *p) {
+    if (p->queued) queue_unlink(l, p);
+    if (!p->registered) return;
+    p->registered = 0;
+    l->count--;
+}
+
+// takes queue_mutex, timing how long that took; an uncontended lock is
+// recorded as no wait without reading the clock
+void lobby_lock(Lobby *l) {
+    if (pthread_mutex_trylock(&l->queue_mutex) == 0) {
+        metrics_record(H_LOBBY_LOCK, 0);
+        return;
+    }
+    uint64_t start = metrics_now();
+    pthread_mutex_lock(&l->queue_mutex);
+    metrics_record(H_LOBBY_LOCK, metrics_now() - start);
+}
+
+// 0 if the lock was free and is now held
+int lobby_trylock(Lobby *l) {
+    if (pthread_mutex_trylock(&l->queue_mutex) != 0) return -1;
+    metrics_record(H_LOBBY_LOCK, 0);
+    return 0;
+}
+
+void lobby_unlock(Lobby *l) {
+    pthread_mutex_unlock(&l->queue_mutex);
+}
@@ -0,0 +1,57 @@
+#ifndef LOBBY_H
+#define LOBBY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "player.h"
+
+// Players waiting for an opponent sit in a rating index: one intrusive
+// FIFO per LOBBY_BUCKET_WIDTH points of rating, threaded through the
+// Player itself, and a bitmap of the buckets that hold anyone. Two players
+// may meet when their ratings are within the wider of their two windows,
+// and a window widens the longer its player waits (see lobby_window). A
+// match only looks at the head of each occupied bucket, nearest first:
+// the head has waited longest there, so has the widest window of it.
+// Joining and leaving are O(1) and a match costs at most one look per
+// bucket, however many are waiting. count is every opened player, waiting
+// or in a game. Name uniqueness lives in names.c, ratings in rating.c.
+
+#define LOBBY_BUCKETS 128
+#define LOBBY_BUCKET_WIDTH 25
+// how often waiting players are tried again as their windows widen
+#define LOBBY_RETRY_MS 250
+
+typedef struct {
+    Player *head;
+    Player *tail;
+} LobbyBucket;
+
+typedef struct {
+    LobbyBucket bucket[LOBBY_BUCKETS];
+    uint64_t occupied[LOBBY_BUCKETS / 64];
+    int waiting;
+    int count;
+    int capacity;
+    pthread_mutex_t queue_mutex;
+} Lobby;
+
+// a window is lobby_window_base rating points on joining and grows by
+// lobby_window_growth points a second, see --match-window
+extern int lobby_window_base;
+extern int lobby_window_growth;
+
+typedef void (*LobbyMatchFn)(void *ctx, Player *p1, Player *p2);
+
+int lobby_init(Lobby *l, int capacity);
+void lobby_free(Lobby *l);
+int lobby_add(Lobby *l, Player *p, uint64_t now);
+long lobby_window(uint64_t waited_ms);
+int lobby_match(Lobby *l, Player *p, uint64_t now, Player **p1, Player **p2);
+int lobby_sweep(Lobby *l, uint64_t now, LobbyMatchFn fn, void *ctx);
+int lobby_take(Lobby *l, Player *p);
+void remove_player(Lobby *l, Player *p);
+void lobby_lock(Lobby *l);
+int lobby_trylock(Lobby *l);
+void lobby_unlock(Lobby *l);
+
+#endif
@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "metrics.h"
+
+__thread MetricsShard *metrics_local;
+
+// live shards belong to running threads; a thread that exits folds its
+// shard into retired and leaves it on the spare list for the next one
+static pthread_mutex_t registry = PTHREAD_MUTEX_INITIALIZER;
+static MetricsShard *live;
+static MetricsShard *spare;
+static MetricsShard retired;
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+
+static int admin_fd = -1;
+static char admin_path[108];
+static char admin_spec[128];
+
+static const char *fail_codes[] = {
+    "10", "21", "22", "23", "24", "25", "31", "32", "33", "other"
+};
+
+static void shard_fold(MetricsShard *into, const MetricsShard *s) {
+    for (int i = 0; i < M_COUNTERS; i++)
+        into->counters[i] += __atomic_load_n(&s->counters[i], __ATOMIC_RELAXED);
+    for (int h = 0; h < M_HISTOGRAMS; h++) {
+        const Histogram *from = &s->hist[h];
+        Histogram *to = &into->hist[h];
+        for (int i = 0; i < M_BUCKETS; i++)
+            to->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+        to->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+        to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+        int64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+        if (max > to->max) to->max = max;
+    }
+}
+
+static void shard_retire(void *arg) {
+    MetricsShard *s = arg;
+    pthread_mutex_lock(&registry);
+    MetricsShard **link = &live;
+    while (*link != s) link = &(*link)->next;
+    *link = s->next;
+    shard_fold(&retired, s);
+    memset(s, 0, sizeof(*s));
+    s->next = spare;
+    spare = s;
+    pthread_mutex_unlock(&registry);
+}
+
+static void shard_key_init(void) {
+    pthread_key_create(&shard_key, shard_retire);
+}
+
+// first event on a thread: give it a shard
+MetricsShard *metrics_attach(void) {
+    pthread_once(&shard_once, shard_key_init);
+    pthread_mutex_lock(&registry);
+    MetricsShard *s = spare;
+    if (s) spare = s->next;
+    else s = calloc(1, sizeof(MetricsShard));
+    if (s) {
+        s->next = live;
+        live = s;
+    }
+    pthread_mutex_unlock(&registry);
+    if (!s) {
+        // out of memory, count into a shared throwaway shard rather than crash
+        static MetricsShard lost;
+        s = &lost;
+    } else {
+        pthread_setspecific(shard_key, s);
+    }
+    metrics_local = s;
+    return s;
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t v) {
+    if (v < 32) return v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - 4;
+    int i = 32 + (shift - 1) * 16 + (int)((v >> shift) - 16);
+    return i < M_BUCKETS ? i : M_BUCKETS - 1;
+}
+
+// largest value that lands in bucket i
+static uint64_t bucket_top(int i) {
+    if (i < 32) return i;
+    int shift = (i - 32) / 16 + 1;
+    uint64_t m = (i - 32) % 16 + 16;
+    return ((m + 1) << shift) - 1;
+}
+
+void metrics_record(int hist, uint64_t ns) {
+    MetricsShard *s = metrics_local ? metrics_local : metrics_attach();
+    Histogram *h = &s->hist[hist];
+    int i = bucket_of(ns);
+    __atomic_store_n(&h->counts[i], h->counts[i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + (int64_t)ns, __ATOMIC_RELAXED);
+    if ((int64_t)ns > h->max) __atomic_store_n(&h->max, (int64_t)ns, __ATOMIC_RELAXED);
+}
+
+// counts a FAIL by the code its reason starts with
+void metrics_fail(const char *reason) {
+    int id;
+    switch (atoi(reason)) {
+    case 10: id = M_FAIL_10; break;
+    case 21: id = M_FAIL_21; break;
+    case 22: id = M_FAIL_22; break;
+    case 23: id = M_FAIL_23; break;
+    case 24: id = M_FAIL_24; break;
+    case 25: id = M_FAIL_25; break;
+    case 31: id = M_FAIL_31; break;
+    case 32: id = M_FAIL_32; break;
+    case 33: id = M_FAIL_33; break;
+    default: id = M_FAIL_OTHER; break;
+    }
+    metrics_add(id, 1);
+}
+
+static uint64_t quantile(const Histogram *h, double q) {
+    if (h->total == 0) return 0;
+    int64_t want = (int64_t)(q * h->total + 0.5);
+    if (want < 1) want = 1;
+    int64_t seen = 0;
+    for (int i = 0; i < M_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want) return bucket_top(i) < (uint64_t)h->max ? bucket_top(i) : (uint64_t)h->max;
+    }
+    return h->max;
+}
+
+static void write_counter(FILE *out, const char *name, const char *help, int64_t v) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lld\n", name, help, name, name, (long long)v);
+}
+
+static void write_gauge(FILE *out, const char *name, const char *help, int64_t v) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", name, help, name, name, (long long)v);
+}
+
+static void write_summary(FILE *out, const char *name, const char *help, const Histogram *h) {
+    static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+    fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    for (int i = 0; i < 4; i++)
+        fprintf(out, "%s{quantile=\"%g\"} %.9f\n", name, qs[i], quantile(h, qs[i]) / 1e9);
+    fprintf(out, "%s_sum %.9f\n%s_count %lld\n%s_max %.9f\n", name, h->sum / 1e9,
+            name, (long long)h->total, name, h->max / 1e9);
+}
+
+// Prometheus text format
+void metrics_write(FILE *out) {
+    MetricsShard *t = calloc(1, sizeof(MetricsShard));
+    if (!t) return;
+    pthread_mutex_lock(&registry);
+    shard_fold(t, &retired);
+    for (MetricsShard *s = live; s; s = s->next) shard_fold(t, s);
+    pthread_mutex_unlock(&registry);
+
+    write_counter(out, "nimd_connections_total", "Connections accepted.", t->counters[M_CONNECTIONS]);
+    write_counter(out, "nimd_opens_total", "Valid OPEN messages.", t->counters[M_OPENS]);
+    write_counter(out, "nimd_waits_total", "WAIT messages sent.", t->counters[M_WAITS]);
+    fprintf(out, "# HELP nimd_fails_total FAIL messages sent, by code.\n# TYPE nimd_fails_total counter\n");
+    for (int i = M_FAIL_10; i <= M_FAIL_OTHER; i++)
+        fprintf(out, "nimd_fails_total{code=\"%s\"} %lld\n", fail_codes[i - M_FAIL_10],
+                (long long)t->counters[i]);
+    write_counter(out, "nimd_games_total", "Games started.", t->counters[M_GAMES]);
+    write_counter(out, "nimd_forfeits_total", "Games ended by forfeit.", t->counters[M_FORFEITS]);
+    write_counter(out, "nimd_moves_total", "Valid moves played.", t->counters[M_MOVES]);
+    write_counter(out, "nimd_bot_games_total", "Games against the house bot.", t->counters[M_BOT_GAMES]);
+    write_counter(out, "nimd_slow_consumers_total", "Connections cut off at the outbound high-water mark.",
+                  t->counters[M_SLOW_CONSUMERS]);
+    write_counter(out, "nimd_log_events_total", "Events written to the event log.", t->counters[M_LOG_EVENTS]);
+    write_counter(out, "nimd_log_dropped_total", "Events dropped on a full event log ring.",
+                  t->counters[M_LOG_DROPS]);
+    write_counter(out, "nimd_slow_watchers_total", "Spectators cut off for falling behind their game.",
+                  t->counters[M_SLOW_WATCHERS]);
+    write_gauge(out, "nimd_active_games", "Games in progress.", t->counters[M_ACTIVE_GAMES]);
+    write_gauge(out, "nimd_lobby_waiting", "Players queued for an opponent.", t->counters[M_LOBBY_WAITING]);
+    write_gauge(out, "nimd_watchers", "Spectators following a game.", t->counters[M_WATCHERS]);
+    write_summary(out, "nimd_lobby_lock_wait_seconds", "Time spent acquiring the lobby lock.",
+                  &t->hist[H_LOBBY_LOCK]);
+    write_summary(out, "nimd_move_seconds", "Server time to handle a move.", &t->hist[H_MOVE]);
+    write_summary(out, "nimd_game_duration_seconds", "Game length, start to end.", &t->hist[H_GAME]);
+    write_summary(out, "nimd_lobby_match_wait_seconds", "Time from joining the lobby to being matched.",
+                  &t->hist[H_MATCH_WAIT]);
+    free(t);
+}
+
+// answers one scrape; a request starting with GET gets an HTTP reply,
+// anything else (or nothing within 200ms) just gets the text
+static void admin_reply(int fd) {
+    struct timeval tv = { 0, 200000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char req[1024];
+    int n = read(fd, req, sizeof(req));
+    int http = n >= 4 && memcmp(req, "GET ", 4) == 0;
+
+    char *body = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&body, &len);
+    if (!out) return;
+    metrics_write(out);
+    fclose(out);
+
+    if (http) {
+        char head[128];
+        int hl = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+                          "version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+        if (write(fd, head, hl) < 0) perror("admin write");
+    }
+    for (size_t off = 0; off < len;) {
+        ssize_t w = write(fd, body + off, len - off);
+        if (w <= 0) break;
+        off += w;
+    }
+    free(body);
+}
+
+static void *admin_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        int fd = accept(admin_fd, NULL, NULL);
+        if (fd < 0) {
+            // out of descriptors, most likely: back off rather than spin
+            if (errno != EINTR && errno != ECONNABORTED) poll(NULL, 0, 10);
+            continue;
+        }
+        admin_reply(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int admin_start(const char *spec) {
+    snprintf(admin_spec, sizeof(admin_spec), "%s", spec);
+    // the admin thread never takes the shutdown signals
+    sigset_t block, old;
+    sigfillset(&block);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, admin_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+// a listener that could not be set up is closed; errno is the failure's
+static int admin_abandon(void) {
+    int err = errno;
+    close(admin_fd);
+    admin_fd = -1;
+    errno = err;
+    return -1;
+}
+
+// spec is a port, served on 127.0.0.1 only, or unix:/path
+int metrics_serve(const char *spec) {
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(spec + 5) >= sizeof(addr.sun_path)) return -1;
+        strcpy(addr.sun_path, spec + 5);
+        admin_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (admin_fd < 0) return -1;
+        unlink(addr.sun_path);
+        if (bind(admin_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) return admin_abandon();
+        strcpy(admin_path, addr.sun_path);
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(spec));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        admin_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (admin_fd < 0) return -1;
+        int opt = 1;
+        setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (bind(admin_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) return admin_abandon();
+    }
+    if (listen(admin_fd, 16) < 0) return admin_abandon();
+    return admin_start(spec);
+}
+
+// serves spec on a listener a previous process handed over
+int metrics_adopt(int fd, const char *spec) {
+    admin_fd = fd;
+    if (strncmp(spec, "unix:", 5) == 0) snprintf(admin_path, sizeof(admin_path), "%s", spec + 5);
+    return admin_start(spec);
+}
+
+// the admin listener and what it serves, -1 when there is none
+int metrics_listener(const char **spec) {
+    *spec = admin_spec;
+    return admin_fd;
+}
+
+void metrics_close(void) {
+    if (admin_path[0]) unlink(admin_path);
+}
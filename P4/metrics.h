@@ -0,0 +1,82 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Server metrics. Every thread writes its own shard of counters and
+// histograms with plain relaxed stores, so recording an event takes no
+// lock and no atomic read-modify-write; a scrape sums the shards of live
+// threads plus whatever exited threads left behind.
+
+enum {
+    M_CONNECTIONS,
+    M_OPENS,
+    M_WAITS,
+    M_FAIL_10,
+    M_FAIL_21,
+    M_FAIL_22,
+    M_FAIL_23,
+    M_FAIL_24,
+    M_FAIL_25,
+    M_FAIL_31,
+    M_FAIL_32,
+    M_FAIL_33,
+    M_FAIL_OTHER,
+    M_GAMES,
+    M_FORFEITS,
+    M_MOVES,
+    M_BOT_GAMES,
+    M_SLOW_CONSUMERS,
+    M_LOG_EVENTS,
+    M_LOG_DROPS,
+    M_SLOW_WATCHERS,
+    // gauges, kept as sums of per-thread deltas
+    M_ACTIVE_GAMES,
+    M_LOBBY_WAITING,
+    M_WATCHERS,
+    M_COUNTERS
+};
+
+enum {
+    H_LOBBY_LOCK,
+    H_MOVE,
+    H_GAME,
+    H_MATCH_WAIT,
+    M_HISTOGRAMS
+};
+
+// log-linear buckets of nanoseconds: exact below 32, then 16 per power of two
+#define M_BUCKETS 640
+
+typedef struct {
+    int64_t counts[M_BUCKETS];
+    int64_t total;
+    int64_t sum;
+    int64_t max;
+} Histogram;
+
+typedef struct MetricsShard {
+    int64_t counters[M_COUNTERS];
+    Histogram hist[M_HISTOGRAMS];
+    struct MetricsShard *next;
+} MetricsShard;
+
+extern __thread MetricsShard *metrics_local;
+
+MetricsShard *metrics_attach(void);
+uint64_t metrics_now(void);
+void metrics_record(int hist, uint64_t ns);
+void metrics_fail(const char *reason);
+void metrics_write(FILE *out);
+int metrics_serve(const char *spec);
+int metrics_adopt(int fd, const char *spec);
+int metrics_listener(const char **spec);
+void metrics_close(void);
+
+static inline void metrics_add(int id, long n) {
+    MetricsShard *s = metrics_local ? metrics_local : metrics_attach();
+    __atomic_store_n(&s->counters[id], s->counters[id] + n, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "names.h"
+#include "strtab.h"
+
+#define NAME_SHARDS 64
+#define CHUNK_SIZE 16384
+#define CLASS_SIZE 16
+#define CLASSES 8
+
+typedef struct Name {
+    StrNode node;
+    // what names_bind attached, the game a player is in
+    void *owner;
+    char str[];
+} Name;
+
+// arena, one per shard and under its lock: bump allocation out of the
+// current chunk, and released entries are kept per size class for the
+// next name of that size
+typedef struct {
+    char *chunk;
+    size_t used;
+    Name *free_list[CLASSES];
+} NameArena;
+
+static StrTable table;
+static NameArena arenas[NAME_SHARDS];
+static pthread_once_t names_once = PTHREAD_ONCE_INIT;
+
+static void names_init(void) {
+    if (strtab_init(&table, NAME_SHARDS) < 0) abort();
+    for (int i = 0; i < NAME_SHARDS; i++) arenas[i].used = CHUNK_SIZE;
+}
+
+static int size_class(size_t len) {
+    return (offsetof(Name, str) + len + 1 + CLASS_SIZE - 1) / CLASS_SIZE - 1;
+}
+
+static Name *arena_alloc(NameArena *a, size_t len) {
+    int c = size_class(len);
+    if (c < CLASSES && a->free_list[c]) {
+        Name *n = a->free_list[c];
+        a->free_list[c] = (Name *)n->node.next;
+        return n;
+    }
+
+    size_t size = (size_t)(c + 1) * CLASS_SIZE;
+    if (a->used + size > CHUNK_SIZE) {
+        // old chunks are never returned, their entries recycle through the free lists
+        a->chunk = malloc(CHUNK_SIZE);
+        if (!a->chunk) return NULL;
+        a->used = 0;
+    }
+    Name *n = (Name *)(a->chunk + a->used);
+    a->used += size;
+    return n;
+}
+
+// returns the interned copy, or NULL if the name is already in use
+const char *names_claim(const char *name) {
+    pthread_once(&names_once, names_init);
+    size_t len = strlen(name);
+    uint32_t h = strtab_hash(name, len);
+    StrShard *s = strtab_shard(&table, h);
+
+    pthread_mutex_lock(&s->lock);
+    if (strtab_find(&table, s, name, len, h)) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+
+    if (size_class(len) >= CLASSES) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+    Name *n = arena_alloc(&arenas[s - table.shards], len);
+    if (!n) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+    n->node.str = n->str;
+    n->node.hash = h;
+    n->node.len = len;
+    n->owner = NULL;
+    memcpy(n->str, name, len + 1);
+    strtab_insert(&table, s, &n->node);
+    pthread_mutex_unlock(&s->lock);
+    return n->str;
+}
+
+void names_release(const char *name) {
+    if (!name) return;
+    Name *n = (Name *)(name - offsetof(Name, str));
+    StrShard *s = strtab_shard(&table, n->node.hash);
+
+    pthread_mutex_lock(&s->lock);
+    strtab_remove(&table, s, &n->node);
+    NameArena *a = &arenas[s - table.shards];
+    int c = size_class(n->node.len);
+    n->node.next = (StrNode *)a->free_list[c];
+    a->free_list[c] = n;
+    pthread_mutex_unlock(&s->lock);
+}
+
+// attaches owner to a claimed name, NULL detaches; names_visit sees it
+// under the same lock, so once this returns no visit holds the old one
+void names_bind(const char *name, void *owner) {
+    Name *n = (Name *)(name - offsetof(Name, str));
+    StrShard *s = strtab_shard(&table, n->node.hash);
+    pthread_mutex_lock(&s->lock);
+    n->owner = owner;
+    pthread_mutex_unlock(&s->lock);
+}
+
+// calls fn with the owner bound to name, the shard still locked so the
+// owner cannot be unbound meanwhile; -1 when the name has none
+int names_visit(const char *name, int (*fn)(void *owner, void *arg), void *arg) {
+    pthread_once(&names_once, names_init);
+    size_t len = strlen(name);
+    uint32_t h = strtab_hash(name, len);
+    StrShard *s = strtab_shard(&table, h);
+    pthread_mutex_lock(&s->lock);
+    Name *n = (Name *)strtab_find(&table, s, name, len, h);
+    int rc = n && n->owner ? fn(n->owner, arg) : -1;
+    pthread_mutex_unlock(&s->lock);
+    return rc;
+}
+
+long names_active(void) {
+    pthread_once(&names_once, names_init);
+    long total = 0;
+    for (int i = 0; i < NAME_SHARDS; i++) {
+        StrShard *s = &table.shards[i];
+        pthread_mutex_lock(&s->lock);
+        total += s->count;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return total;
+}
@@ -0,0 +1,19 @@
+#ifndef NAMES_H
+#define NAMES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Server wide set of names in use, by lobby and in-game players alike.
+// It is a table of independently locked shards (strtab.h), and each name
+// is interned once into its shard's arena; the returned pointer stays
+// valid until names_release. A claimed name can have an owner bound to it, which is
+// how WATC finds the game a name is playing.
+
+const char *names_claim(const char *name);
+void names_release(const char *name);
+void names_bind(const char *name, void *owner);
+int names_visit(const char *name, int (*fn)(void *owner, void *arg), void *arg);
+long names_active(void);
+
+#endif
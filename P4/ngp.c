@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "ngp.h"
+
+// Every board reachable from 1 3 5 7 9 has one digit per pile, so its PLAY
+// frame is always 22 bytes. They are built once as the frame for turn 1 and
+// the turn digit is patched on the way out; OVER reuses the board text.
+// Boards of any other layout are written out as they come.
+#define PLAY_LEN 22
+#define PLAY_TURN 10
+#define PLAY_BOARD 12
+#define BOARD_LEN 9
+
+static const int layout[5] = {1, 3, 5, 7, 9};
+static char play_frames[NGP_BOARDS][24];
+static pthread_once_t play_once = PTHREAD_ONCE_INIT;
+static int play_ready = 0;
+
+int ngp_board_index(const uint8_t *board, int piles) {
+    if (piles != 5) return -1;
+    int idx = 0;
+    for (int i = 4; i >= 0; i--) {
+        if (board[i] > layout[i]) return -1;
+        idx = idx * (layout[i] + 1) + board[i];
+    }
+    return idx;
+}
+
+void ngp_board_at(int idx, uint8_t *board) {
+    for (int i = 0; i < 5; i++) {
+        board[i] = idx % (layout[i] + 1);
+        idx /= layout[i] + 1;
+    }
+}
+
+static void build_play_frames(void) {
+    uint8_t b[5];
+    for (int idx = 0; idx < NGP_BOARDS; idx++) {
+        ngp_board_at(idx, b);
+        // one digit per pile, each followed by a space or the closing bar
+        char *f = play_frames[idx];
+        memcpy(f, "0|17|PLAY|1|", PLAY_BOARD);
+        for (int i = 0; i < 5; i++) {
+            f[PLAY_BOARD + 2 * i] = '0' + b[i];
+            f[PLAY_BOARD + 2 * i + 1] = i < 4 ? ' ' : '|';
+        }
+        f[PLAY_LEN] = '\0';
+    }
+    play_ready = 1;
+}
+
+void ngp_init(void) {
+    pthread_once(&play_once, build_play_frames);
+}
+
+// the index into play_frames, or -1 if the board is off the table
+static int play_index(const uint8_t *board, int piles) {
+    if (!play_ready) return -1;
+    return ngp_board_index(board, piles);
+}
+
+// "p0 p1 ...", for boards off the table
+static void board_text(char *s, const uint8_t *board, int piles) {
+    for (int i = 0; i < piles; i++) s += sprintf(s, i ? " %d" : "%d", board[i]);
+    *s = '\0';
+}
+
+int ngp_encode(char *buf, const char *type, const char *const fields[], int count) {
+    char *s = buf + 5;
+    size_t tl = strlen(type);
+    memcpy(s, type, tl);
+    s += tl;
+    *s++ = '|';
+
+    // fields that would push the body past two length digits are dropped
+    for (int i = 0; i < count; i++) {
+        size_t fl = strlen(fields[i]);
+        if ((size_t)(s - buf - 5) + fl + 1 > 99)
+            break;
+        memcpy(s, fields[i], fl);
+        s += fl;
+        *s++ = '|';
+    }
+
+    int body = s - buf - 5;
+    buf[0] = '0';
+    buf[1] = '|';
+    buf[2] = '0' + body / 10;
+    buf[3] = '0' + body % 10;
+    buf[4] = '|';
+    *s = '\0';
+    return s - buf;
+}
+
+int ngp_wait(char *buf) {
+    memcpy(buf, "0|05|WAIT|", 11);
+    return 10;
+}
+
+int ngp_fail(char *buf, const char *reason) {
+    const char *fields[1] = {reason};
+    return ngp_encode(buf, "FAIL", fields, 1);
+}
+
+int ngp_name(char *buf, int number, const char *name) {
+    char num[2] = {'0' + number, '\0'};
+    const char *fields[2] = {num, name};
+    return ngp_encode(buf, "NAME", fields, 2);
+}
+
+int ngp_play(char *buf, int turn, const uint8_t *board, int piles) {
+    int idx = play_index(board, piles);
+    if (idx >= 0) {
+        memcpy(buf, play_frames[idx], PLAY_LEN + 1);
+        buf[PLAY_TURN] = '0' + turn;
+        return PLAY_LEN;
+    }
+
+    char num[2] = {'0' + turn, '\0'};
+    char state[64];
+    board_text(state, board, piles);
+    const char *fields[2] = {num, state};
+    return ngp_encode(buf, "PLAY", fields, 2);
+}
+
+int ngp_over(char *buf, int winner, const uint8_t *board, int piles, int forfeit) {
+    char num[2] = {'0' + winner, '\0'};
+    char state[64];
+    int idx = play_index(board, piles);
+    if (idx >= 0) {
+        memcpy(state, play_frames[idx] + PLAY_BOARD, BOARD_LEN);
+        state[BOARD_LEN] = '\0';
+    } else {
+        board_text(state, board, piles);
+    }
+    const char *fields[3] = {num, state, forfeit ? "Forfeit" : ""};
+    return ngp_encode(buf, "OVER", fields, 3);
+}
+
+// Message types are matched as one 32-bit word: a multiply-shift that
+// happens to send the seven tags to seven different slots (the constant
+// was found by search), then a single compare against the tag in that slot.
+#define TAG(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+#define TAG_HASH(tag) ((uint32_t)((tag) * 0xc2ce6f45u) >> 29)
+
+static const struct {
+    uint32_t tag;
+    int type;
+} type_slots[8] = {
+    [1] = { TAG('W', 'A', 'T', 'C'), NGP_WATC },
+    [2] = { TAG('M', 'O', 'V', 'E'), NGP_MOVE },
+    [3] = { TAG('P', 'L', 'A', 'Y'), NGP_PLAY },
+    [4] = { TAG('O', 'V', 'E', 'R'), NGP_OVER },
+    [5] = { TAG('O', 'P', 'E', 'N'), NGP_OPEN },
+    [6] = { TAG('N', 'A', 'M', 'E'), NGP_NAME },
+    [7] = { TAG('F', 'A', 'I', 'L'), NGP_FAIL },
+};
+
+static int message_type(const char *s, int len) {
+    if (len != 4) return NGP_NONE;
+    const unsigned char *u = (const unsigned char *)s;
+    uint32_t tag = TAG(u[0], u[1], u[2], u[3]);
+    int slot = TAG_HASH(tag);
+    return type_slots[slot].tag == tag ? type_slots[slot].type : NGP_NONE;
+}
+
+// a '|' or the end of the text at 'at'; 1 when the frame is done
+static int field_end(const char *buf, int at, int len, int *start, NgpMsg *m) {
+    if (at == len || buf[at] == '\0') {
+        // text after the last bar that no bar closes
+        if (at != *start) m->count = -1;
+        return 1;
+    }
+    m->field[m->count].off = *start;
+    m->field[m->count].len = at - *start;
+    *start = at + 1;
+    return ++m->count == NGP_FIELDS;
+}
+
+// Splits buf on '|' into at most NGP_FIELDS fields, stopping early at a
+// NUL; the count is -1 when the text does not end on a bar. The scan
+// looks at 16 bytes per step for either a bar or a NUL.
+int ngp_parse(const char *buf, int len, NgpMsg *m) {
+    m->buf = buf;
+    m->count = 0;
+    m->type = NGP_NONE;
+    m->binary = 0;
+    int start = 0;
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i bar = _mm_set1_epi8('|');
+    const __m128i nul = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned hits = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, bar), _mm_cmpeq_epi8(v, nul)));
+        while (hits) {
+            if (field_end(buf, i + __builtin_ctz(hits), len, &start, m)) goto done;
+            hits &= hits - 1;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if ((buf[i] == '|' || buf[i] == '\0') && field_end(buf, i, len, &start, m)) goto done;
+    }
+    field_end(buf, len, len, &start, m);
+done:
+    if (m->count >= 3) m->type = message_type(buf + m->field[2].off, m->field[2].len);
+    return m->count;
+}
+
+// field i read as atoi would: the bar after it stops the digits
+int ngp_int(const NgpMsg *m, int i) {
+    if (m->binary) return (unsigned char)m->buf[m->field[i].off];
+    return atoi(m->buf + m->field[i].off);
+}
+
+static void set_field(NgpMsg *m, int i, int off, int len) {
+    m->field[i].off = off;
+    m->field[i].len = len;
+}
+
+// len is the whole frame, header included. Fields 0 and 1 (the text
+// header) are empty, 2 is the opcode; a payload of the wrong shape leaves
+// just those three, which every state treats as 10 Invalid.
+int ngpb_parse(const char *buf, int len, NgpMsg *m) {
+    int op = (unsigned char)buf[0];
+    int payload = len - NGPB_HEADER;
+    m->buf = buf;
+    m->binary = 1;
+    // clients never send WAIT, as in text
+    m->type = op >= NGP_OPEN && op <= NGP_OVER ? op : NGP_NONE;
+    set_field(m, 0, 0, 0);
+    set_field(m, 1, 0, 0);
+    set_field(m, 2, 0, 1);
+    m->count = 3;
+    if (m->type == NGP_OPEN) {
+        set_field(m, 3, NGPB_HEADER, payload);
+        m->count = 4;
+    } else if (m->type == NGP_MOVE && payload == 2) {
+        set_field(m, 3, NGPB_HEADER, 1);
+        set_field(m, 4, NGPB_HEADER + 1, 1);
+        m->count = 5;
+    }
+    return m->count;
+}
+
+static int binary_frame(char *buf, int op, int payload) {
+    buf[0] = op;
+    buf[1] = payload;
+    return NGPB_HEADER + payload;
+}
+
+int ngpb_wait(char *buf) {
+    return binary_frame(buf, NGP_WAIT, 0);
+}
+
+int ngpb_fail(char *buf, const char *reason) {
+    size_t len = strlen(reason);
+    if (len > NGPB_MAX_PAYLOAD) len = NGPB_MAX_PAYLOAD;
+    memcpy(buf + NGPB_HEADER, reason, len);
+    return binary_frame(buf, NGP_FAIL, len);
+}
+
+int ngpb_name(char *buf, int number, const char *name) {
+    size_t len = strlen(name);
+    if (len > NGPB_MAX_PAYLOAD - 1) len = NGPB_MAX_PAYLOAD - 1;
+    buf[NGPB_HEADER] = number;
+    memcpy(buf + NGPB_HEADER + 1, name, len);
+    return binary_frame(buf, NGP_NAME, 1 + len);
+}
+
+int ngpb_play(char *buf, int turn, const uint8_t *board, int piles) {
+    buf[NGPB_HEADER] = turn;
+    buf[NGPB_HEADER + 1] = piles;
+    memcpy(buf + NGPB_HEADER + 2, board, piles);
+    return binary_frame(buf, NGP_PLAY, 2 + piles);
+}
+
+int ngpb_over(char *buf, int winner, const uint8_t *board, int piles, int forfeit) {
+    buf[NGPB_HEADER] = winner;
+    buf[NGPB_HEADER + 1] = forfeit != 0;
+    buf[NGPB_HEADER + 2] = piles;
+    memcpy(buf + NGPB_HEADER + 3, board, piles);
+    return binary_frame(buf, NGP_OVER, 3 + piles);
+}
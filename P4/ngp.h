@@ -0,0 +1,78 @@
+#ifndef NGP_H
+#define NGP_H
+
+// a frame is "0|LL|" plus at most 99 bytes of body
+#define NGP_MAX_FRAME 104
+#define NGP_BUF_SIZE (NGP_MAX_FRAME + 1)
+
+#include <stdint.h>
+
+// encoders write one complete frame into buf (at least NGP_BUF_SIZE bytes),
+// NUL terminate it and return its length; none of them allocate
+
+void ngp_init(void);
+
+// Every board reachable from 1 3 5 7 9 has an index below NGP_BOARDS, for
+// tables with one entry per board (the PLAY frames here, the bot's moves).
+// ngp_board_index is -1 for a board of any other layout; ngp_board_at
+// writes out the 5 piles of an index.
+#define NGP_BOARDS (2 * 4 * 6 * 8 * 10)
+
+int ngp_board_index(const uint8_t *board, int piles);
+void ngp_board_at(int idx, uint8_t *board);
+int ngp_encode(char *buf, const char *type, const char *const fields[], int count);
+int ngp_wait(char *buf);
+int ngp_fail(char *buf, const char *reason);
+int ngp_name(char *buf, int number, const char *name);
+int ngp_play(char *buf, int turn, const uint8_t *board, int piles);
+int ngp_over(char *buf, int winner, const uint8_t *board, int piles, int forfeit);
+
+// A received frame is split in one pass into fields that point back into
+// the frame, nothing is copied. Fields past NGP_FIELDS are not looked at.
+#define NGP_FIELDS 6
+
+enum { NGP_NONE, NGP_OPEN, NGP_MOVE, NGP_FAIL, NGP_NAME, NGP_PLAY, NGP_OVER, NGP_WAIT, NGP_WATC };
+
+typedef struct {
+    unsigned short off;
+    unsigned short len;
+} NgpField;
+
+typedef struct {
+    const char *buf;
+    int count;
+    int type;
+    // an NGP-B frame, whose number fields are raw bytes
+    int binary;
+    NgpField field[NGP_FIELDS];
+} NgpMsg;
+
+int ngp_parse(const char *buf, int len, NgpMsg *m);
+int ngp_int(const NgpMsg *m, int i);
+
+// NGP-B, the binary framing. A client asks for it with a fifth field on
+// its OPEN, "0|LL|OPEN|name|B|"; every frame after that OPEN, both ways,
+// is a 2 byte header (opcode, payload length) and the payload:
+//   WAIT  -
+//   FAIL  reason text
+//   NAME  number, name
+//   PLAY  turn, pile count, one byte per pile
+//   OVER  winner, forfeit (0 or 1), pile count, one byte per pile
+//   OPEN  name
+//   MOVE  pile, quantity
+// Opcodes are the NGP_ types. Frames decode into the same NgpMsg as text
+// ones, field numbers included, so both go through the same checks. The
+// ngpb_ encoders are like the text ones but leave no terminator. WATC
+// has no binary form: spectators get text, see watch.h.
+#define NGPB_OPTION "B"
+#define NGPB_HEADER 2
+#define NGPB_MAX_PAYLOAD (NGP_MAX_FRAME - NGPB_HEADER)
+
+int ngpb_parse(const char *buf, int len, NgpMsg *m);
+int ngpb_wait(char *buf);
+int ngpb_fail(char *buf, const char *reason);
+int ngpb_name(char *buf, int number, const char *name);
+int ngpb_play(char *buf, int turn, const uint8_t *board, int piles);
+int ngpb_over(char *buf, int winner, const uint8_t *board, int piles, int forfeit);
+
+#endif
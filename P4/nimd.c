@@ -1,280 +1,88 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <signal.h>
 #include <errno.h>
 #include <pthread.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <getopt.h>
+#include <stdint.h>
+#include "nimd.h"
+#include "player.h"
+#include "game.h"
+#include "lobby.h"
+#include "names.h"
+#include "pool.h"
+#include "reactor.h"
+#include "timer.h"
+#include "metrics.h"
+#include "bot.h"
+#include "evlog.h"
+#include "handoff.h"
+#include "watch.h"
+#include "rating.h"
+#include "sim.h"
 
 #ifndef DEBUG
 #define DEBUG
 #endif
 
-#define Q_SIZE 128
-
 volatile int active = 1;
-
-
-typedef struct {
-    int fd;
-    char name[74];
-    int in_game;
-    int player_number;
-    int has_opened;
-    int begun;
-} Player;
-
-Player *player_create(int fd) {
-    Player *p = malloc(sizeof(Player));
-    p->fd = fd;
-    p->name[0] = '\0';
-    p->in_game = 0;
-    p->player_number = 0;
-    p->has_opened = 0;
-    p->begun = 0;
-    return p;
-}
-
-void player_destroy(Player *p) {
-    if (!p) return;
-    if (p->fd >= 0) {
-        close(p->fd);
-        p->fd = -1;
-    }
-    free(p);
-}
-
-int player_send(Player *p, const char *message) {
-    int msg = write(p->fd, message, strlen(message));
-    if (msg < 0) perror("write");
-    return msg;
-}
-
-
-
-int player_parse(const char *msg, char fields[][128], int max_fields) {
-    int count = 0;
-    const char *s = msg;
-    while (*s && count < max_fields) {
-        const char *e = strchr(s, '|');
-        if (!e) return -1;
-        size_t len = e - s;
-        if (len >= 128) return -1;
-        strncpy(fields[count], s, len);
-        fields[count][len] = '\0';
-        count++;
-        s = e + 1;
-    }
-    return count;
-}
-
-char *player_build(const char *type, const char fields[][128], int count) {
-    char body[105];
-    body[0] = '\0';
-    size_t remaining = 104;
-    if (fields != NULL) {
-        for (int i = 0; i < count; i++) {
-            size_t fl = strnlen(fields[i], 128);
-            if (fl + 1 > remaining)
-                break;
-            strncat(body, fields[i], remaining);
-            remaining -= fl;
-            strncat(body, "|", remaining);
-            remaining -= 1;
-        }
-    }
-
-    int length = strlen(type) + 1 + strlen(body);
-    char *buf = malloc(105);
-    if (!buf)
-        return NULL;
-    snprintf(buf, 105, "0|%02d|%s|%s", length, type, body);
-    return buf;
-}
-
-void player_send_fail(Player *p, const char *reason) {
-    char fields[1][128];
-    strncpy(fields[0], reason, 128);
-    char *temp = player_build("FAIL", fields, 1);
-    player_send(p, temp);
-    free(temp);
-}
-
-
-int player_receive(Player *p, char *buf, size_t bufsize) {
-    int n = read(p->fd, buf, bufsize - 1);
-    if (n <= 0) return n;
-    buf[n] = '\0';
-
-    if (n < 5) {
-        player_send_fail(p, "10 Invalid");
-        return -1;
-    }
-
-    if (buf[0] != '0' || buf[1] != '|' || !isdigit(buf[2]) || !isdigit(buf[3]) || buf[4] != '|') {
-        player_send_fail(p, "10 Invalid");
-        return -1;
-    }
-
-    int declared_len = (buf[2] - '0') * 10 + (buf[3] - '0');
-    int actual_len = n - 5;
-
-    //length mismatch
-    if (declared_len != actual_len) {
-        if (declared_len<actual_len){
-            //we received more chars, so truncate and do the rest
-            buf[declared_len+5]='\0';
-
-        }
-        else{
-            //message too short
-            player_send_fail(p, "10 Invalid");
-            return -1;
-        }
-    }
-
-     char fields[6][128];
-     int field_count = player_parse(buf, fields, 6);
- 
-     if (field_count < 3) {
-         player_send_fail(p, "10 Invalid");
-         return -1;
-    }
-
-     const char *type = fields[2];
-
-     if (strcmp(type, "OPEN") != 0 &&
-        strcmp(type, "MOVE") != 0 &&
-        strcmp(type, "FAIL")  != 0 &&
-        strcmp(type, "NAME") != 0 &&   // server only
-        strcmp(type, "PLAY") != 0 &&   // server only
-        strcmp(type, "OVER") != 0) {   // server only
-
-        player_send_fail(p, "10 Invalid"); //invalid message type
-        return -1;
-    }
-
-    return n;
-}
-
-int player_receive_open(Player *p) {
-    char buf[128];
-    int n = player_receive(p, buf, sizeof(buf));
-    if (n <= 0) return -1;
-
-    char fields[6][128];
-    int count = player_parse(buf, fields, 6);
-    if (count != 4 || strcmp(fields[2], "OPEN") != 0) {
-        player_send_fail(p, "10 Invalid");
-        return -1;
-    }
-
-    strncpy(p->name, fields[3], 73);
-    p->name[73] = '\0';
-    p->has_opened = 1;
-    if (strlen(p->name) == 0){
-        player_send_fail(p, "10 Invalid");
-        return -1;
-    }
-    return 0;
-}
-
-
-void player_send_wait(Player *p) {
-    char *temp = player_build("WAIT", NULL, 0);
-    player_send(p, temp);
-    free(temp);
-}
-
-
-typedef struct {
-    Player *p1;
-    Player *p2;
-    int board[5];
-    int turn;
-} Game;
-
-Game *game_create(Player *p1, Player *p2) {
-    Game *g = malloc(sizeof(Game));
-    g->p1 = p1;
-    g->p2 = p2;
-    g->turn = 1;
-    g->board[0] = 1;
-    g->board[1] = 3;
-    g->board[2] = 5;
-    g->board[3] = 7;
-    g->board[4] = 9;
-    p1->in_game = 1;
-    p2->in_game = 1;
-    return g;
-}
-
-void game_destroy(Game *g) {
-    if (!g) return;
-    g->p1->in_game = 0;
-    g->p2->in_game = 0;
-    player_destroy(g->p1);
-    player_destroy(g->p2);
-
-    free(g);
+long open_timeout = 30000;
+long idle_timeout = 600000;
+long move_timeout = 60000;
+long bot_wait = 0;
+int listen_backlog = 4096;
+int defer_accept = 0;
+
+
+Lobby lobby;
+
+// poll timeout for a deadline in timer_now_ms() time; no deadline means
+// wait forever, and a deadline that has passed gives a zero timeout
+static int until(uint64_t deadline) {
+    if (!deadline) return -1;
+    uint64_t now = timer_now_ms();
+    return deadline > now ? (int)(deadline - now) : 0;
 }
 
-int game_move(Game *g, int player_num, int pile, int count) {
-    if (player_num != g->turn) return 31;
-    if (pile < 0 || pile >= 5) return 32;
-    if (count <= 0 || count > g->board[pile]) return 33;
-    g->board[pile] -= count;
-    return 0;
-}
-
-int game_over(Game *g) {
-    for (int i = 0; i < 5; i++) if (g->board[i] > 0) return 0;
-    return 1;
-}
-
-Player *waiting_players[Q_SIZE];
-int wait_count = 0;
-pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-void remove_player(Player* p) {
-
-
-    for (int i = 0; i < wait_count; i++) {
-        if (waiting_players[i] == p) {
-            for (int j = i + 1; j < wait_count; j++)
-                waiting_players[j - 1] = waiting_players[j];
-            wait_count--;
-            break;
-        }
-    }
-
-}
+// poll, not select: thread mode sees fds past FD_SETSIZE under load.
+// What select would call readable or writable, errors and hang ups
+// included, so the read or write that follows finds out.
+#define POLL_READABLE(pfd) ((pfd).revents & (POLLIN | POLLHUP | POLLERR))
+#define POLL_WRITABLE(pfd) ((pfd).revents & (POLLOUT | POLLERR))
 
 void *game_start(void *arg) {
     Game *g = (Game *)arg;
-    char buf[1024];
-    char fields[6][128];
-
-    sprintf(fields[0], "1");
-    strcpy(fields[1], g->p2->name);
-    char *temp = player_build("NAME", fields, 2);
-    player_send(g->p1, temp);
-    free(temp);
-    sprintf(fields[0], "2");
-    strcpy(fields[1], g->p1->name);
-    char *temp2 = player_build("NAME", fields, 2);
-    player_send(g->p2, temp2);
-    free(temp2);
-    
+    NgpMsg m;
+    char out[NGP_BUF_SIZE];
+
+    // everything a turn sends each player (NAME and PLAY, or the PLAYs
+    // either side of a bot move) is gathered and leaves before the wait
+    player_cork(g->p1);
+    player_cork(g->p2);
+    player_write(g->p1, out, player_encode_name(g->p1, out, 1, g->p2->name));
+    player_write(g->p2, out, player_encode_name(g->p2, out, 2, g->p1->name));
+
     g->p1->begun = 1;
     g->p2->begun = 1;
+    // for the event log's FAIL records
+    g->p1->game = g->p2->game = g;
+    g->p1->player_number = 1;
+    g->p2->player_number = 2;
+    evlog_match(g);
+    watch_game_start(g);
 
     bool ff = false;
     bool p1_connected = true;
@@ -312,27 +120,35 @@ void *game_start(void *arg) {
             opp_connected = &p1_connected; 
         }
 
-        char state[128];
-        snprintf(state, sizeof(state), "%d %d %d %d %d",
-                 g->board[0], g->board[1], g->board[2], g->board[3], g->board[4]);
-
-        sprintf(fields[0], "%d", g->turn);
-        strcpy(fields[1], state);
+        int out_len = player_encode_play(curr, out, g->turn, game_board(g), game_piles(g));
+        if (*curr_connected) player_write(curr, out, out_len);
+        if (opp->binary != curr->binary)
+            out_len = player_encode_play(opp, out, g->turn, game_board(g), game_piles(g));
+        if (*opp_connected) player_write(opp, out, out_len);
+
+        if (curr->bot) {
+            watch_play(g);
+            // the house bot answers on the spot; one that cannot move
+            // forfeits rather than hand the same board back
+            if (bot_move(g) != 0) {
+                winner = 3 - g->turn;
+                ff = true;
+                break;
+            }
+            g->turn = 3 - g->turn;
+            continue;
+        }
 
-        char *msg = player_build("PLAY", fields, 2);
-        if (*curr_connected) player_send(curr, msg);
-        if (*opp_connected) player_send(opp, msg);
-        free(msg);
+        player_uncork(curr);
+        player_uncork(opp);
+        // spectators once the players' frames are on their way
+        watch_play(g);
 
         // extra cred
-        fd_set readfds;
-        int max_fd;
-        if (curr->fd > opp->fd) {
-            max_fd = curr->fd; 
-         } else {
-            max_fd = opp->fd;
-         }
+        struct pollfd pfd[2];
         bool received = false;
+        // the move clock restarts every turn, impatience does not reset it
+        uint64_t deadline = move_timeout > 0 ? timer_now_ms() + move_timeout : 0;
 
         while (!received && !ff) {
             //both are gone
@@ -343,9 +159,13 @@ void *game_start(void *arg) {
                 break;
             }
 
-            FD_ZERO(&readfds);
-            if (*curr_connected) FD_SET(curr->fd, &readfds);
-            if (*opp_connected) FD_SET(opp->fd, &readfds);
+            // a negative fd is skipped
+            pfd[0].fd = *curr_connected ? curr->fd : -1;
+            // the house bot has no socket
+            pfd[1].fd = *opp_connected && !opp->bot ? opp->fd : -1;
+            // output a slow reader has not taken yet
+            pfd[0].events = POLLIN | (player_queued(curr) ? POLLOUT : 0);
+            pfd[1].events = POLLIN | (!opp->bot && player_queued(opp) ? POLLOUT : 0);
 
             int fd_count = 0;
             if (*curr_connected) {
@@ -364,38 +184,51 @@ void *game_start(void *arg) {
                 break;
             }
 
-            int ready = select(max_fd + 1, &readfds, NULL, NULL, NULL);
-            if (ready < 0) {
-                ff = true;
-                break;
+            // frames already buffered from an earlier read go first
+            bool opp_ready = *opp_connected && player_pending(opp);
+            bool curr_ready = *curr_connected && player_pending(curr);
+            if (!opp_ready && !curr_ready) {
+                int ready = poll(pfd, 2, until(deadline));
+                if (ready < 0) {
+                    ff = true;
+                    break;
+                }
+                if (ready == 0) {
+                    // out of time, the current player forfeits
+                    winner = 3 - g->turn;
+                    ff = true;
+                    break;
+                }
+                opp_ready = pfd[1].fd >= 0 && POLL_READABLE(pfd[1]);
+                curr_ready = pfd[0].fd >= 0 && POLL_READABLE(pfd[0]);
+                if (pfd[1].fd >= 0 && POLL_WRITABLE(pfd[1])) player_flush(opp);
+                if (pfd[0].fd >= 0 && POLL_WRITABLE(pfd[0])) player_flush(curr);
             }
 
             // impatient
-            if (*opp_connected && FD_ISSET(opp->fd, &readfds)) {
-                int n = player_receive(opp, buf, sizeof(buf));
-                if (n <= 0) {
+            if (opp_ready) {
+                int n = player_poll(opp, &m);
+                if (n < 0) {
                     // forfeit
                     //current player wins
                     winner = g->turn;
-                    close(opp->fd);
-                    opp->fd = -1;
+                    player_hang_up(opp);
                     *opp_connected = false;
                     ff = true;
                     break;
                 }
+                if (n == 0) continue;
 
-                int count = player_parse(buf, fields, 6);
-                if (count == 5 && strcmp(fields[2], "MOVE") == 0) {
+                if (m.count == 5 && m.type == NGP_MOVE) {
                     // impatient
                     player_send_fail(opp, "31 Impatient");
 
-                } else if (count == 4 && strcmp(fields[2], "OPEN") == 0) {
+                } else if (m.count == 4 && m.type == NGP_OPEN) {
                     //alr open
                     //current player wins
                     player_send_fail(opp, "23 Already Open");
                     winner = g->turn;
-                    close(opp->fd);
-                    opp->fd = -1;
+                    player_hang_up(opp);
                     *opp_connected = false;
                     ff = true;
                     break;
@@ -405,57 +238,51 @@ void *game_start(void *arg) {
                     //current player wins
                     player_send_fail(opp, "10 Invalid");
                     winner = g->turn;
-                    close(opp->fd);
-                    opp->fd = -1;
+                    player_hang_up(opp);
                     *opp_connected = false;
                     ff = true;
                     break;
                 }
             }
 
-            if (*curr_connected && FD_ISSET(curr->fd, &readfds)) {
-                int n = player_receive(curr, buf, sizeof(buf));
-                if (n <= 0) {
+            if (curr_ready) {
+                int n = player_poll(curr, &m);
+                if (n < 0) {
                     //forfeit
                     //other player wins
                     winner = 3 - g->turn;
-                    close(curr->fd);
-                    curr->fd = -1;
+                    player_hang_up(curr);
                     *curr_connected = false;
                     ff = true;
                     break;
                 }
+                if (n == 0) continue;
+                uint64_t start = metrics_now();
 
-                int count = player_parse(buf, fields, 6);
-
-                if (count >= 3 && strcmp(fields[2], "OPEN") == 0) {
+                if (m.type == NGP_OPEN) {
                     //alr open
                     //other player wins
                     winner = 3 - g->turn;
                     player_send_fail(curr, "23 Already Open");
-                    close(curr->fd);
-                    curr->fd = -1;
+                    player_hang_up(curr);
                     *curr_connected = false;
                     ff = true;
                     break;
                 }
 
-                if (count != 5 || strcmp(fields[2], "MOVE") != 0) {
+                if (m.count != 5 || m.type != NGP_MOVE) {
                     //invalid
                     //other player wins
                     winner = 3 - g->turn;
-                    char *msg = player_build("FAIL", (char[][128]){"10 Invalid"}, 1);
-                    player_send(curr, msg);
-                    free(msg);
-                    close(curr->fd);
-                    curr->fd = -1;
+                    player_send_fail(curr, "10 Invalid");
+                    player_hang_up(curr);
                     *curr_connected = false;
                     ff = true;
                     break;
                 }
 
-                int pile = atoi(fields[3]);
-                int qty = atoi(fields[4]);
+                int pile = ngp_int(&m, 3);
+                int qty = ngp_int(&m, 4);
                 int err = game_move(g, g->turn, pile, qty);
                 if (err != 0) {
                     char msg[128];
@@ -475,15 +302,14 @@ void *game_start(void *arg) {
                         //weird error, not supposed to happen
                         sprintf(msg, "%d", err);
                     }
-                    char fail_fields[1][128];
-                    strcpy(fail_fields[0], msg);
-                    char *message = player_build("FAIL", fail_fields, 1);
-                    player_send(curr, message);
-                    free(message);
+                    player_send_fail(curr, msg);
                     continue;
                 }
 
                 received = true;
+                evlog_move(g, g->turn, pile, qty);
+                metrics_add(M_MOVES, 1);
+                metrics_record(H_MOVE, metrics_now() - start);
             }
         }
 
@@ -493,32 +319,29 @@ void *game_start(void *arg) {
         } else {
             g->turn = 1;
         }
+        player_cork(g->p1);
+        player_cork(g->p2);
     }
 
-    char state[128];
-    snprintf(state, sizeof(state), "%d %d %d %d %d",
-             g->board[0], g->board[1], g->board[2], g->board[3], g->board[4]);
-
     //game ends normally
     if (winner == 0){
         winner = 3 - g->turn;
     }
-    sprintf(fields[0], "%d", winner);
-    strcpy(fields[1], state);
-    strcpy(fields[2], "");
-    if (ff == true) {
-        strcpy(fields[2], "Forfeit");
-    }
-
-    char *msg = player_build("OVER", fields, 3);
-    if (p1_connected) player_send(g->p1, msg);
-    if (p2_connected) player_send(g->p2, msg);
-    free(msg);
 
-    pthread_mutex_lock(&queue_mutex);
-    remove_player(g->p1);
-    remove_player(g->p2);
-    pthread_mutex_unlock(&queue_mutex);
+    if (ff) metrics_add(M_FORFEITS, 1);
+    evlog_over(g, winner, ff);
+    rating_over(g, winner);
+    int out_len = player_encode_over(g->p1, out, winner, game_board(g), game_piles(g), ff);
+    if (p1_connected) player_write(g->p1, out, out_len);
+    if (g->p2->binary != g->p1->binary)
+        out_len = player_encode_over(g->p2, out, winner, game_board(g), game_piles(g), ff);
+    if (p2_connected) player_write(g->p2, out, out_len);
+    watch_game_end(g, winner, ff);
+
+    lobby_lock(&lobby);
+    remove_player(&lobby, g->p1);
+    remove_player(&lobby, g->p2);
+    lobby_unlock(&lobby);
 
     game_destroy(g);
     return NULL;
@@ -538,46 +361,30 @@ void install_handlers() {
     sigaction(SIGINT, &act, NULL);
     sigaction(SIGHUP, &act, NULL);
     sigaction(SIGTERM, &act, NULL);
+    // a peer that hangs up mid write should not take the server down
+    signal(SIGPIPE, SIG_IGN);
 }
 
-int name_exists(const char *name) {
-    for (int i = 0; i < wait_count; i++)
-        if (strcmp(waiting_players[i]->name, name) == 0) return 1;
-    return 0;
-}
-int count_players_in_queue() {
-    int count = 0;
-    for (int i = 0; i < wait_count; i++)
-        if (waiting_players[i]->in_game == 0) count++;
-    return count;
+// the backlog and TCP_DEFER_ACCEPT as configured; a listener handed over
+// by an older process is listened on again, which only resizes its queue
+int tune_listener(int listener) {
+    if (setsockopt(listener, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(defer_accept)) < 0)
+        return -1;
+    return listen(listener, listen_backlog);
 }
 
-int first_player_in_queue() {
-    int count = 0;
-    for (int i = 0; i < wait_count; i++) {
-        if (waiting_players[i]->in_game == 0) {
-            count++;
-            if (count==1){
-                return i;
-            }
-        }
-    }
-    return -1;
-}
-int second_player_in_queue() {
-    int count = 0;
-    for (int i = 0; i < wait_count; i++) {
-        if (waiting_players[i]->in_game == 0) {
-            count++;
-            if (count==2){
-                return i;
-            }
-        }
-    }
-    return -1;
+// Every connection the server takes on, accepted or handed over. Frames
+// are coalesced by player_cork, so Nagle has nothing left to do but hold
+// a frame back until the peer's delayed ACK, often 40 ms.
+void tune_client(int fd) {
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
 }
 
-int open_listener(const char *port, int qsize) {
+// with reuseport set, several listeners can bind the same port and the
+// kernel spreads incoming connections across them. The listener is non
+// blocking, for accept_batch.
+int open_listener(const char *port, int reuseport) {
     struct addrinfo hints, *res;
     int listener;
     memset(&hints, 0, sizeof(hints));
@@ -588,160 +395,685 @@ int open_listener(const char *port, int qsize) {
 
     if (getaddrinfo(NULL, port, &hints, &res) != 0) return -1;
 
-    listener = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (listener < 0) return -1;
+    listener = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+    if (listener < 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
     int opt = 1;
 
     setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    if (bind(listener, res->ai_addr, res->ai_addrlen) < 0) return -1;
-    if (listen(listener, qsize) < 0) return -1;
+    if ((reuseport && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) ||
+        bind(listener, res->ai_addr, res->ai_addrlen) < 0 || tune_listener(listener) < 0) {
+        // errno is the failure's, not close's
+        int err = errno;
+        close(listener);
+        freeaddrinfo(res);
+        errno = err;
+        return -1;
+    }
 
     freeaddrinfo(res);
     return listener;
 }
 
+// Up to max connections off a non-blocking listener into fds, each
+// accepted with flags (SOCK_NONBLOCK, SOCK_CLOEXEC) so it needs no fcntl
+// after. How many were taken: fewer than max means the backlog is empty
+// (errno is EAGAIN) or that an error like EMFILE stopped it (errno is
+// that error); -1 when the error came first.
+int accept_batch(int listener, int *fds, int max, int flags) {
+    int n = 0;
+    while (n < max) {
+        int fd = accept4(listener, NULL, NULL, flags);
+        if (fd >= 0) {
+            fds[n++] = fd;
+            continue;
+        }
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK || n > 0) break;
+        return -1;
+    }
+    return n;
+}
+
+// Thread mode hands a matched player from its lobby thread to a game
+// thread, and only one of them ever reads the socket. The lobby thread
+// reads into p's buffer but parses a frame only after seeing, under the
+// lobby lock, that p is still waiting; whoever makes the match sets up
+// the game under the same lock and wakes the other lobby thread through
+// its eventfd. The last lobby thread to let go starts the game.
+
+static void game_launch(Game *g) {
+    pthread_t tid;
+    pthread_create(&tid, NULL, game_start, g);
+    pthread_detach(tid);
+}
+
+// with the lobby lock held: g is made, the lobby threads are told
+static void lobby_hand_over(Game *g, int holders, Player *self) {
+    g->handing = holders;
+    g->p1->game = g->p2->game = g;
+    uint64_t one = 1;
+    if (g->p1 != self && !g->p1->bot && write(g->p1->wake, &one, sizeof(one)) < 0) perror("eventfd");
+    if (g->p2 != self && !g->p2->bot && write(g->p2->wake, &one, sizeof(one)) < 0) perror("eventfd");
+}
+
+// p's lobby thread is done with it, and must not touch it after this
+static void lobby_let_go(Player *p) {
+    Game *g = p->game;
+    close(p->wake);
+    p->wake = -1;
+    if (__atomic_sub_fetch(&g->handing, 1, __ATOMIC_ACQ_REL) == 0) game_launch(g);
+}
+
+// with the lobby lock held: p1 and p2 were matched, and their game is
+// handed to both lobby threads. 1 when self is one of them.
+static int lobby_start(Player *p1, Player *p2, Player *self) {
+    Game *g = game_create(p1, p2);
+    if (!g) {
+        // both lobby threads notice the closed sockets and clean up;
+        // under the lock, so neither has freed its player yet
+        player_shutdown(p1, SHUT_RDWR);
+        player_shutdown(p2, SHUT_RDWR);
+        return 0;
+    }
+    lobby_hand_over(g, 2, self);
+    return p1 == self || p2 == self;
+}
+
+// with the lobby lock held, p still waiting: the house bot takes the other
+// seat once p has waited bot_wait
+static int bot_match(Player *p) {
+    Player *bot = bot_create();
+    Game *g = bot ? game_create(p, bot) : NULL;
+    if (!g) {
+        player_destroy(bot);
+        return -1;
+    }
+    lobby_take(&lobby, p);
+    lobby_hand_over(g, 1, p);
+    metrics_add(M_BOT_GAMES, 1);
+    return 0;
+}
+
+// waits in the lobby until p is matched (1, the caller lets go of it) or
+// leaves (0, the caller destroys it)
+static int lobby_wait(Player *p) {
+    uint64_t deadline = idle_timeout > 0 ? timer_now_ms() + idle_timeout : 0;
+    uint64_t bot_at = bot_wait > 0 ? timer_now_ms() + bot_wait : 0;
+    if (deadline && bot_at >= deadline) bot_at = 0;
+    // p's match window widens as it waits, so it tries again every so often
+    uint64_t retry_at = timer_now_ms() + LOBBY_RETRY_MS;
+    for (;;) {
+        uint64_t wake_at = retry_at;
+        if (bot_at && bot_at < wake_at) wake_at = bot_at;
+        if (deadline && deadline < wake_at) wake_at = deadline;
+        int ready = 1;
+        int filled = 1;
+        if (!player_pending(p)) {
+            int queued = player_queued(p) > 0;
+            struct pollfd pfd[2] = {
+                { .fd = p->fd, .events = POLLIN | (queued ? POLLOUT : 0) },
+                { .fd = p->wake, .events = POLLIN },
+            };
+            ready = poll(pfd, 2, until(wake_at));
+            if (ready < 0) continue;
+            if (ready > 0 && queued && POLL_WRITABLE(pfd[0])) player_flush(p);
+            // matched, the check below sees it
+            if (ready > 0 && !POLL_READABLE(pfd[0]) && !POLL_READABLE(pfd[1])) continue;
+            // the bytes stay in p, so a game that takes it over still has them
+            if (ready > 0 && POLL_READABLE(pfd[0])) filled = player_fill(p);
+            if (filled < 0 && errno == EINTR) continue;
+        }
+
+        lobby_lock(&lobby);
+        if (p->in_game) {
+            lobby_unlock(&lobby);
+            return 1;
+        }
+
+        uint64_t now = ready == 0 ? timer_now_ms() : 0;
+        if (ready == 0 && bot_at && now >= bot_at) {
+            int matched = bot_match(p) == 0;
+            lobby_unlock(&lobby);
+            if (matched) return 1;
+            // no room for a game, keep waiting for a human
+            bot_at = 0;
+            continue;
+        }
+
+        if (ready == 0 && now < (deadline ? deadline : UINT64_MAX)) {
+            Player *p1, *p2;
+            int matched = lobby_match(&lobby, p, now, &p1, &p2) && lobby_start(p1, p2, p);
+            lobby_unlock(&lobby);
+            if (matched) return 1;
+            retry_at = now + LOBBY_RETRY_MS;
+            continue;
+        }
+
+        if (ready == 0) {
+            // idle too long
+            remove_player(&lobby, p);
+            lobby_unlock(&lobby);
+            player_send_fail(p, "Timeout");
+            return 0;
+        }
+
+        NgpMsg m;
+        int n = filled > 0 ? player_next_frame(p, &m) : -1;
+        if (n == 0) {
+            lobby_unlock(&lobby);
+            continue;
+        }
+        if (n < 0 || m.type == NGP_MOVE || m.type == NGP_OPEN) {
+            remove_player(&lobby, p);
+            lobby_unlock(&lobby);
+            if (n > 0) player_send_fail(p, m.type == NGP_MOVE ? "24 Not Playing" : "23 Already Open");
+            return 0;
+        }
+        lobby_unlock(&lobby);
+        // Some other invalid message
+        player_send_fail(p, "10 Invalid");
+    }
+}
+
+// A spectator's thread only keeps its frames moving: the game thread
+// sends what the socket takes and wakes this one through the eventfd for
+// the rest. Anything the spectator sends ends it.
+static void spectate(Player *p, const NgpMsg *m) {
+    p->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (p->wake < 0) {
+        perror("eventfd");
+        player_send_fail(p, "Server full");
+        player_destroy(p);
+        return;
+    }
+    if (watch_open(p, m) < 0) {
+        close(p->wake);
+        player_destroy(p);
+        return;
+    }
+    for (;;) {
+        int left = watch_flush(p);
+        if (left < 0 || watch_finished(p)) break;
+        struct pollfd pfd[2] = {
+            { .fd = p->fd, .events = POLLIN | (left > 0 ? POLLOUT : 0) },
+            { .fd = p->wake, .events = POLLIN },
+        };
+        if (poll(pfd, 2, -1) < 0) continue;
+        uint64_t kicks;
+        if (POLL_READABLE(pfd[1]) && read(p->wake, &kicks, sizeof(kicks)) < 0) continue;
+        if (POLL_READABLE(pfd[0])) {
+            // a shut down socket reads as closed: cut off, or the game is over
+            int n = player_fill(p);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            NgpMsg msg;
+            if (player_next_frame(p, &msg) != 0) {
+                player_send_fail(p, "10 Invalid");
+                break;
+            }
+        }
+    }
+    watch_leave(p);
+    close(p->wake);
+    player_destroy(p);
+}
+
+// player_receive with a deadline for the whole frame, not for each read,
+// so a client trickling bytes in cannot hold its thread past it; a
+// deadline that passes is -1 with errno ETIMEDOUT
+static int receive_by(Player *p, NgpMsg *m, uint64_t deadline) {
+    for (;;) {
+        int status = player_next_frame(p, m);
+        if (status != 0) return status;
+        struct pollfd pfd = { .fd = p->fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, until(deadline));
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) return -1;
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        int n = player_fill(p);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return n;
+    }
+}
+
 void *client_thread(void *arg) {
-    int client = *(int *)arg;
-    free(arg);
+    int client = (int)(intptr_t)arg;
+    tune_client(client);
 
     Player *p = player_create(client);
-    if (player_receive_open(p) < 0) {
+    if (!p) {
+        close(client);
+        return NULL;
+    }
+
+    char name[NAME_BUF];
+    NgpMsg m;
+    errno = 0;
+    // the OPEN deadline is absolute, as on the event loops' wheel
+    uint64_t deadline = open_timeout > 0 ? timer_now_ms() + open_timeout : 0;
+    int n = receive_by(p, &m, deadline);
+    if (n > 0 && m.type == NGP_WATC) {
+        spectate(p, &m);
+        return NULL;
+    }
+    if (n <= 0 || player_open(p, &m, name) < 0) {
+        if (n < 0 && errno == ETIMEDOUT) player_send_fail(p, "Timeout");
         player_destroy(p);
         return NULL;
     }
 
-    if (strlen(p->name) > 72) {
+    if (strlen(name) > 72) {
         player_send_fail(p, "21 Long Name");
         player_destroy(p);
         return NULL;
     }
 
-    pthread_mutex_lock(&queue_mutex);
-    if (name_exists(p->name)) {
-
-        pthread_mutex_unlock(&queue_mutex);
+    // uniqueness is settled by the name registry, outside the queue lock
+    p->name = names_claim(name);
+    if (!p->name) {
         player_send_fail(p, "22 Already Playing");
         player_destroy(p);
         return NULL;
     }
+    evlog_open(p->name);
+    p->rating = rating_of(p->name);
+
+    p->wake = eventfd(0, EFD_CLOEXEC);
+    if (p->wake < 0) {
+        perror("eventfd");
+        player_send_fail(p, "Server full");
+        player_destroy(p);
+        return NULL;
+    }
+
+    lobby_lock(&lobby);
 
     player_send_wait(p);
 
 
-    if (wait_count < Q_SIZE) {
-        waiting_players[wait_count++] = p;
-    }
-    else {
+    if (lobby_add(&lobby, p, timer_now_ms()) < 0) {
 
-        pthread_mutex_unlock(&queue_mutex);
+        lobby_unlock(&lobby);
         player_send_fail(p, "Server full");
+        close(p->wake);
         player_destroy(p);
         return NULL;
     }
 
-    int queue_count = count_players_in_queue();
-
-    if (queue_count >= 2) {
+    Player *p1, *p2;
+    int matched = lobby_match(&lobby, p, timer_now_ms(), &p1, &p2) && lobby_start(p1, p2, p);
+    lobby_unlock(&lobby);
 
-        Player *p1 = waiting_players[first_player_in_queue()];
-        Player *p2 = waiting_players[second_player_in_queue()];
-        // don't remove from queue until end
-
-        Game *g = game_create(p1, p2);
-        pthread_mutex_unlock(&queue_mutex);
-        pthread_t tid;
-        pthread_create(&tid, NULL, game_start, g);
-        pthread_detach(tid);
+    // extra cred
+    if (matched || lobby_wait(p)) {
+        lobby_let_go(p);
     } else {
-        pthread_mutex_unlock(&queue_mutex);
+        close(p->wake);
+        player_destroy(p);
     }
+    return NULL;
+}
 
-    // extra cred
-    while (!p->in_game) {
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(p->fd, &readfds);
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--epoll] [--uring] [--shards N [--pin]] [--workers N [--queue-depth N]]\n"
+                    "          [--lobby N] [--prewarm N] [--pool-cache N] [--piles N,N,...]\n"
+                    "          [--open-timeout MS] [--idle-timeout MS] [--move-timeout MS]\n"
+                    "          [--bot-wait MS [--bot-skill PCT]] [--high-water BYTES]\n"
+                    "          [--log PATH [--log-sync MS]] [--handoff PATH] [--match-window N[,N]]\n"
+                    "          [--backlog N] [--defer-accept SECS] [--admin PORT|unix:PATH] port\n"
+                    "       %s --selfplay N [--bot-skill PCT] [--piles N,N,...]\n"
+                    "       %s --simulate GAMES [--seed N] [--sim-clients N] [server options]\n", prog, prog, prog);
+    exit(EXIT_FAILURE);
+}
 
-        int ready = select(p->fd + 1, &readfds, NULL, NULL, NULL);
+// bot against bot with no server around it, to check the table and the
+// game core: with best play the first player wins exactly when the
+// starting nim-sum is not zero, as it is for 1 3 5 7 9
+static int run_selfplay(long games) {
+    bot_init();
+    int nimsum = 0;
+    for (int i = 0; i < game_layout.count; i++) nimsum ^= game_layout.piles[i];
+    long p1_wins;
+    uint64_t start = metrics_now();
+    long moves = bot_selfplay(&game_layout, games, bot_skill, &p1_wins);
+    double secs = (metrics_now() - start) / 1e9;
+    if (moves < 0) {
+        fprintf(stderr, "selfplay: the bot made an illegal move\n");
+        return EXIT_FAILURE;
+    }
+    printf("%ld games, %ld moves in %.3f s (%.0f games/s, %.0f moves/s)\n",
+           games, moves, secs, games / secs, moves / secs);
+    printf("player 1 won %ld (%.1f%%) at skill %d\n", p1_wins, 100.0 * p1_wins / games, bot_skill);
+    if (bot_skill == 100 && p1_wins != (nimsum ? games : 0)) {
+        fprintf(stderr, "selfplay: the bot lost a won position\n");
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+static void report_pools(void) {
+    pool_report(&player_pool, stdout);
+    pool_report(&game_pool, stdout);
+    pool_report(&watcher_pool, stdout);
+    pool_report(&watch_frame_pool, stdout);
+    game_table_report(stdout);
+}
 
-        if (p->in_game){
-            break;
+int main(int argc, char **argv) {
+    static struct option long_opts[] = {
+        {"epoll", no_argument, NULL, 'e'},
+        {"uring", no_argument, NULL, 'u'},
+        {"lobby", required_argument, NULL, 'l'},
+        {"shards", required_argument, NULL, 's'},
+        {"pin", no_argument, NULL, 'p'},
+        {"prewarm", required_argument, NULL, 'w'},
+        {"pool-cache", required_argument, NULL, 'c'},
+        {"workers", required_argument, NULL, 'W'},
+        {"queue-depth", required_argument, NULL, 'q'},
+        {"open-timeout", required_argument, NULL, 'O'},
+        {"idle-timeout", required_argument, NULL, 'I'},
+        {"move-timeout", required_argument, NULL, 'M'},
+        {"admin", required_argument, NULL, 'a'},
+        {"bot-wait", required_argument, NULL, 'B'},
+        {"bot-skill", required_argument, NULL, 'K'},
+        {"selfplay", required_argument, NULL, 'S'},
+        {"piles", required_argument, NULL, 'L'},
+        {"high-water", required_argument, NULL, 'H'},
+        {"log", required_argument, NULL, 'G'},
+        {"log-sync", required_argument, NULL, 'y'},
+        {"handoff", required_argument, NULL, 'U'},
+        {"match-window", required_argument, NULL, 'm'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"defer-accept", required_argument, NULL, 'D'},
+        {"simulate", required_argument, NULL, 'X'},
+        {"seed", required_argument, NULL, 'R'},
+        {"sim-clients", required_argument, NULL, 'N'},
+        {NULL, 0, NULL, 0}
+    };
+    int use_epoll = 0;
+    int use_uring = 0;
+    int lobby_size = 0;
+    int shards = 0;
+    int pin = 0;
+    long prewarm = 0;
+    int workers = 0;
+    int queue_depth = 1024;
+    const char *admin = NULL;
+    const char *log_path = NULL;
+    long log_sync = 100;
+    const char *handoff_path = NULL;
+    long selfplay = 0;
+    long simulate = 0;
+    uint64_t seed = 1;
+    int sim_clients = 1000;
+    int c;
+    while ((c = getopt_long(argc, argv, "eul:s:pw:c:W:q:O:I:M:a:B:K:S:L:H:G:y:U:m:b:D:X:R:N:", long_opts, NULL)) != -1) {
+        if (c == 'e') {
+            use_epoll = 1;
+        } else if (c == 'u') {
+            // the event loop with io_uring doing its socket I/O
+            use_epoll = use_uring = 1;
+        } else if (c == 's') {
+            shards = atoi(optarg);
+            if (shards < 1) usage(argv[0]);
+        } else if (c == 'p') {
+            pin = 1;
+        } else if (c == 'w') {
+            prewarm = atol(optarg);
+            if (prewarm < 0) usage(argv[0]);
+        } else if (c == 'c') {
+            pool_cache_size = atoi(optarg);
+            if (pool_cache_size < 0) usage(argv[0]);
+        } else if (c == 'W') {
+            workers = atoi(optarg);
+            if (workers < 1) usage(argv[0]);
+        } else if (c == 'q') {
+            queue_depth = atoi(optarg);
+            if (queue_depth < 1) usage(argv[0]);
+        } else if (c == 'O' || c == 'I' || c == 'M') {
+            long ms = atol(optarg);
+            if (ms < 0) usage(argv[0]);
+            if (c == 'O') open_timeout = ms;
+            else if (c == 'I') idle_timeout = ms;
+            else move_timeout = ms;
+        } else if (c == 'a') {
+            admin = optarg;
+        } else if (c == 'B') {
+            bot_wait = atol(optarg);
+            if (bot_wait < 0) usage(argv[0]);
+        } else if (c == 'K') {
+            bot_skill = atoi(optarg);
+            if (bot_skill < 0 || bot_skill > 100) usage(argv[0]);
+        } else if (c == 'H') {
+            player_high_water = atoi(optarg);
+            if (player_high_water < 0) usage(argv[0]);
+        } else if (c == 'm') {
+            // BASE or BASE,GROWTH: rating points, and points a second
+            char *end;
+            lobby_window_base = strtol(optarg, &end, 10);
+            if (*end == ',') lobby_window_growth = strtol(end + 1, &end, 10);
+            if (*end || end == optarg || lobby_window_base < 0 || lobby_window_growth < 0) usage(argv[0]);
+        } else if (c == 'b') {
+            listen_backlog = atoi(optarg);
+            if (listen_backlog < 1) usage(argv[0]);
+        } else if (c == 'D') {
+            defer_accept = atoi(optarg);
+            if (defer_accept < 0) usage(argv[0]);
+        } else if (c == 'U') {
+            handoff_path = optarg;
+        } else if (c == 'G') {
+            log_path = optarg;
+        } else if (c == 'y') {
+            log_sync = atol(optarg);
+            if (log_sync < 0) usage(argv[0]);
+        } else if (c == 'L') {
+            if (game_parse_layout(optarg, &game_layout) < 0) usage(argv[0]);
+        } else if (c == 'S') {
+            selfplay = atol(optarg);
+            if (selfplay < 1) usage(argv[0]);
+        } else if (c == 'X') {
+            simulate = atol(optarg);
+            if (simulate < 1) usage(argv[0]);
+        } else if (c == 'R') {
+            seed = strtoull(optarg, NULL, 10);
+        } else if (c == 'N') {
+            sim_clients = atoi(optarg);
+            if (sim_clients < 2) usage(argv[0]);
+        } else if (c == 'l') {
+            lobby_size = atoi(optarg);
+            if (lobby_size < 0) usage(argv[0]);
+        } else {
+            usage(argv[0]);
         }
+    }
+    if (use_uring && workers > 0) usage(argv[0]);
+    // only the single event loop knows how to hand over
+    if (handoff_path && (!use_epoll || shards > 0 || workers > 0)) usage(argv[0]);
+    if (selfplay > 0) {
+        if (optind != argc) usage(argv[0]);
+        return run_selfplay(selfplay);
+    }
+    if (simulate > 0) {
+        if (optind != argc) usage(argv[0]);
+        ngp_init();
+        bot_init();
+        return sim_run(simulate, seed, sim_clients, lobby_size);
+    }
+    if (optind != argc - 1) {
+        printf("Specify only the port number\n");
+        usage(argv[0]);
+    }
+    const char *port = argv[optind];
 
-        if (ready > 0 && FD_ISSET(p->fd, &readfds)) {
-            char buf[128];
-            int n = player_receive(p, buf, sizeof(buf));
-            if (n <= 0) {
-                pthread_mutex_lock(&queue_mutex);
-                remove_player(p);
-                pthread_mutex_unlock(&queue_mutex);
-                player_destroy(p);
-                return NULL;
-            }
+    install_handlers();
+    ngp_init();
+    bot_init();
+
+    // a server already on the handoff socket passes this one its
+    // listeners and then its connections; with nobody there it starts fresh
+    int from = -1, listener = -1, admin_fd = -1;
+    HandoffHello hello;
+    if (handoff_path && (from = handoff_connect(handoff_path)) >= 0) {
+        if (handoff_hello(from, &hello, &listener, &admin_fd) < 0) {
+            perror("handoff");
+            exit(EXIT_FAILURE);
+        }
+        game_serial_floor(hello.serial);
+        // this process's --backlog and --defer-accept, not the old one's
+        if (tune_listener(listener) < 0) perror("listen");
+    }
 
-            char fields[6][128];
-            int count = player_parse(buf, fields, 6);
-
-            if (count >= 3 && strcmp(fields[2], "MOVE") == 0) {
-                player_send_fail(p, "24 Not Playing");
-                pthread_mutex_lock(&queue_mutex);
-                remove_player(p);
-                pthread_mutex_unlock(&queue_mutex);
-                player_destroy(p);
-                return NULL;
-            } else if (count >= 3 && strcmp(fields[2], "OPEN") == 0) {
-                player_send_fail(p, "23 Already Open");
-                pthread_mutex_lock(&queue_mutex);
-                remove_player(p);
-                pthread_mutex_unlock(&queue_mutex);
-                player_destroy(p);
-                return NULL;
-            } else {
-                // Some other invalid message
-                player_send_fail(p, "10 Invalid");
-            }
+    if (admin_fd >= 0 && admin && strcmp(admin, hello.admin) == 0) {
+        if (metrics_adopt(admin_fd, admin) < 0) {
+            perror("metrics_serve");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        if (admin_fd >= 0) close(admin_fd);
+        if (admin && metrics_serve(admin) < 0) {
+            perror("metrics_serve");
+            exit(EXIT_FAILURE);
         }
     }
 
-    return NULL;
-}
+    if (log_path && evlog_start(log_path, log_sync) < 0) {
+        perror("evlog_start");
+        exit(EXIT_FAILURE);
+    }
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        printf("Specify only the port number\n");
+    // carve the pools up front so a connection storm does not hit malloc
+    if (pool_prewarm(&player_pool, prewarm) < 0 || pool_prewarm(&game_pool, prewarm / 2) < 0) {
+        fprintf(stderr, "could not prewarm pools\n");
         exit(EXIT_FAILURE);
     }
 
-    install_handlers();
-    int listener = open_listener(argv[1], Q_SIZE);
+    if (shards > 0) {
+        // each shard opens its own listener on the port
+        printf("Server running on port %s (%d shards)...\n", port, shards);
+        if (reactor_run_shards(port, shards, pin, lobby_size, use_uring) < 0)
+            exit(EXIT_FAILURE);
+        printf("Server shutting down.\n");
+        evlog_stop();
+        evlog_report(stdout);
+        report_pools();
+        metrics_close();
+        return 0;
+    }
+
+    if (listener < 0) listener = open_listener(port, 0);
     if (listener < 0) {
         perror("open_listener");
         exit(EXIT_FAILURE);
     }
 
-    printf("Server running on port %s...\n", argv[1]);
+    if (workers > 0) {
+        Reactor r;
+        WorkerPool wp;
+        if (reactor_init(&r, listener, lobby_size) < 0) {
+            perror("reactor_init");
+            exit(EXIT_FAILURE);
+        }
+        if (workers_init(&wp, workers, queue_depth) < 0) {
+            perror("workers_init");
+            exit(EXIT_FAILURE);
+        }
+        printf("Server running on port %s (%d workers)...\n", port, workers);
+        reactor_run_workers(&r, &wp);
+        workers_stop(&wp);
+        printf("Server shutting down.\n");
+        printf("%ld connections, %ld games\n", r.accepted, r.games);
+        workers_report(&wp, stdout);
+        evlog_stop();
+        evlog_report(stdout);
+        report_pools();
+        metrics_close();
+        workers_free(&wp);
+        reactor_free(&r);
+        close(listener);
+        return 0;
+    }
+
+    if (use_epoll) {
+        Reactor r;
+        if (reactor_init(&r, listener, lobby_size) < 0) {
+            perror("reactor_init");
+            exit(EXIT_FAILURE);
+        }
+        if (use_uring && reactor_use_uring(&r) < 0) perror("io_uring unavailable, using epoll");
+        if (from >= 0) {
+            int n = reactor_take_over(&r, from);
+            if (n < 0) {
+                perror("handoff");
+                exit(EXIT_FAILURE);
+            }
+            close(from);
+            printf("Took over %d connections from pid %d.\n", n, hello.pid);
+        }
+        if (handoff_path && reactor_handoff(&r, handoff_path) < 0) {
+            perror("handoff");
+            exit(EXIT_FAILURE);
+        }
+        printf("Server running on port %s (%s)...\n", port, r.ring ? "io_uring" : "epoll");
+        reactor_run(&r);
+        int handed_off = r.handed_off;
+        reactor_free(&r);
+        // after a handoff the sockets at both paths are the new process's
+        printf(handed_off ? "Server handed off.\n" : "Server shutting down.\n");
+        evlog_stop();
+        evlog_report(stdout);
+        report_pools();
+        if (!handed_off) {
+            metrics_close();
+            if (handoff_path) unlink(handoff_path);
+        }
+        close(listener);
+        return 0;
+    }
+
+    if (lobby_init(&lobby, lobby_size) < 0) {
+        perror("lobby_init");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Server running on port %s...\n", port);
 
+    // the listener is non blocking: wait for it, then drain the backlog.
+    // Clients stay blocking, their threads read them that way.
     while (active) {
-        struct sockaddr_storage remote_host;
-        socklen_t len = sizeof(remote_host);
-
-        int client = accept(listener, (struct sockaddr *)&remote_host, &len);
-        if (!active) break;
-        if (client < 0) {
-            if (errno == EINTR) continue;
+        struct pollfd pfd = { .fd = listener, .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0) continue;
+
+        int clients[ACCEPT_BATCH];
+        int n = accept_batch(listener, clients, ACCEPT_BATCH, SOCK_CLOEXEC);
+        if (n < 0) {
+            // out of descriptors, most likely: let the games free some
+            perror("accept");
+            poll(NULL, 0, 10);
             continue;
         }
+        metrics_add(M_CONNECTIONS, n);
 
-        printf("Client connected.\n");
-
-        pthread_t tid;
-        int *c = malloc(sizeof(int));
-        *c = client;
-        pthread_create(&tid, NULL, client_thread, c);
-        pthread_detach(tid);
+        for (int i = 0; i < n; i++) {
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, client_thread, (void *)(intptr_t)clients[i]) != 0) {
+                close(clients[i]);
+                continue;
+            }
+            pthread_detach(tid);
+        }
     }
 
     printf("Server shutting down.\n");
+    evlog_stop();
+    evlog_report(stdout);
+    report_pools();
+    metrics_close();
     shutdown(listener, SHUT_RDWR);
     close(listener);
     return 0;
@@ -0,0 +1,25 @@
+#ifndef NIMD_H
+#define NIMD_H
+
+// connections taken off a listener per accept_batch; an event loop takes
+// one batch a turn so a storm of them cannot hold up the games
+#define ACCEPT_BATCH 64
+
+extern volatile int active;
+// in milliseconds, 0 turns a timeout off
+extern long open_timeout;
+extern long idle_timeout;
+extern long move_timeout;
+// how long a lone player waits before the house bot takes it, 0 = never
+extern long bot_wait;
+// the listen backlog, which the kernel caps at net.core.somaxconn, and
+// TCP_DEFER_ACCEPT in seconds, 0 = off; see --backlog and --defer-accept
+extern int listen_backlog;
+extern int defer_accept;
+
+int open_listener(const char *port, int reuseport);
+int tune_listener(int listener);
+void tune_client(int fd);
+int accept_batch(int listener, int *fds, int max, int flags);
+
+#endif
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include "evlog.h"
+
+// nimlog: prints the event log nimd --log PATH writes, one line per
+// record. PATH names the log (PATH.000000 onward) or a single segment;
+// -f keeps reading as the server appends and moves on to new segments.
+
+static char buf[64 * 1024];
+static int buf_len;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-f] PATH\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static void print_time(uint64_t ns) {
+    time_t sec = ns / 1000000000;
+    struct tm tm;
+    char when[32];
+    gmtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+    printf("%s.%06u", when, (unsigned)(ns % 1000000000 / 1000));
+}
+
+// a board is its pile count and then the piles
+static int print_board(const uint8_t *p, int len) {
+    if (len < 1 || len < 1 + p[0]) return -1;
+    printf(" [");
+    for (int i = 0; i < p[0]; i++) printf(i ? " %d" : "%d", p[1 + i]);
+    printf("]");
+    return 1 + p[0];
+}
+
+// a string ending in NUL, or running to the end of the record
+static int print_str(const char *p, int len) {
+    int n = strnlen(p, len);
+    if (n) printf(" %.*s", n, p);
+    return n < len ? n + 1 : n;
+}
+
+static void print_record(const EvRecord *r) {
+    const char *pay = (const char *)(r + 1);
+    int len = r->size - sizeof(*r);
+    print_time(r->time);
+    if (r->game) printf(" game %llu", (unsigned long long)r->game);
+    switch (r->type) {
+    case EV_OPEN:
+        printf(" OPEN %.*s", len, pay);
+        break;
+    case EV_MATCH: {
+        printf(" MATCH");
+        int n = print_board((const uint8_t *)pay, len);
+        if (n < 0) break;
+        n += print_str(pay + n, len - n);
+        print_str(pay + n, len - n);
+        break;
+    }
+    case EV_MOVE:
+        printf(" MOVE p%d pile %u count %u", r->player, r->arg >> 8, r->arg & 0xff);
+        break;
+    case EV_FAIL: {
+        printf(" FAIL");
+        if (r->player) printf(" p%d", r->player);
+        int n = print_str(pay, len);
+        printf(" %.*s", len - n, pay + n);
+        break;
+    }
+    case EV_OVER:
+        printf(" OVER winner p%u%s", r->arg & 0xff, r->arg >> 8 ? " forfeit" : "");
+        print_board((const uint8_t *)pay, len);
+        break;
+    default:
+        printf(" type %d, %d bytes", r->type, r->size);
+        break;
+    }
+    putchar('\n');
+}
+
+// prints every whole record in buf and keeps a partial one at the front
+static void print_records(void) {
+    int off = 0;
+    while (buf_len - off >= (int)sizeof(EvRecord)) {
+        EvRecord r;
+        memcpy(&r, buf + off, sizeof(r));
+        if (r.size < sizeof(r) || r.size > EVLOG_RECORD_MAX) {
+            fprintf(stderr, "nimlog: bad record size %d\n", r.size);
+            exit(EXIT_FAILURE);
+        }
+        if (buf_len - off < r.size) break;
+        uint64_t rec[EVLOG_RECORD_MAX / 8];
+        memcpy(rec, buf + off, r.size);
+        print_record((const EvRecord *)rec);
+        off += r.size;
+    }
+    memmove(buf, buf + off, buf_len - off);
+    buf_len -= off;
+}
+
+static int open_segment(const char *name) {
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    char header[EVLOG_HEADER];
+    uint32_t version;
+    if (read(fd, header, sizeof(header)) != (ssize_t)sizeof(header) ||
+        memcmp(header, EVLOG_MAGIC, 8) != 0) {
+        fprintf(stderr, "nimlog: %s is not an event log\n", name);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&version, header + 8, 4);
+    if (version != EVLOG_VERSION) {
+        fprintf(stderr, "nimlog: %s is version %u, not %d\n", name, version, EVLOG_VERSION);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// reads one segment to its end; with follow, until the next one appears
+static void read_segment(int fd, int follow, const char *next) {
+    int done = 0;
+    for (;;) {
+        ssize_t n = read(fd, buf + buf_len, sizeof(buf) - buf_len);
+        if (n < 0) {
+            perror("read");
+            exit(EXIT_FAILURE);
+        }
+        if (n > 0) {
+            buf_len += n;
+            print_records();
+            continue;
+        }
+        if (!follow || done) break;
+        // the server finishes a segment before it starts the next, so one
+        // more pass after the next one shows up reads the rest
+        if (next && access(next, F_OK) == 0) {
+            done = 1;
+            continue;
+        }
+        fflush(stdout);
+        usleep(100000);
+    }
+    // a segment ends on a record; anything left was cut off by a crash
+    if (buf_len > 0) fprintf(stderr, "nimlog: %d bytes of a partial record\n", buf_len);
+    buf_len = 0;
+}
+
+int main(int argc, char **argv) {
+    int follow = 0;
+    int c;
+    while ((c = getopt(argc, argv, "f")) != -1) {
+        if (c == 'f') follow = 1;
+        else usage(argv[0]);
+    }
+    if (optind != argc - 1) usage(argv[0]);
+    const char *path = argv[optind];
+
+    // a single segment named outright
+    if (access(path, F_OK) == 0) {
+        int fd = open_segment(path);
+        read_segment(fd, follow, NULL);
+        close(fd);
+        return 0;
+    }
+
+    char name[4096], next[4096];
+    int seg = 0;
+    snprintf(name, sizeof(name), "%s.%06d", path, seg);
+    if (access(name, F_OK) < 0) {
+        fprintf(stderr, "nimlog: no log at %s\n", path);
+        return EXIT_FAILURE;
+    }
+    for (;;) {
+        snprintf(next, sizeof(next), "%s.%06d", path, seg + 1);
+        int fd = open_segment(name);
+        read_segment(fd, follow, next);
+        close(fd);
+        if (access(next, F_OK) < 0) break;
+        seg++;
+        memcpy(name, next, sizeof(name));
+    }
+    return 0;
+}
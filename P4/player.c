@@ -0,0 +1,479 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "player.h"
+#include "names.h"
+#include "metrics.h"
+#include "rating.h"
+#include "evlog.h"
+#include "watch.h"
+
+static int player_init(void *obj) {
+    Player *p = obj;
+    p->wbuf = p->winline;
+    p->wcap = WBUF_INLINE;
+    return pthread_mutex_init(&p->wlock, NULL) == 0 ? 0 : -1;
+}
+
+// players and their receive and send buffers come from one pool
+Pool player_pool = POOL_INITIALIZER_INIT("player", Player, player_init);
+
+int player_high_water = 64 * 1024;
+
+__thread Player **player_outbox;
+
+Player *player_create(int fd) {
+    Player *p = pool_alloc(&player_pool);
+    if (!p) return NULL;
+    p->fd = fd;
+    p->io = &tcp_transport;
+    p->chan = NULL;
+    p->name = NULL;
+    p->in_game = 0;
+    p->wake = -1;
+    p->player_number = 0;
+    p->has_opened = 0;
+    p->begun = 0;
+    p->state = P_OPENING;
+    p->bot = 0;
+    p->binary = 0;
+    p->game = NULL;
+    p->watch = NULL;
+    p->next_dead = NULL;
+    timer_init(&p->timer, NULL, p);
+    p->timed_out = 0;
+    p->lobby_prev = p->lobby_next = NULL;
+    p->queued = 0;
+    p->rating = RATING_START;
+    p->queued_at = 0;
+    p->registered = 0;
+    p->rstart = 0;
+    p->rend = 0;
+    p->rhold = -1;
+    p->wstart = 0;
+    p->wend = 0;
+    p->corked = 0;
+    p->overflowed = 0;
+    p->ring = 0;
+    p->outbox = 0;
+    p->next_out = NULL;
+    p->conn_prev = p->conn_next = NULL;
+    return p;
+}
+
+void player_destroy(Player *p) {
+    if (!p) return;
+    watch_leave(p);
+    if (!p->bot) names_release(p->name);
+    if (player_connected(p)) {
+        // last chance for a queued OVER or FAIL; whatever the socket
+        // will not take now is lost
+        player_flush(p);
+        player_hang_up(p);
+    }
+    if (p->wbuf != p->winline) {
+        free(p->wbuf);
+        p->wbuf = p->winline;
+        p->wcap = WBUF_INLINE;
+    }
+    pool_free(&player_pool, p);
+}
+
+// a socket or a memory channel still open on the server's side
+int player_connected(const Player *p) {
+    return p->fd >= 0 || p->chan;
+}
+
+void player_hang_up(Player *p) {
+    if (player_connected(p)) p->io->close(p);
+}
+
+void player_shutdown(Player *p, int how) {
+    p->io->shutdown(p, how);
+}
+
+int player_send(Player *p, const char *message) {
+    return player_write(p, message, strlen(message));
+}
+
+// Sends never block. A frame goes straight to the socket when nothing is
+// queued ahead of it, and whatever the socket does not take waits in the
+// player's queue until player_flush finds it writable again. While a
+// player is corked its frames are only queued, so everything it is sent
+// in one go (a FAIL and then a PLAY, two PLAYs around a bot move) leaves
+// in a single send. A player whose queue would pass player_high_water has
+// stopped reading: its queue is dropped and its read side shut down, so
+// its next read ends the connection the usual way.
+
+// the queue is gone along with the connection; caller holds wlock
+static void queue_drop(Player *p) {
+    p->wstart = p->wend = 0;
+}
+
+static int send_error(Player *p, const char *what) {
+    // peers hanging up mid game is routine, anything else is worth a look
+    if (errno != EPIPE && errno != ECONNRESET && errno != EBADF) perror(what);
+    queue_drop(p);
+    return -1;
+}
+
+// room for len more bytes at the end of the queue; caller holds wlock
+static int queue_reserve(Player *p, int len) {
+    int queued = p->wend - p->wstart;
+    if (p->overflowed) return -1;
+    if (player_high_water > 0 && queued + len > player_high_water) {
+        p->overflowed = 1;
+        queue_drop(p);
+        player_shutdown(p, SHUT_RD);
+        metrics_add(M_SLOW_CONSUMERS, 1);
+        return -1;
+    }
+    if (p->wend + len <= p->wcap) return 0;
+    if (p->wstart > 0) {
+        memmove(p->wbuf, p->wbuf + p->wstart, queued);
+        p->wstart = 0;
+        p->wend = queued;
+        if (p->wend + len <= p->wcap) return 0;
+    }
+    int cap = p->wcap;
+    while (cap < queued + len) cap *= 2;
+    char *grown = malloc(cap);
+    if (!grown) return -1;
+    memcpy(grown, p->wbuf, queued);
+    if (p->wbuf != p->winline) free(p->wbuf);
+    p->wbuf = grown;
+    p->wcap = cap;
+    return 0;
+}
+
+static int queue_append(Player *p, const char *buf, int len) {
+    if (queue_reserve(p, len) < 0) return -1;
+    memcpy(p->wbuf + p->wend, buf, len);
+    p->wend += len;
+    if (player_outbox && !p->outbox) {
+        p->outbox = 1;
+        p->next_out = *player_outbox;
+        *player_outbox = p;
+    }
+    return 0;
+}
+
+// sends what the socket takes; the bytes left queued or -1, under wlock
+static int queue_flush(Player *p) {
+    while (p->wstart < p->wend) {
+        struct iovec iov = { p->wbuf + p->wstart, p->wend - p->wstart };
+        ssize_t n = p->io->sendv(p, &iov, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n < 0) return send_error(p, "send");
+        p->wstart += n;
+    }
+    if (p->wstart == p->wend) queue_drop(p);
+    return p->wend - p->wstart;
+}
+
+// len once the frame is sent or queued, -1 if the connection is gone
+int player_write(Player *p, const char *buf, int len) {
+    if (p->bot) return len;
+    pthread_mutex_lock(&p->wlock);
+    int sent = 0;
+    if (p->wstart == p->wend && !p->corked && !p->overflowed) {
+        struct iovec iov = { (char *)buf, len };
+        for (;;) {
+            ssize_t n = p->io->sendv(p, &iov, 1);
+            if (n < 0 && errno == EINTR) continue;
+            if (n >= 0) sent = n;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK) sent = send_error(p, "send");
+            break;
+        }
+    }
+    if (sent >= 0 && sent < len && queue_append(p, buf + sent, len - sent) < 0) sent = -1;
+    pthread_mutex_unlock(&p->wlock);
+    return sent < 0 ? -1 : len;
+}
+
+// several frames for the same player in one syscall
+int player_writev(Player *p, const struct iovec *iov, int count) {
+    int len = 0;
+    for (int i = 0; i < count; i++) len += iov[i].iov_len;
+    if (p->bot) return len;
+    pthread_mutex_lock(&p->wlock);
+    int sent = 0;
+    if (p->wstart == p->wend && !p->corked && !p->overflowed) {
+        for (;;) {
+            ssize_t n = p->io->sendv(p, iov, count);
+            if (n < 0 && errno == EINTR) continue;
+            if (n >= 0) sent = n;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK) sent = send_error(p, "sendmsg");
+            break;
+        }
+    }
+    // queue whatever of each frame did not go out
+    int skip = sent;
+    for (int i = 0; sent >= 0 && i < count; i++) {
+        int fl = iov[i].iov_len;
+        if (skip >= fl) {
+            skip -= fl;
+            continue;
+        }
+        if (queue_append(p, (const char *)iov[i].iov_base + skip, fl - skip) < 0) sent = -1;
+        skip = 0;
+    }
+    pthread_mutex_unlock(&p->wlock);
+    return sent < 0 ? -1 : len;
+}
+
+// sends as much of the queue as the socket takes, corked or not; returns
+// the bytes still queued, or -1 once the connection is known to be gone
+int player_flush(Player *p) {
+    if (p->bot) return 0;
+    pthread_mutex_lock(&p->wlock);
+    int left = p->wstart < p->wend ? queue_flush(p) : 0;
+    pthread_mutex_unlock(&p->wlock);
+    return left;
+}
+
+int player_queued(Player *p) {
+    pthread_mutex_lock(&p->wlock);
+    int queued = p->wend - p->wstart;
+    pthread_mutex_unlock(&p->wlock);
+    return queued;
+}
+
+void player_cork(Player *p) {
+    if (p->bot) return;
+    pthread_mutex_lock(&p->wlock);
+    p->corked = 1;
+    pthread_mutex_unlock(&p->wlock);
+}
+
+// lets the frames gathered since player_cork go, in one send
+void player_uncork(Player *p) {
+    if (p->bot) return;
+    pthread_mutex_lock(&p->wlock);
+    p->corked = 0;
+    if (p->wstart < p->wend) queue_flush(p);
+    pthread_mutex_unlock(&p->wlock);
+}
+
+// For an event loop that makes its own sends (the io_uring backend): the
+// queued bytes, which stay put until player_sent is told how many of them
+// the socket took, or the -errno it failed with. player_sent returns the
+// bytes still queued, or -1 once the connection is known to be gone.
+const char *player_outbound(Player *p, int *len) {
+    pthread_mutex_lock(&p->wlock);
+    *len = p->wend - p->wstart;
+    const char *buf = p->wbuf + p->wstart;
+    pthread_mutex_unlock(&p->wlock);
+    return buf;
+}
+
+int player_sent(Player *p, int res) {
+    int transient = res == -EAGAIN || res == -EWOULDBLOCK || res == -EINTR;
+    pthread_mutex_lock(&p->wlock);
+    int left;
+    if (res < 0 && !transient) {
+        errno = -res;
+        left = send_error(p, "send");
+    } else {
+        if (res > 0) p->wstart += res;
+        if (p->wstart == p->wend) queue_drop(p);
+        left = p->wend - p->wstart;
+    }
+    pthread_mutex_unlock(&p->wlock);
+    return left;
+}
+
+void player_send_fail(Player *p, const char *reason) {
+    char buf[NGP_BUF_SIZE];
+    metrics_fail(reason);
+    evlog_fail(p, reason);
+    player_write(p, buf, p->binary ? ngpb_fail(buf, reason) : ngp_fail(buf, reason));
+}
+
+// the frame for p in whichever codec it speaks
+int player_encode_name(Player *p, char *buf, int number, const char *name) {
+    return p->binary ? ngpb_name(buf, number, name) : ngp_name(buf, number, name);
+}
+
+int player_encode_play(Player *p, char *buf, int turn, const uint8_t *board, int piles) {
+    return p->binary ? ngpb_play(buf, turn, board, piles) : ngp_play(buf, turn, board, piles);
+}
+
+int player_encode_over(Player *p, char *buf, int winner, const uint8_t *board, int piles, int forfeit) {
+    return p->binary ? ngpb_over(buf, winner, board, piles, forfeit)
+                     : ngp_over(buf, winner, board, piles, forfeit);
+}
+
+// Incoming bytes are framed incrementally: one read may carry several
+// frames or only part of one. Complete frames are handed out in place,
+// terminated by overwriting the byte after them, which is put back
+// before the buffer is touched again.
+
+static void player_release(Player *p) {
+    if (p->rhold >= 0) {
+        p->rbuf[p->rhold] = p->rsaved;
+        p->rhold = -1;
+    }
+}
+
+// 1 if a whole frame is buffered (*len is its size), 0 if more bytes
+// are needed, -1 if the header is already known to be bad
+static int frame_scan(Player *p, int *len) {
+    int avail = p->rend - p->rstart;
+    const char *s = p->rbuf + p->rstart;
+    if (p->binary) {
+        if (avail > 1 && (unsigned char)s[1] > NGPB_MAX_PAYLOAD) return -1;
+        if (avail < NGPB_HEADER || avail < NGPB_HEADER + (unsigned char)s[1]) return 0;
+        *len = NGPB_HEADER + (unsigned char)s[1];
+        return 1;
+    }
+    if (avail > 0 && s[0] != '0') return -1;
+    if (avail > 1 && s[1] != '|') return -1;
+    if (avail > 2 && !isdigit((unsigned char)s[2])) return -1;
+    if (avail > 3 && !isdigit((unsigned char)s[3])) return -1;
+    if (avail > 4 && s[4] != '|') return -1;
+    if (avail < 5) return 0;
+
+    int declared_len = (s[2] - '0') * 10 + (s[3] - '0');
+    if (avail < 5 + declared_len) return 0;
+    *len = 5 + declared_len;
+    return 1;
+}
+
+// makes room at the free end of the buffer, sliding a partial frame back
+// to the front when the tail gets short
+static void player_make_room(Player *p) {
+    player_release(p);
+    if (p->rstart == p->rend) {
+        p->rstart = p->rend = 0;
+    } else if (p->rstart > 0 && RBUF_SIZE - p->rend < NGP_MAX_FRAME) {
+        memmove(p->rbuf, p->rbuf + p->rstart, p->rend - p->rstart);
+        p->rend -= p->rstart;
+        p->rstart = 0;
+    }
+}
+
+// reads whatever the connection has into the free end of the buffer
+int player_fill(Player *p) {
+    player_make_room(p);
+    int n = p->io->recv(p, p->rbuf + p->rend, RBUF_SIZE - p->rend);
+    if (n > 0) p->rend += n;
+    return n;
+}
+
+// the same for bytes that were received some other way (the io_uring
+// backend's provided buffers); returns how many of them fit
+int player_feed(Player *p, const char *data, int len) {
+    player_make_room(p);
+    if (len > RBUF_SIZE - p->rend) len = RBUF_SIZE - p->rend;
+    memcpy(p->rbuf + p->rend, data, len);
+    p->rend += len;
+    return len;
+}
+
+// the bytes received but not yet a whole frame, for handing the
+// connection to another process
+const char *player_inbound(Player *p, int *len) {
+    player_release(p);
+    *len = p->rend - p->rstart;
+    return p->rbuf + p->rstart;
+}
+
+// true when player_next_frame would return without more input
+int player_pending(Player *p) {
+    int len;
+    player_release(p);
+    return frame_scan(p, &len) != 0;
+}
+
+// hands out the next complete frame, already split into fields; 1 on
+// success, 0 if more bytes are needed, -1 on a bad message (FAIL already sent)
+int player_next_frame(Player *p, NgpMsg *m) {
+    int len;
+    player_release(p);
+    int status = frame_scan(p, &len);
+    if (status == 0) return 0;
+    if (status < 0) {
+        player_send_fail(p, "10 Invalid");
+        return -1;
+    }
+
+    char *buf = p->rbuf + p->rstart;
+    p->rhold = p->rstart + len;
+    p->rsaved = p->rbuf[p->rhold];
+    p->rbuf[p->rhold] = '\0';
+    p->rstart += len;
+
+    // NAME, PLAY and OVER only ever come from the server, but they are
+    // well formed; the state machines turn them away
+    int count = p->binary ? ngpb_parse(buf, len, m) : ngp_parse(buf, len, m);
+    if (count < 3 || m->type == NGP_NONE) {
+        player_send_fail(p, "10 Invalid");
+        return -1;
+    }
+    return 1;
+}
+
+// for callers that just saw the socket readable: at most one read, then
+// 1 with a frame, 0 if the frame is still incomplete, -1 if the player is gone
+int player_poll(Player *p, NgpMsg *m) {
+    if (!player_pending(p) && player_fill(p) <= 0) return -1;
+    return player_next_frame(p, m);
+}
+
+// blocks until a whole frame arrives; 1 on success, 0 on EOF, -1 on error
+int player_receive(Player *p, NgpMsg *m) {
+    for (;;) {
+        int status = player_next_frame(p, m);
+        if (status != 0) return status;
+        int n = player_fill(p);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return n;
+    }
+}
+
+// copies the name from a validated OPEN message into name (NAME_BUF bytes);
+// the caller claims it with names_claim. An OPEN that asks for NGP-B
+// switches p over before anything is sent back.
+int player_open(Player *p, const NgpMsg *m, char *name) {
+    int binary = m->count == 5 && m->field[4].len == 1 &&
+                 m->buf[m->field[4].off] == NGPB_OPTION[0];
+    if ((m->count != 4 && !binary) || m->type != NGP_OPEN) {
+        player_send_fail(p, "10 Invalid");
+        return -1;
+    }
+    p->binary = binary;
+
+    int len = m->field[3].len < NAME_BUF - 1 ? m->field[3].len : NAME_BUF - 1;
+    memcpy(name, m->buf + m->field[3].off, len);
+    name[len] = '\0';
+    p->has_opened = 1;
+    // a binary OPEN can carry bytes no text frame could, and the name
+    // goes out to a text opponent in NAME
+    if (len == 0 || memchr(name, '|', len) || memchr(name, '\0', len)){
+        player_send_fail(p, "10 Invalid");
+        return -1;
+    }
+    metrics_add(M_OPENS, 1);
+    return 0;
+}
+
+int player_receive_open(Player *p, char *name) {
+    NgpMsg m;
+    int n = player_receive(p, &m);
+    if (n <= 0) return -1;
+    return player_open(p, &m, name);
+}
+
+
+void player_send_wait(Player *p) {
+    char buf[NGP_BUF_SIZE];
+    metrics_add(M_WAITS, 1);
+    player_write(p, buf, p->binary ? ngpb_wait(buf) : ngp_wait(buf));
+}
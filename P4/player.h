@@ -0,0 +1,120 @@
+#ifndef PLAYER_H
+#define PLAYER_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "ngp.h"
+#include "pool.h"
+#include "timer.h"
+#include "transport.h"
+
+struct Game;
+struct Watcher;
+
+#define RBUF_SIZE 256
+// outbound bytes held in the Player itself before the queue spills to the heap
+#define WBUF_INLINE 256
+// room for the longest accepted name plus one, so over-long names show
+#define NAME_BUF 74
+
+// connection states used by the event loop
+enum { P_OPENING, P_WAITING, P_PLAYING, P_CLOSED, P_WATCHING };
+
+typedef struct Player {
+    int fd;
+    // how p's bytes move, see transport.h: tcp_transport on fd, or the
+    // memory channel chan
+    const Transport *io;
+    void *chan;
+    const char *name;
+    int in_game;
+    // thread mode: the eventfd that wakes p's lobby thread when p is matched
+    int wake;
+    int player_number;
+    int has_opened;
+    int begun;
+    int state;
+    // the house bot, see bot.h
+    int bot;
+    // speaks NGP-B, see ngp.h
+    int binary;
+    struct Game *game;
+    // a spectator's subscription, see watch.h
+    struct Watcher *watch;
+    struct Player *next_dead;
+    // OPEN deadline, lobby idle timeout or move clock, whichever applies
+    Timer timer;
+    int timed_out;
+    // lobby links, see lobby.h
+    struct Player *lobby_prev;
+    struct Player *lobby_next;
+    int queued;
+    int registered;
+    // the name's rating when it opened (see rating.h), and when it joined
+    // the lobby in timer_now_ms() time
+    int rating;
+    uint64_t queued_at;
+    // receive buffer, frames are parsed in place between rstart and rend
+    char rbuf[RBUF_SIZE + 1];
+    int rstart;
+    int rend;
+    int rhold;
+    char rsaved;
+    // outbound queue, see player_write; wlock guards it, since on the
+    // worker pool the opponent's task writes too
+    pthread_mutex_t wlock;
+    char *wbuf;
+    int wstart;
+    int wend;
+    int wcap;
+    int corked;
+    int overflowed;
+    char winline[WBUF_INLINE];
+    // io_uring backend, see reactor.c: requests still in flight, and the
+    // link on the list of players with frames to send
+    int ring;
+    int outbox;
+    struct Player *next_out;
+    // every connection an event loop holds, for the hot upgrade
+    struct Player *conn_prev;
+    struct Player *conn_next;
+} Player;
+
+extern Pool player_pool;
+// queued outbound bytes a player may have before it is cut off, 0 for no limit
+extern int player_high_water;
+// set by an event loop that makes its own sends; a player whose queue
+// was empty is linked here when a frame is queued for it
+extern __thread Player **player_outbox;
+
+Player *player_create(int fd);
+void player_destroy(Player *p);
+int player_connected(const Player *p);
+void player_hang_up(Player *p);
+void player_shutdown(Player *p, int how);
+int player_send(Player *p, const char *message);
+int player_write(Player *p, const char *buf, int len);
+int player_writev(Player *p, const struct iovec *iov, int count);
+int player_flush(Player *p);
+int player_queued(Player *p);
+void player_cork(Player *p);
+void player_uncork(Player *p);
+const char *player_outbound(Player *p, int *len);
+int player_sent(Player *p, int res);
+const char *player_inbound(Player *p, int *len);
+void player_send_fail(Player *p, const char *reason);
+int player_encode_name(Player *p, char *buf, int number, const char *name);
+int player_encode_play(Player *p, char *buf, int turn, const uint8_t *board, int piles);
+int player_encode_over(Player *p, char *buf, int winner, const uint8_t *board, int piles, int forfeit);
+int player_fill(Player *p);
+int player_feed(Player *p, const char *data, int len);
+int player_pending(Player *p);
+int player_next_frame(Player *p, NgpMsg *m);
+int player_poll(Player *p, NgpMsg *m);
+int player_receive(Player *p, NgpMsg *m);
+int player_open(Player *p, const NgpMsg *m, char *name);
+int player_receive_open(Player *p, char *name);
+void player_send_wait(Player *p);
+
+#endif
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include "pool.h"
+
+#define SLAB_OBJECTS 64
+#define POOL_MAX 16
+#define POOL_CACHE_MAX 256
+
+int pool_cache_size = 64;
+
+typedef struct {
+    void *items[POOL_CACHE_MAX];
+    int count;
+} PoolCache;
+
+static Pool *pools[POOL_MAX];
+static int npools = 0;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static __thread PoolCache caches[POOL_MAX];
+static __thread int cache_registered = 0;
+
+// free list links live in the first word of a free object
+#define NEXT(obj) (*(void **)(obj))
+
+// caller holds p->lock
+static int pool_grow(Pool *p) {
+    char *slab = malloc(p->size * SLAB_OBJECTS);
+    if (!slab) return -1;
+    for (int i = 0; p->init && i < SLAB_OBJECTS; i++) {
+        if (p->init(slab + (size_t)i * p->size) < 0) {
+            free(slab);
+            return -1;
+        }
+    }
+    for (int i = SLAB_OBJECTS - 1; i >= 0; i--) {
+        void *obj = slab + (size_t)i * p->size;
+        NEXT(obj) = p->free_list;
+        p->free_list = obj;
+    }
+    p->capacity += SLAB_OBJECTS;
+    p->slabs++;
+    return 0;
+}
+
+// moves up to n objects between a cache and the shared free list
+static void cache_refill(Pool *p, PoolCache *c, int n) {
+    pthread_mutex_lock(&p->lock);
+    while (c->count < n) {
+        if (!p->free_list && pool_grow(p) < 0) break;
+        void *obj = p->free_list;
+        p->free_list = NEXT(obj);
+        c->items[c->count++] = obj;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void cache_drain(Pool *p, PoolCache *c, int keep) {
+    pthread_mutex_lock(&p->lock);
+    while (c->count > keep) {
+        void *obj = c->items[--c->count];
+        NEXT(obj) = p->free_list;
+        p->free_list = obj;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+// a thread that exits hands its cached objects back
+static void cache_release(void *unused) {
+    (void)unused;
+    int n = __atomic_load_n(&npools, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++)
+        if (caches[i].count) cache_drain(pools[i], &caches[i], 0);
+}
+
+static void cache_key_init(void) {
+    pthread_key_create(&cache_key, cache_release);
+}
+
+static PoolCache *cache_for(Pool *p) {
+    if (pool_cache_size <= 0) return NULL;
+    if (p->id < 0) {
+        pthread_mutex_lock(&pools_lock);
+        if (p->id < 0 && npools < POOL_MAX) {
+            pools[npools] = p;
+            __atomic_store_n(&p->id, npools, __ATOMIC_RELEASE);
+            __atomic_store_n(&npools, npools + 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&pools_lock);
+        if (p->id < 0) return NULL;
+    }
+    if (!cache_registered) {
+        pthread_once(&cache_once, cache_key_init);
+        pthread_setspecific(cache_key, caches);
+        cache_registered = 1;
+    }
+    return &caches[p->id];
+}
+
+static void count_alloc(Pool *p) {
+    long n = __atomic_add_fetch(&p->in_use, 1, __ATOMIC_RELAXED);
+    long hw = __atomic_load_n(&p->high_water, __ATOMIC_RELAXED);
+    while (n > hw && !__atomic_compare_exchange_n(&p->high_water, &hw, n, 1,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void *pool_alloc(Pool *p) {
+    void *obj = NULL;
+    PoolCache *c = cache_for(p);
+    int depth = pool_cache_size < POOL_CACHE_MAX ? pool_cache_size : POOL_CACHE_MAX;
+
+    if (c) {
+        if (c->count == 0) cache_refill(p, c, (depth + 1) / 2);
+        if (c->count > 0) obj = c->items[--c->count];
+    } else {
+        pthread_mutex_lock(&p->lock);
+        if (p->free_list || pool_grow(p) == 0) {
+            obj = p->free_list;
+            p->free_list = NEXT(obj);
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    if (obj) count_alloc(p);
+    return obj;
+}
+
+void pool_free(Pool *p, void *obj) {
+    if (!obj) return;
+    __atomic_sub_fetch(&p->in_use, 1, __ATOMIC_RELAXED);
+
+    PoolCache *c = cache_for(p);
+    int depth = pool_cache_size < POOL_CACHE_MAX ? pool_cache_size : POOL_CACHE_MAX;
+    if (c) {
+        if (c->count >= depth) cache_drain(p, c, depth / 2);
+        c->items[c->count++] = obj;
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    NEXT(obj) = p->free_list;
+    p->free_list = obj;
+    pthread_mutex_unlock(&p->lock);
+}
+
+// carves slabs until the pool holds at least count objects
+int pool_prewarm(Pool *p, long count) {
+    int err = 0;
+    pthread_mutex_lock(&p->lock);
+    while (p->capacity < count && (err = pool_grow(p)) == 0)
+        ;
+    pthread_mutex_unlock(&p->lock);
+    return err;
+}
+
+void pool_report(Pool *p, FILE *out) {
+    pthread_mutex_lock(&p->lock);
+    fprintf(out, "pool %-8s size %4zu  in use %8ld  high water %8ld  capacity %8ld  slabs %6ld\n",
+            p->name, p->size,
+            __atomic_load_n(&p->in_use, __ATOMIC_RELAXED),
+            __atomic_load_n(&p->high_water, __ATOMIC_RELAXED),
+            p->capacity, p->slabs);
+    pthread_mutex_unlock(&p->lock);
+}
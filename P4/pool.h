@@ -0,0 +1,39 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+// Fixed size object pool. Objects are carved out of slabs that are never
+// returned to the heap; freed objects go onto a free list, and each thread
+// keeps a small cache of them so most alloc/free pairs take no lock.
+typedef struct {
+    const char *name;
+    size_t size;
+    int id;
+    pthread_mutex_t lock;
+    void *free_list;
+    long capacity;
+    long slabs;
+    long in_use;
+    long high_water;
+    // runs once per object as its slab is carved, before first use; the
+    // first word of the object is the free list link and is not kept
+    int (*init)(void *obj);
+} Pool;
+
+// objects are rounded up to whole words, for the free list link
+#define POOL_INITIALIZER_INIT(name, type, init) \
+    { name, (sizeof(type) + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *), -1, \
+      PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, init }
+#define POOL_INITIALIZER(name, type) POOL_INITIALIZER_INIT(name, type, NULL)
+
+// per-thread cache depth for every pool, 0 turns the caches off
+extern int pool_cache_size;
+
+void *pool_alloc(Pool *p);
+void pool_free(Pool *p, void *obj);
+int pool_prewarm(Pool *p, long count);
+void pool_report(Pool *p, FILE *out);
+
+#endif
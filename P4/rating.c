@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "rating.h"
+#include "strtab.h"
+
+#define RATING_SHARDS 64
+#define SHARD_MAX (RATING_MAX / RATING_SHARDS)
+
+typedef struct Rating {
+    StrNode node;
+    // the shard's entries by last use, for eviction
+    struct Rating *newer;
+    struct Rating *older;
+    int rating;
+    char name[];
+} Rating;
+
+// one per shard and under its lock
+typedef struct {
+    Rating *newest;
+    Rating *oldest;
+} RatingLru;
+
+static StrTable table;
+static RatingLru lrus[RATING_SHARDS];
+static pthread_once_t rating_once = PTHREAD_ONCE_INIT;
+
+static void rating_init(void) {
+    if (strtab_init(&table, RATING_SHARDS) < 0) abort();
+}
+
+static void lru_unlink(RatingLru *l, Rating *e) {
+    if (e->newer) e->newer->older = e->older;
+    else l->newest = e->older;
+    if (e->older) e->older->newer = e->newer;
+    else l->oldest = e->newer;
+}
+
+static void lru_push(RatingLru *l, Rating *e) {
+    e->newer = NULL;
+    e->older = l->newest;
+    if (l->newest) l->newest->newer = e;
+    else l->oldest = e;
+    l->newest = e;
+}
+
+// with the shard locked: name's entry, now the shard's most recently
+// used, made at RATING_START when create is set and it has none; NULL if
+// there is none or no memory for one. A full shard lets its least
+// recently used name go to make room.
+static Rating *find(StrShard *s, const char *name, uint32_t h, int create) {
+    RatingLru *l = &lrus[s - table.shards];
+    size_t len = strlen(name);
+    Rating *e = (Rating *)strtab_find(&table, s, name, len, h);
+    if (e) {
+        lru_unlink(l, e);
+        lru_push(l, e);
+        return e;
+    }
+    if (!create) return NULL;
+    if (s->count >= SHARD_MAX) {
+        Rating *old = l->oldest;
+        lru_unlink(l, old);
+        strtab_remove(&table, s, &old->node);
+        free(old);
+    }
+    e = malloc(sizeof(Rating) + len + 1);
+    if (!e) return NULL;
+    memcpy(e->name, name, len + 1);
+    e->node.str = e->name;
+    e->node.hash = h;
+    e->node.len = len;
+    e->rating = RATING_START;
+    strtab_insert(&table, s, &e->node);
+    lru_push(l, e);
+    return e;
+}
+
+static StrShard *shard_of(const char *name, uint32_t *h) {
+    pthread_once(&rating_once, rating_init);
+    *h = strtab_hash(name, strlen(name));
+    return strtab_shard(&table, *h);
+}
+
+int rating_of(const char *name) {
+    uint32_t h;
+    StrShard *s = shard_of(name, &h);
+    pthread_mutex_lock(&s->lock);
+    Rating *e = find(s, name, h, 0);
+    int rating = e ? e->rating : RATING_START;
+    pthread_mutex_unlock(&s->lock);
+    return rating;
+}
+
+// -1 when there is no memory for the entry
+int rating_set(const char *name, int rating) {
+    uint32_t h;
+    StrShard *s = shard_of(name, &h);
+    pthread_mutex_lock(&s->lock);
+    Rating *e = find(s, name, h, 1);
+    if (e) e->rating = rating;
+    pthread_mutex_unlock(&s->lock);
+    return e ? 0 : -1;
+}
+
+static void adjust(const char *name, int delta) {
+    uint32_t h;
+    StrShard *s = shard_of(name, &h);
+    pthread_mutex_lock(&s->lock);
+    Rating *e = find(s, name, h, 1);
+    if (e) e->rating += delta;
+    pthread_mutex_unlock(&s->lock);
+}
+
+// g ended with an OVER for winner. Games against the house bot do not
+// count, its strength is whatever --bot-skill says. Each name is in one
+// game at a time, so reading both and adjusting each on its own is safe.
+void rating_over(const Game *g, int winner) {
+    if (g->p1->bot || g->p2->bot || !g->p1->name || !g->p2->name) return;
+    const char *won = winner == 1 ? g->p1->name : g->p2->name;
+    const char *lost = winner == 1 ? g->p2->name : g->p1->name;
+    double expected = 1 / (1 + pow(10, (rating_of(lost) - rating_of(won)) / 400.0));
+    int delta = (int)lround(RATING_K * (1 - expected));
+    adjust(won, delta);
+    adjust(lost, -delta);
+}
+
+// calls fn for every rated name, a shard locked at a time and oldest
+// first, so rating_set in the same order keeps which go first; stops
+// once fn returns -1
+int rating_each(int (*fn)(const char *name, int rating, void *arg), void *arg) {
+    pthread_once(&rating_once, rating_init);
+    for (int i = 0; i < RATING_SHARDS; i++) {
+        StrShard *s = &table.shards[i];
+        pthread_mutex_lock(&s->lock);
+        for (Rating *e = lrus[i].oldest; e; e = e->newer) {
+            if (fn(e->name, e->rating, arg) < 0) {
+                pthread_mutex_unlock(&s->lock);
+                return -1;
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef RATING_H
+#define RATING_H
+
+#include "game.h"
+
+// Elo ratings by name, kept for as long as the server runs and carried
+// over a hot upgrade. A name no game has ended for is at RATING_START;
+// every OVER between two people moves the winner up and the loser down
+// by the same amount, at most RATING_K. A strtab.h table like names.c's,
+// holding at most RATING_MAX names: past that the least recently seen go
+// and start over at RATING_START if they come back.
+
+#define RATING_START 1500
+#define RATING_K 32
+#define RATING_MAX 65536
+
+int rating_of(const char *name);
+int rating_set(const char *name, int rating);
+void rating_over(const Game *g, int winner);
+int rating_each(int (*fn)(const char *name, int rating, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,1744 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include "nimd.h"
+#include "game.h"
+#include "names.h"
+#include "metrics.h"
+#include "bot.h"
+#include "evlog.h"
+#include "handoff.h"
+#include "reactor.h"
+#include "watch.h"
+#include "rating.h"
+#ifndef NO_URING
+#include "uring.h"
+#endif
+
+// single threaded event loop: every lobby and game is a state machine
+// advanced by edge-triggered readiness on its player sockets
+
+#define MAX_EVENTS 256
+#define TIMER_TICK_MS 10
+
+// on the worker pool another thread may move a player to a new state,
+// so states are always read and written whole
+static int state_of(const Player *p) {
+    return __atomic_load_n(&p->state, __ATOMIC_ACQUIRE);
+}
+
+static void set_state(Player *p, int state) {
+    __atomic_store_n(&p->state, state, __ATOMIC_RELEASE);
+}
+
+// a waiting player's timer runs for the house bot's wait when that comes
+// before the idle timeout
+static int bot_first(void) {
+    return bot_wait > 0 && (idle_timeout == 0 || bot_wait < idle_timeout);
+}
+
+static void reactor_sweep(void *ctx, void *arg);
+static void reactor_accept_retry(void *ctx, void *arg);
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int reactor_init(Reactor *r, int listener, int capacity) {
+    r->listener = listener;
+    r->dead = NULL;
+    r->accepted = 0;
+    r->accept_more = 0;
+    r->games = 0;
+    r->shared = 0;
+    r->ring = NULL;
+    r->outbox = NULL;
+    r->sending = 0;
+    r->recv_multishot = 1;
+    r->quiescing = 0;
+    r->cancel_pending = 0;
+    r->players = NULL;
+    r->handoff = -1;
+    r->handoff_ready = 0;
+    r->handed_off = 0;
+    timer_wheel_init(&r->timers, TIMER_TICK_MS, r);
+    timer_init(&r->sweep, reactor_sweep, NULL);
+    timer_init(&r->accept_retry, reactor_accept_retry, NULL);
+    pthread_mutex_init(&r->timer_lock, NULL);
+    if (lobby_init(&r->lobby, capacity) < 0) return -1;
+
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) return -1;
+    r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->wakefd < 0) return -1;
+
+    // the listener and the wake fd are tagged with their own address,
+    // every other entry points at a player. Without a listener r only
+    // serves what reactor_connect gives it.
+    struct epoll_event ev;
+    if (listener >= 0) {
+        if (set_nonblocking(listener) < 0) return -1;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &r->listener;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, listener, &ev) < 0) return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &r->wakefd;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev) < 0) return -1;
+    return 0;
+}
+
+void reactor_free(Reactor *r) {
+#ifndef NO_URING
+    if (r->ring) {
+        uring_free(r->ring);
+        free(r->ring);
+    }
+#endif
+    if (r->handoff >= 0) close(r->handoff);
+    close(r->epfd);
+    close(r->wakefd);
+    lobby_free(&r->lobby);
+    pthread_mutex_destroy(&r->timer_lock);
+}
+
+// breaks a reactor running on another thread out of epoll_wait
+void reactor_wake(Reactor *r) {
+    uint64_t one = 1;
+    if (write(r->wakefd, &one, sizeof(one)) < 0) perror("reactor_wake");
+}
+
+static void reactor_link(Reactor *r, Player *p) {
+    p->conn_prev = NULL;
+    p->conn_next = r->players;
+    if (r->players) r->players->conn_prev = p;
+    r->players = p;
+}
+
+// frees p, taking it off the list of connections if it is there
+static void reactor_release(Reactor *r, Player *p) {
+    if (p->conn_prev) p->conn_prev->conn_next = p->conn_next;
+    else if (r->players == p) r->players = p->conn_next;
+    if (p->conn_next) p->conn_next->conn_prev = p->conn_prev;
+    p->conn_prev = p->conn_next = NULL;
+    player_destroy(p);
+}
+
+// arms p's one timer for ms from now, or cancels it when ms is 0
+static void reactor_set_timer(Reactor *r, Player *p, long ms) {
+    if (r->shared) pthread_mutex_lock(&r->timer_lock);
+    if (ms > 0) timer_arm(&r->timers, &p->timer, ms);
+    else timer_cancel(&r->timers, &p->timer);
+    if (r->shared) pthread_mutex_unlock(&r->timer_lock);
+}
+
+// with the lobby held and players left waiting: their windows widen, so
+// the lobby is swept again in a while, see reactor_sweep
+static void reactor_arm_sweep(Reactor *r) {
+    if (r->shared) pthread_mutex_lock(&r->timer_lock);
+    if (!timer_armed(&r->sweep)) timer_arm(&r->timers, &r->sweep, LOBBY_RETRY_MS);
+    if (r->shared) pthread_mutex_unlock(&r->timer_lock);
+}
+
+// players are only freed once the current batch of events is done,
+// since a later event in the batch may still point at them
+static void reactor_close(Reactor *r, Player *p) {
+    if (state_of(p) == P_CLOSED) return;
+    if (p->bot) {
+        // no socket, timer or lobby entry; on the worker pool it goes
+        // with the game
+        set_state(p, P_CLOSED);
+        if (!r->shared) {
+            p->next_dead = r->dead;
+            r->dead = p;
+        }
+        return;
+    }
+    reactor_set_timer(r, p, 0);
+    if (p->watch) {
+        watch_leave(p);
+        // the io_uring backend hears about a spectator's socket draining
+        // through the epoll set, see ring_watchers
+        if (r->ring) epoll_ctl(r->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+    }
+    if (state_of(p) == P_WAITING || state_of(p) == P_PLAYING) {
+        // on the worker pool a playing player is closed under its game
+        // lock, waiting players are already under the lobby lock
+        int lock = r->shared && state_of(p) == P_PLAYING;
+        if (lock) lobby_lock(&r->lobby);
+        remove_player(&r->lobby, p);
+        if (lock) lobby_unlock(&r->lobby);
+    }
+    names_release(p->name);
+    p->name = NULL;
+    p->in_game = 0;
+    if (r->ring) {
+        // the ring sends p's last frames with everyone else's, and
+        // ring_sweep closes it after
+        set_state(p, P_CLOSED);
+        p->next_dead = r->dead;
+        r->dead = p;
+        return;
+    }
+    // whatever was queued for p (often its OVER or FAIL) goes now or never
+    player_flush(p);
+    if (r->shared) {
+        // only the player's own task closes and frees it, shutting the
+        // socket down makes sure that task runs
+        set_state(p, P_CLOSED);
+        player_shutdown(p, SHUT_RDWR);
+        return;
+    }
+    player_hang_up(p);
+    set_state(p, P_CLOSED);
+    p->next_dead = r->dead;
+    r->dead = p;
+}
+
+// one encode, sent to both players unless they speak different codecs
+static void reactor_send_play(Game *g) {
+    char msg[NGP_BUF_SIZE];
+    Player *curr = g->turn == 1 ? g->p1 : g->p2;
+    Player *opp = g->turn == 1 ? g->p2 : g->p1;
+    int len = player_encode_play(curr, msg, g->turn, game_board(g), game_piles(g));
+    player_write(curr, msg, len);
+    if (opp->binary != curr->binary)
+        len = player_encode_play(opp, msg, g->turn, game_board(g), game_piles(g));
+    player_write(opp, msg, len);
+    watch_play(g);
+}
+
+// NAME and the first PLAY go out to each player in a single writev
+static void reactor_game_start(Game *g) {
+    char name1[NGP_BUF_SIZE], name2[NGP_BUF_SIZE], play[NGP_BUF_SIZE];
+    struct iovec iov[2];
+    iov[1].iov_base = play;
+    iov[1].iov_len = player_encode_play(g->p1, play, g->turn, game_board(g), game_piles(g));
+
+    iov[0].iov_base = name1;
+    iov[0].iov_len = player_encode_name(g->p1, name1, 1, g->p2->name);
+    player_writev(g->p1, iov, 2);
+    if (g->p2->binary != g->p1->binary)
+        iov[1].iov_len = player_encode_play(g->p2, play, g->turn, game_board(g), game_piles(g));
+    iov[0].iov_base = name2;
+    iov[0].iov_len = player_encode_name(g->p2, name2, 2, g->p1->name);
+    player_writev(g->p2, iov, 2);
+
+    g->p1->player_number = 1;
+    g->p2->player_number = 2;
+    g->p1->game = g;
+    g->p2->game = g;
+    set_state(g->p1, P_PLAYING);
+    set_state(g->p2, P_PLAYING);
+    g->p1->begun = 1;
+    g->p2->begun = 1;
+    evlog_match(g);
+    watch_game_start(g);
+}
+
+// sends OVER to whoever is still connected and tears the game down. gone
+// is a player who left mid game, or NULL: it is rated with the other one,
+// then closed before the OVER goes out, as it gets none.
+static void reactor_game_end(Reactor *r, Game *g, int winner, int ff, Player *gone) {
+    char msg[NGP_BUF_SIZE];
+    if (ff) metrics_add(M_FORFEITS, 1);
+    evlog_over(g, winner, ff);
+    rating_over(g, winner);
+    if (gone) reactor_close(r, gone);
+    int len = player_encode_over(g->p1, msg, winner, game_board(g), game_piles(g), ff);
+    if (state_of(g->p1) != P_CLOSED) player_write(g->p1, msg, len);
+    if (g->p2->binary != g->p1->binary)
+        len = player_encode_over(g->p2, msg, winner, game_board(g), game_piles(g), ff);
+    if (state_of(g->p2) != P_CLOSED) player_write(g->p2, msg, len);
+    watch_game_end(g, winner, ff);
+
+    reactor_close(r, g->p1);
+    reactor_close(r, g->p2);
+    // on the worker pool the last player to finish frees the game
+    if (!r->shared) game_free(g);
+}
+
+// p leaves mid game, the other player wins by forfeit
+static void reactor_forfeit(Reactor *r, Player *p) {
+    Game *g = p->game;
+    reactor_game_end(r, g, p == g->p1 ? 2 : 1, 1, p);
+}
+
+// p's socket has room: more of its frames, and once the game is over and
+// they have all gone, the connection
+static void reactor_watch_flush(Reactor *r, Player *p) {
+    if (watch_flush(p) < 0 || watch_finished(p)) reactor_close(r, p);
+}
+
+static int ring_watcher(Reactor *r, Player *p);
+
+// a spectator, see watch.h: no name, no lobby and no clock
+static void reactor_spectate(Reactor *r, Player *p, const NgpMsg *m) {
+    if (watch_open(p, m) < 0 || (r->ring && ring_watcher(r, p) < 0)) {
+        reactor_close(r, p);
+        return;
+    }
+    reactor_set_timer(r, p, 0);
+    set_state(p, P_WATCHING);
+    reactor_watch_flush(r, p);
+}
+
+// spectators only listen, anything they send ends them
+static void reactor_watch_message(Reactor *r, Player *p) {
+    player_send_fail(p, "10 Invalid");
+    reactor_close(r, p);
+}
+
+static void reactor_open(Reactor *r, Player *p, const NgpMsg *m) {
+    if (m->type == NGP_WATC) {
+        reactor_spectate(r, p, m);
+        return;
+    }
+    char name[NAME_BUF];
+    if (player_open(p, m, name) < 0) {
+        reactor_close(r, p);
+        return;
+    }
+
+    if (strlen(name) > 72) {
+        player_send_fail(p, "21 Long Name");
+        reactor_close(r, p);
+        return;
+    }
+
+    p->name = names_claim(name);
+    if (!p->name) {
+        player_send_fail(p, "22 Already Playing");
+        reactor_close(r, p);
+        return;
+    }
+    evlog_open(p->name);
+    p->rating = rating_of(p->name);
+
+    player_send_wait(p);
+
+    if (r->shared) lobby_lock(&r->lobby);
+    if (lobby_add(&r->lobby, p, timer_now_ms()) < 0) {
+        player_send_fail(p, "Server full");
+        reactor_close(r, p);
+        if (r->shared) lobby_unlock(&r->lobby);
+        return;
+    }
+    set_state(p, P_WAITING);
+    reactor_set_timer(r, p, bot_first() ? bot_wait : idle_timeout);
+
+    Player *p1, *p2;
+    if (lobby_match(&r->lobby, p, timer_now_ms(), &p1, &p2)) {
+        Game *g = game_create(p1, p2);
+        if (!g) {
+            player_send_fail(p1, "Server full");
+            player_send_fail(p2, "Server full");
+            reactor_close(r, p1);
+            reactor_close(r, p2);
+        } else {
+            reactor_game_start(g);
+            // player 1 moves first, so only its clock runs
+            reactor_set_timer(r, g->p1, move_timeout);
+            reactor_set_timer(r, g->p2, 0);
+            r->games++;
+        }
+    } else if (r->lobby.waiting > 1) {
+        reactor_arm_sweep(r);
+    }
+    if (r->shared) lobby_unlock(&r->lobby);
+}
+
+static void reactor_lobby_message(Reactor *r, Player *p, const NgpMsg *m) {
+    if (m->type == NGP_MOVE) {
+        player_send_fail(p, "24 Not Playing");
+        reactor_close(r, p);
+    } else if (m->type == NGP_OPEN) {
+        player_send_fail(p, "23 Already Open");
+        reactor_close(r, p);
+    } else {
+        // Some other invalid message
+        player_send_fail(p, "10 Invalid");
+    }
+}
+
+static void reactor_game_message(Reactor *r, Player *p, const NgpMsg *m) {
+    uint64_t start = metrics_now();
+    Game *g = p->game;
+    Player *curr = g->turn == 1 ? g->p1 : g->p2;
+
+    if (p != curr) {
+        if (m->count == 5 && m->type == NGP_MOVE) {
+            // impatient
+            player_send_fail(p, "31 Impatient");
+            return;
+        }
+        if (m->count == 4 && m->type == NGP_OPEN)
+            player_send_fail(p, "23 Already Open");
+        else
+            player_send_fail(p, "10 Invalid");
+        reactor_forfeit(r, p);
+        return;
+    }
+
+    if (m->type == NGP_OPEN) {
+        player_send_fail(p, "23 Already Open");
+        reactor_forfeit(r, p);
+        return;
+    }
+
+    if (m->count != 5 || m->type != NGP_MOVE) {
+        player_send_fail(p, "10 Invalid");
+        reactor_forfeit(r, p);
+        return;
+    }
+
+    int pile = ngp_int(m, 3);
+    int count = ngp_int(m, 4);
+    int err = game_move(g, g->turn, pile, count);
+    if (err == 31) {
+        player_send_fail(p, "31 Impatient");
+        return;
+    } else if (err == 32) {
+        player_send_fail(p, "32 Pile Index");
+        return;
+    } else if (err == 33) {
+        player_send_fail(p, "33 Quantity");
+        return;
+    }
+
+    evlog_move(g, g->turn, pile, count);
+    reactor_set_timer(r, p, 0);
+    g->turn = 3 - g->turn;
+    int stuck = 0;
+    if (!game_over(g) && (g->turn == 1 ? g->p1 : g->p2)->bot) {
+        // the house bot answers on the spot; one that cannot move
+        // forfeits rather than hand the same board back
+        reactor_send_play(g);
+        if (bot_move(g) != 0) stuck = 1;
+        else g->turn = 3 - g->turn;
+    }
+    if (stuck) {
+        reactor_game_end(r, g, 3 - g->turn, 1, NULL);
+    } else if (game_over(g)) {
+        reactor_game_end(r, g, 3 - g->turn, 0, NULL);
+    } else {
+        reactor_send_play(g);
+        reactor_set_timer(r, g->turn == 1 ? g->p1 : g->p2, move_timeout);
+    }
+    metrics_add(M_MOVES, 1);
+    metrics_record(H_MOVE, metrics_now() - start);
+}
+
+// p missed its deadline: a silent connection or an idle lobby player is
+// dropped, and a player out of time on its move loses by forfeit
+static void reactor_timeout(Reactor *r, Player *p) {
+    if (state_of(p) == P_PLAYING) {
+        Game *g = p->game;
+        reactor_game_end(r, g, p == g->p1 ? 2 : 1, 1, NULL);
+        return;
+    }
+    player_send_fail(p, "Timeout");
+    reactor_close(r, p);
+}
+
+// p waited bot_wait without a human turning up, so the house bot takes
+// the other seat; the caller holds the lobby
+static int reactor_bot_match(Reactor *r, Player *p) {
+    Player *bot = bot_create();
+    Game *g = bot ? game_create(p, bot) : NULL;
+    if (!g) {
+        player_destroy(bot);
+        return -1;
+    }
+    lobby_take(&r->lobby, p);
+    reactor_game_start(g);
+    r->games++;
+    metrics_add(M_BOT_GAMES, 1);
+    return 0;
+}
+
+// runs on the timer wheel. On the worker pool the poller holds timer_lock
+// here, which nests inside the lobby lock, so it only tries for the lobby
+// and comes back a tick later if a task has it. -1 when p found no room
+// for a game and has used up its idle timeout meanwhile.
+static int reactor_bot_wait(Reactor *r, Player *p) {
+    if (r->shared && lobby_trylock(&r->lobby) < 0) {
+        timer_arm(&r->timers, &p->timer, TIMER_TICK_MS);
+        return 0;
+    }
+    int expired = 0;
+    if (state_of(p) == P_WAITING) {
+        if (reactor_bot_match(r, p) == 0) {
+            // p is player 1 and moves first
+            if (move_timeout > 0) timer_arm(&r->timers, &p->timer, move_timeout);
+        } else {
+            // no room for a game: another round, but none past the
+            // idle timeout, which the bot's wait had taken the place of
+            long next = bot_wait;
+            if (idle_timeout > 0) {
+                uint64_t now = timer_now_ms();
+                long waited = now > p->queued_at ? (long)(now - p->queued_at) : 0;
+                if (waited >= idle_timeout) expired = 1;
+                else if (idle_timeout - waited < next) next = idle_timeout - waited;
+            }
+            if (!expired) timer_arm(&r->timers, &p->timer, next);
+        }
+    }
+    if (r->shared) lobby_unlock(&r->lobby);
+    return expired ? -1 : 0;
+}
+
+// lobby_sweep's matches, on the timer wheel: on the worker pool the
+// poller holds timer_lock already, so the clocks are set directly, and a
+// pair with no room for a game is left for its own tasks to close
+static void reactor_swept(void *ctx, Player *p1, Player *p2) {
+    Reactor *r = ctx;
+    Game *g = game_create(p1, p2);
+    if (!g) {
+        player_send_fail(p1, "Server full");
+        player_send_fail(p2, "Server full");
+        if (r->shared) {
+            player_shutdown(p1, SHUT_RD);
+            player_shutdown(p2, SHUT_RD);
+        } else {
+            reactor_close(r, p1);
+            reactor_close(r, p2);
+        }
+        return;
+    }
+    reactor_game_start(g);
+    timer_cancel(&r->timers, &g->p2->timer);
+    if (move_timeout > 0) timer_arm(&r->timers, &g->p1->timer, move_timeout);
+    else timer_cancel(&r->timers, &g->p1->timer);
+    r->games++;
+}
+
+// runs on the timer wheel while players wait, for the matches their
+// widened windows allow; on the worker pool it only tries for the lobby,
+// as reactor_bot_wait does
+static void reactor_sweep(void *ctx, void *arg) {
+    Reactor *r = ctx;
+    (void)arg;
+    if (r->shared && lobby_trylock(&r->lobby) < 0) {
+        timer_arm(&r->timers, &r->sweep, TIMER_TICK_MS);
+        return;
+    }
+    lobby_sweep(&r->lobby, timer_now_ms(), reactor_swept, r);
+    if (r->lobby.waiting > 1) timer_arm(&r->timers, &r->sweep, LOBBY_RETRY_MS);
+    if (r->shared) lobby_unlock(&r->lobby);
+}
+
+static void reactor_expire(void *ctx, void *arg) {
+    Reactor *r = ctx;
+    Player *p = arg;
+    if (state_of(p) == P_WAITING && bot_first() && reactor_bot_wait(r, p) == 0) return;
+    if (!r->shared) {
+        reactor_timeout(r, p);
+        return;
+    }
+    // the poller holds timer_lock here; shutting the read side down
+    // hands the timeout to the player's own task
+    __atomic_store_n(&p->timed_out, 1, __ATOMIC_RELEASE);
+    player_shutdown(p, SHUT_RD);
+}
+
+// p hung up, sent something fatal, or (on the worker pool) ran out of time
+static void reactor_lost(Reactor *r, Player *p) {
+    if (__atomic_load_n(&p->timed_out, __ATOMIC_ACQUIRE))
+        reactor_timeout(r, p);
+    else if (state_of(p) == P_PLAYING)
+        reactor_forfeit(r, p);
+    else
+        reactor_close(r, p);
+}
+
+static void reactor_shared_step(Reactor *r, Player *p, const NgpMsg *msg);
+
+static void reactor_dispatch(Reactor *r, Player *p, const NgpMsg *msg) {
+    if (r->shared)
+        reactor_shared_step(r, p, msg);
+    else if (state_of(p) == P_OPENING)
+        reactor_open(r, p, msg);
+    else if (state_of(p) == P_WAITING)
+        reactor_lobby_message(r, p, msg);
+    else if (state_of(p) == P_WATCHING)
+        reactor_watch_message(r, p);
+    else
+        reactor_game_message(r, p, msg);
+}
+
+static void reactor_drop(Reactor *r, Player *p) {
+    if (r->shared)
+        reactor_shared_step(r, p, NULL);
+    else
+        reactor_lost(r, p);
+}
+
+// handles every complete frame buffered for p; -1 if p sent a bad one
+static int reactor_frames(Reactor *r, Player *p) {
+    NgpMsg msg;
+    int status = 0;
+    while (state_of(p) != P_CLOSED && (status = player_next_frame(p, &msg)) > 0)
+        reactor_dispatch(r, p, &msg);
+    return status;
+}
+
+// edge triggered, so keep reading until the socket would block; every
+// complete frame in the buffer is handled after each read
+static void reactor_readable(Reactor *r, Player *p) {
+    while (state_of(p) != P_CLOSED) {
+        int n = player_fill(p);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            reactor_drop(r, p);
+            return;
+        }
+
+        // replies to everything in this read leave in one send
+        player_cork(p);
+        int status = reactor_frames(r, p);
+        player_uncork(p);
+        if (status < 0 && state_of(p) != P_CLOSED) {
+            reactor_drop(r, p);
+            return;
+        }
+    }
+}
+
+// a new connection becomes a player with its OPEN clock running
+static Player *reactor_join(Reactor *r, Player *p) {
+    r->accepted++;
+    metrics_add(M_CONNECTIONS, 1);
+    if (!r->shared) reactor_link(r, p);
+    timer_init(&p->timer, reactor_expire, p);
+    reactor_set_timer(r, p, open_timeout);
+    return p;
+}
+
+static Player *reactor_adopt(Reactor *r, int client) {
+    tune_client(client);
+    Player *p = player_create(client);
+    if (!p) {
+        close(client);
+        return NULL;
+    }
+    return reactor_join(r, p);
+}
+
+// players closed during a batch of events, now that it is done
+static void reactor_reap(Reactor *r) {
+    while (r->dead) {
+        Player *p = r->dead;
+        r->dead = p->next_dead;
+        reactor_release(r, p);
+    }
+}
+
+// For a driver other than reactor_run, with connections that are not
+// sockets (see sim.c). reactor_connect is the accept, reactor_ready the
+// EPOLLIN for p (input, a hang up, or its read side shut), and
+// reactor_tick runs the deadlines up to timer_now_ms(). Sends on such a
+// transport never fall short, so nothing waits for EPOLLOUT.
+Player *reactor_connect(Reactor *r, const Transport *io, void *chan) {
+    Player *p = player_create(-1);
+    if (!p) return NULL;
+    p->io = io;
+    p->chan = chan;
+    return reactor_join(r, p);
+}
+
+void reactor_ready(Reactor *r, Player *p) {
+    if (state_of(p) != P_CLOSED) reactor_readable(r, p);
+    reactor_reap(r);
+}
+
+void reactor_tick(Reactor *r) {
+    timer_advance(&r->timers, timer_now_ms());
+    reactor_reap(r);
+}
+
+static void reactor_accept_retry(void *ctx, void *arg) {
+    Reactor *r = ctx;
+    (void)arg;
+    r->accept_more = 1;
+}
+
+// One batch off the listener, already non blocking. The listener is edge
+// triggered, so a full batch may have left more behind: accept_more has
+// the loop come back for them after the events in hand, without waiting.
+// A batch an error cut short (EMFILE, ENFILE) gets no new edge for what
+// is left either, so the loop comes back a tick later, once the games
+// may have freed some descriptors, as thread mode's accept loop does.
+static void reactor_accept(Reactor *r) {
+    int clients[ACCEPT_BATCH];
+    int n = accept_batch(r->listener, clients, ACCEPT_BATCH, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    r->accept_more = n == ACCEPT_BATCH;
+    if (n < ACCEPT_BATCH && errno != EAGAIN && errno != EWOULDBLOCK) {
+        if (n < 0) perror("accept");
+        if (r->shared) pthread_mutex_lock(&r->timer_lock);
+        if (!timer_armed(&r->accept_retry)) timer_arm(&r->timers, &r->accept_retry, TIMER_TICK_MS);
+        if (r->shared) pthread_mutex_unlock(&r->timer_lock);
+    }
+
+    for (int i = 0; i < n; i++) {
+        Player *p = reactor_adopt(r, clients[i]);
+        if (!p) continue;
+        struct epoll_event ev;
+        // on the worker pool each player has at most one task in flight;
+        // the event loop also hears when a full socket drains
+        ev.events = r->shared ? EPOLLIN | EPOLLRDHUP | EPOLLONESHOT
+                              : EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = p;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, clients[i], &ev) < 0) {
+            perror("epoll_ctl");
+            reactor_set_timer(r, p, 0);
+            reactor_release(r, p);
+        }
+    }
+}
+
+static void reactor_run_uring(Reactor *r);
+static int reactor_hand_over(Reactor *r);
+
+void reactor_run(Reactor *r) {
+    struct epoll_event events[MAX_EVENTS];
+    watch_defer();
+    if (r->ring) {
+        reactor_run_uring(r);
+        return;
+    }
+
+    while (active) {
+        int timeout = r->accept_more ? 0 : timer_next_ms(&r->timers, timer_now_ms());
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        // deadlines that passed while we slept go first, which also
+        // brings the wheel up to date before anything new is armed
+        timer_advance(&r->timers, timer_now_ms());
+
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &r->listener) {
+                r->accept_more = 1;
+            } else if (tag == &r->wakefd) {
+                uint64_t count;
+                if (read(r->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("read");
+            } else if (tag == &r->handoff) {
+                r->handoff_ready = 1;
+            } else {
+                Player *p = tag;
+                uint32_t what = events[i].events;
+                if ((what & EPOLLOUT) && state_of(p) != P_CLOSED) player_flush(p);
+                if ((what & EPOLLOUT) && state_of(p) == P_WATCHING) reactor_watch_flush(r, p);
+                if ((what & ~EPOLLOUT) && state_of(p) != P_CLOSED) reactor_readable(r, p);
+            }
+        }
+        // the players' frames have all gone, now the spectators'
+        if (watch_deferred()) watch_send_deferred();
+        // new connections after the ones already being served
+        if (r->accept_more) reactor_accept(r);
+        reactor_reap(r);
+
+        // a new process asked for everything, between batches
+        if (r->handoff_ready) {
+            r->handoff_ready = 0;
+            if (reactor_hand_over(r) == 0) return;
+        }
+    }
+}
+
+// io_uring backend: the same state machines, with the socket I/O done by
+// the ring. One multishot accept hands out connections and every player
+// has one multishot recv drawing on the ring's provided buffers, so a
+// frame arrives without a read. Players stay corked: whatever a batch of
+// completions queues for them (NAME and PLAY to both sides of a game, the
+// last PLAY and OVER) goes out as one send each, and all those sends are
+// submitted together with the next wait, in one syscall.
+
+#ifndef NO_URING
+
+#define URING_ENTRIES 256
+#define URING_BUFS 512
+#define URING_BUF_SIZE 512
+
+// a completion's user_data is its player with the request in the low bits
+enum { RING_ACCEPT, RING_WAKE, RING_RECV, RING_SEND, RING_POLLOUT, RING_HANDOFF, RING_CANCEL, RING_WATCH };
+#define RING_OP(data) ((int)((data) & 7))
+#define RING_PLAYER(data) ((Player *)(uintptr_t)((data) & ~(uint64_t)7))
+
+// p->ring: requests that still point at p
+#define RING_RECV_ARMED 1
+#define RING_SEND_ARMED 2
+#define RING_POLL_ARMED 4
+
+// nothing new is armed while ring_quiesce takes requests back
+
+static void ring_accept(Reactor *r) {
+    if (r->quiescing) return;
+    struct io_uring_sqe *sqe = uring_sqe(r->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = RING_ACCEPT;
+}
+
+static void ring_wake(Reactor *r) {
+    if (r->quiescing) return;
+    struct io_uring_sqe *sqe = uring_sqe(r->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->wakefd;
+    sqe->addr = (uintptr_t)&r->wakes;
+    sqe->len = sizeof(r->wakes);
+    sqe->user_data = RING_WAKE;
+}
+
+static void ring_recv(Reactor *r, Player *p) {
+    if (r->quiescing) return;
+    struct io_uring_sqe *sqe = uring_sqe(r->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = p->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = r->recv_multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = (uintptr_t)p | RING_RECV;
+    p->ring |= RING_RECV_ARMED;
+}
+
+// MSG_DONTWAIT makes a full socket fail the send at once instead of
+// parking it, so the send is over by the time submission returns
+static void ring_send(Reactor *r, Player *p) {
+    int len;
+    const char *buf = player_outbound(p, &len);
+    if (len == 0) return;
+    struct io_uring_sqe *sqe = uring_sqe(r->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = p->fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)p | RING_SEND;
+    p->ring |= RING_SEND_ARMED;
+    r->sending++;
+}
+
+static void ring_pollout(Reactor *r, Player *p) {
+    struct io_uring_sqe *sqe = uring_sqe(r->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = p->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (uintptr_t)p | RING_POLLOUT;
+    p->ring |= RING_POLL_ARMED;
+}
+
+static void ring_handoff(Reactor *r) {
+    if (r->quiescing || r->handoff < 0) return;
+    struct io_uring_sqe *sqe = uring_sqe(r->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = r->handoff;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = RING_HANDOFF;
+}
+
+// A spectator's frames are sent by its game's side, on whatever thread
+// that runs, so only the kernel knows when a full socket drains. The
+// spectators' sockets sit in the epoll set, edge triggered for EPOLLOUT,
+// and the ring polls the set.
+static void ring_watch(Reactor *r) {
+    if (r->quiescing) return;
+    struct io_uring_sqe *sqe = uring_sqe(r->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = r->epfd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = RING_WATCH;
+}
+
+static int ring_watcher(Reactor *r, Player *p) {
+    struct epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLET;
+    ev.data.ptr = p;
+    return epoll_ctl(r->epfd, EPOLL_CTL_ADD, p->fd, &ev);
+}
+
+static void ring_watchers(Reactor *r) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(r->epfd, events, MAX_EVENTS, 0);
+    for (int i = 0; i < n; i++) {
+        Player *p = events[i].data.ptr;
+        if (state_of(p) == P_WATCHING) reactor_watch_flush(r, p);
+    }
+}
+
+static void ring_queue(Reactor *r, Player *p) {
+    if (p->outbox) return;
+    p->outbox = 1;
+    p->next_out = r->outbox;
+    r->outbox = p;
+}
+
+// one send for every player something was queued for since the last
+// round, unless it is already waiting for its socket to drain
+static void ring_flush_outbox(Reactor *r) {
+    while (r->outbox) {
+        Player *p = r->outbox;
+        r->outbox = p->next_out;
+        p->outbox = 0;
+        if (p->fd >= 0 && !(p->ring & RING_POLL_ARMED)) ring_send(r, p);
+    }
+}
+
+// The sends just submitted point into their players' queues, which must
+// not move until the kernel is done with them; they complete during
+// submission, so this is a scan of the completion ring and no wait.
+static int ring_settle(Reactor *r) {
+    Uring *u = r->ring;
+    for (;;) {
+        unsigned ready = uring_cq_ready(u);
+        int done = 0;
+        for (unsigned i = 0; i < ready; i++)
+            if (RING_OP(uring_cqe_at(u, i)->user_data) == RING_SEND) done++;
+        if (done >= r->sending) return 0;
+        // a burst of accepts and receives can fill the ring ahead of them
+        if (uring_cq_full(u)) {
+            if (uring_cq_stash(u) < 0) return -1;
+            continue;
+        }
+        if (uring_enter(u, ready + r->sending - done, -1) < 0 && errno != EINTR) return -1;
+    }
+}
+
+// players closed last round have had their last frames sent now, so
+// their sockets go; a player is freed once no request points at it, here
+// or on the last completion for it, which the shutdown brings on
+static void ring_sweep(Reactor *r) {
+    while (r->dead) {
+        Player *p = r->dead;
+        r->dead = p->next_dead;
+        if (p->fd >= 0) {
+            shutdown(p->fd, SHUT_RDWR);
+            close(p->fd);
+            p->fd = -1;
+        }
+        if (!p->ring) reactor_release(r, p);
+    }
+}
+
+static void ring_received(Reactor *r, Player *p, const struct io_uring_cqe *cqe) {
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    if (!more) p->ring &= ~RING_RECV_ARMED;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *data = uring_buf(r->ring, bid);
+        int len = cqe->res;
+        // a read's worth of bytes may hold more frames than the receive
+        // buffer, so it goes in a piece at a time
+        while (len > 0 && state_of(p) != P_CLOSED) {
+            int n = player_feed(p, data, len);
+            data += n;
+            len -= n;
+            if ((reactor_frames(r, p) < 0 || n == 0) && state_of(p) != P_CLOSED) reactor_lost(r, p);
+        }
+        uring_buf_return(r->ring, bid);
+    }
+
+    // taken back by ring_quiesce
+    if (state_of(p) == P_CLOSED || cqe->res == -ECANCELED) return;
+    if (cqe->res == -EINVAL && r->recv_multishot) {
+        // multishot recv came in 6.0, a step after the rest; without it
+        // every recv is armed again after each completion
+        r->recv_multishot = 0;
+        ring_recv(r, p);
+    } else if (cqe->res == -ENOBUFS) {
+        // every buffer was in use; they are all back by the next submit
+        if (!more) ring_recv(r, p);
+    } else if (cqe->res <= 0) {
+        reactor_lost(r, p);
+    } else if (!more) {
+        ring_recv(r, p);
+    }
+}
+
+static void ring_complete(Reactor *r, const struct io_uring_cqe *cqe) {
+    int op = RING_OP(cqe->user_data);
+    if (op == RING_ACCEPT) {
+        if (cqe->res >= 0) {
+            Player *p = reactor_adopt(r, cqe->res);
+            if (p) {
+                player_cork(p);
+                ring_recv(r, p);
+            }
+        } else if (cqe->res != -ECONNABORTED && cqe->res != -ECANCELED) {
+            errno = -cqe->res;
+            perror("accept");
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) ring_accept(r);
+        return;
+    }
+    if (op == RING_WAKE) {
+        ring_wake(r);
+        return;
+    }
+    if (op == RING_HANDOFF) {
+        if (cqe->res > 0) r->handoff_ready = 1;
+        return;
+    }
+    if (op == RING_CANCEL) {
+        r->cancel_pending = 0;
+        r->cancel_res = cqe->res;
+        return;
+    }
+    if (op == RING_WATCH) {
+        if (cqe->res > 0) ring_watchers(r);
+        ring_watch(r);
+        return;
+    }
+
+    Player *p = RING_PLAYER(cqe->user_data);
+    if (op == RING_RECV) {
+        ring_received(r, p, cqe);
+    } else if (op == RING_SEND) {
+        p->ring &= ~RING_SEND_ARMED;
+        r->sending--;
+        // the socket is full, try again once it drains
+        if (player_sent(p, cqe->res) > 0 && state_of(p) != P_CLOSED) ring_pollout(r, p);
+    } else if (op == RING_POLLOUT) {
+        p->ring &= ~RING_POLL_ARMED;
+        if (state_of(p) != P_CLOSED) ring_queue(r, p);
+    }
+    if (state_of(p) == P_CLOSED && !p->ring && p->fd < 0) reactor_release(r, p);
+}
+
+static void ring_drain(Reactor *r) {
+    while (uring_cq_ready(r->ring) > 0) {
+        struct io_uring_cqe cqe = *uring_cqe_at(r->ring, 0);
+        uring_cq_advance(r->ring, 1);
+        ring_complete(r, &cqe);
+    }
+}
+
+// Takes back every request still in flight before a handoff, so none of
+// them reads a socket the new process owns: the accept, the recvs, the
+// polls. Whatever they complete with on the way is handled as usual, and
+// players that closed meanwhile get their last frames and are swept.
+static int ring_quiesce(Reactor *r) {
+    r->quiescing = 1;
+    do {
+        struct io_uring_sqe *sqe = uring_sqe(r->ring);
+        if (!sqe) return -1;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        sqe->user_data = RING_CANCEL;
+        r->cancel_pending = 1;
+        while (r->cancel_pending) {
+            if (uring_enter(r->ring, 1, -1) < 0 && errno != EINTR) return -1;
+            ring_drain(r);
+        }
+        // a cancel that found something goes again until one finds nothing
+    } while (r->cancel_res > 0);
+
+    for (Player *p = r->dead; p; p = p->next_dead) player_flush(p);
+    ring_sweep(r);
+    return 0;
+}
+
+// a handoff that did not happen: everything ring_quiesce took back is
+// armed again
+static void ring_resume(Reactor *r) {
+    r->quiescing = 0;
+    ring_accept(r);
+    ring_wake(r);
+    ring_watch(r);
+    for (Player *p = r->players; p; p = p->conn_next) {
+        if (state_of(p) == P_CLOSED || p->fd < 0) continue;
+        ring_recv(r, p);
+        if (player_queued(p) > 0) ring_queue(r, p);
+    }
+}
+
+static void reactor_run_uring(Reactor *r) {
+    Uring *u = r->ring;
+    player_outbox = &r->outbox;
+    ring_wake(r);
+    ring_handoff(r);
+    ring_watch(r);
+
+    while (active) {
+        ring_flush_outbox(r);
+        // the players' sends are submitted ahead of the spectators'
+        if (watch_deferred()) {
+            if (uring_enter(u, 0, 0) < 0 && errno != EINTR) {
+                perror("io_uring_enter");
+                break;
+            }
+            watch_send_deferred();
+        }
+        int timeout = timer_next_ms(&r->timers, timer_now_ms());
+        if (uring_enter(u, 1, timeout) < 0 && errno != EINTR) {
+            perror("io_uring_enter");
+            break;
+        }
+        if (ring_settle(r) < 0) {
+            perror("io_uring_enter");
+            break;
+        }
+        ring_sweep(r);
+
+        timer_advance(&r->timers, timer_now_ms());
+        ring_drain(r);
+
+        if (r->handoff_ready) {
+            r->handoff_ready = 0;
+            if (reactor_hand_over(r) == 0) break;
+            ring_handoff(r);
+        }
+    }
+    player_outbox = NULL;
+}
+
+// switches r's socket I/O over to io_uring; -1 with errno set when this
+// kernel lacks something the backend needs, and r stays on epoll
+int reactor_use_uring(Reactor *r) {
+    Uring *u = malloc(sizeof(Uring));
+    if (!u) return -1;
+    if (uring_init(u, URING_ENTRIES, URING_BUFS, URING_BUF_SIZE) < 0) {
+        free(u);
+        return -1;
+    }
+    r->ring = u;
+    // multishot accept (5.19) is refused as the sqe is submitted, so
+    // arming it right away shows whether the kernel has it
+    ring_accept(r);
+    if (uring_enter(u, 0, 0) < 0 ||
+        (uring_cq_ready(u) > 0 && uring_cqe_at(u, 0)->res == -EINVAL)) {
+        int err = uring_cq_ready(u) > 0 ? EINVAL : errno;
+        uring_free(u);
+        free(u);
+        r->ring = NULL;
+        errno = err;
+        return -1;
+    }
+    // the ring takes over the listener and the wake fd, which leaves
+    // the epoll set to the spectators
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, r->listener, NULL);
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, r->wakefd, NULL);
+    return 0;
+}
+
+#else
+
+static void reactor_run_uring(Reactor *r) {
+    (void)r;
+}
+
+static int ring_quiesce(Reactor *r) {
+    (void)r;
+    return 0;
+}
+
+static void ring_resume(Reactor *r) {
+    (void)r;
+}
+
+static void ring_recv(Reactor *r, Player *p) {
+    (void)r;
+    (void)p;
+}
+
+static void ring_queue(Reactor *r, Player *p) {
+    (void)r;
+    (void)p;
+}
+
+static int ring_watcher(Reactor *r, Player *p) {
+    (void)r;
+    (void)p;
+    return 0;
+}
+
+int reactor_use_uring(Reactor *r) {
+    (void)r;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
+
+// hot upgrade, see handoff.h. The old process's side runs between two
+// batches of events, so every connection is at rest: no frame half
+// handled, nothing but the start of a frame in a receive buffer.
+
+int reactor_handoff(Reactor *r, const char *path) {
+    r->handoff = handoff_listen(path);
+    if (r->handoff < 0) return -1;
+    // the io_uring backend polls it on the ring
+    if (r->ring) return 0;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &r->handoff;
+    return epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->handoff, &ev);
+}
+
+// p with its socket and buffered input, then its queued output
+static int handoff_player(Reactor *r, int sock, Player *p, uint64_t now) {
+    struct {
+        HandoffPlayer h;
+        char in[RBUF_SIZE];
+    } rec;
+    memset(&rec.h, 0, sizeof(rec.h));
+    rec.h.type = HANDOFF_PLAYER;
+    rec.h.state = state_of(p);
+    rec.h.binary = p->binary;
+    rec.h.has_opened = p->has_opened;
+    rec.h.player_number = p->player_number;
+    rec.h.timer_ms = timer_left_ms(&r->timers, &p->timer, now);
+    rec.h.rating = p->rating;
+    rec.h.waited_ms = p->queued && now > p->queued_at ? now - p->queued_at : 0;
+    if (p->name) snprintf(rec.h.name, sizeof(rec.h.name), "%s", p->name);
+    // a spectator goes by the name it follows
+    if (p->watch) snprintf(rec.h.name, sizeof(rec.h.name), "%s", p->watch->name);
+    int in, out;
+    const char *pending = player_inbound(p, &in);
+    memcpy(rec.in, pending, in);
+    rec.h.inbound = in;
+    const char *queued = player_outbound(p, &out);
+    rec.h.outbound = out;
+    if (handoff_send(sock, &rec, sizeof(rec.h) + in, &p->fd, 1) < 0) return -1;
+
+    struct {
+        uint32_t type;
+        char data[HANDOFF_CHUNK];
+    } chunk;
+    chunk.type = HANDOFF_DATA;
+    for (int off = 0; off < out; off += HANDOFF_CHUNK) {
+        int len = out - off < HANDOFF_CHUNK ? out - off : HANDOFF_CHUNK;
+        memcpy(chunk.data, queued + off, len);
+        if (handoff_send(sock, &chunk, sizeof(chunk.type) + len, NULL, 0) < 0) return -1;
+    }
+    return 0;
+}
+
+static int handoff_game(int sock, Game *g) {
+    HandoffGame rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = HANDOFF_GAME;
+    rec.turn = g->turn;
+    rec.piles = game_piles(g);
+    rec.bot = g->p2->bot;
+    memcpy(rec.board, game_board(g), GAME_MAX_PILES);
+    rec.started = g->started;
+    rec.serial = g->serial;
+    return handoff_send(sock, &rec, sizeof(rec), NULL, 0);
+}
+
+static int handoff_rating(const char *name, int rating, void *arg) {
+    HandoffRating rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = HANDOFF_RATING;
+    rec.rating = rating;
+    snprintf(rec.name, sizeof(rec.name), "%s", name);
+    return handoff_send(*(int *)arg, &rec, sizeof(rec), NULL, 0);
+}
+
+static int reactor_send_state(Reactor *r, int sock) {
+    HandoffHello hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.type = HANDOFF_HELLO;
+    hello.magic = HANDOFF_MAGIC;
+    hello.version = HANDOFF_VERSION;
+    hello.pid = getpid();
+    hello.serial = game_last_serial();
+    const char *admin;
+    int fds[2] = { r->listener, metrics_listener(&admin) };
+    if (fds[1] >= 0) snprintf(hello.admin, sizeof(hello.admin), "%s", admin);
+    if (handoff_send(sock, &hello, sizeof(hello), fds, fds[1] >= 0 ? 2 : 1) < 0) return -1;
+
+    if (rating_each(handoff_rating, &sock) < 0) return -1;
+
+    uint64_t now = timer_now_ms();
+    // the lobby in queue order, so it pairs the same way over there
+    for (int b = 0; b < LOBBY_BUCKETS; b++)
+        for (Player *p = r->lobby.bucket[b].head; p; p = p->lobby_next)
+            if (handoff_player(r, sock, p, now) < 0) return -1;
+    for (Player *p = r->players; p; p = p->conn_next) {
+        int state = state_of(p);
+        if (state == P_OPENING) {
+            if (handoff_player(r, sock, p, now) < 0) return -1;
+        } else if (state == P_PLAYING && p == p->game->p1) {
+            Game *g = p->game;
+            if (handoff_game(sock, g) < 0 || handoff_player(r, sock, g->p1, now) < 0) return -1;
+            if (!g->p2->bot && handoff_player(r, sock, g->p2, now) < 0) return -1;
+        }
+    }
+    // after every game, so each one has something to follow over there
+    for (Player *p = r->players; p; p = p->conn_next)
+        if (state_of(p) == P_WATCHING && watch_following(p) && handoff_player(r, sock, p, now) < 0)
+            return -1;
+    return handoff_send_type(sock, HANDOFF_END);
+}
+
+// the new process holds every connection now: r drops its copies without
+// a word to the peers and frees what went with them
+static void reactor_let_go(Reactor *r) {
+    while (r->players) {
+        Player *p = r->players;
+        Game *g = p->game;
+        if (g) {
+            Player *opp = p == g->p1 ? g->p2 : g->p1;
+            watch_game_end(g, 0, 0);
+            if (opp->bot) player_destroy(opp);
+            else opp->game = NULL;
+            game_free(g);
+        }
+        reactor_set_timer(r, p, 0);
+        remove_player(&r->lobby, p);
+        close(p->fd);
+        p->fd = -1;
+        set_state(p, P_CLOSED);
+        reactor_release(r, p);
+    }
+    r->outbox = NULL;
+    r->handed_off = 1;
+}
+
+// 0 once the process on the other end of the handoff socket has taken
+// everything; on any failure r carries on as before
+static int reactor_hand_over(Reactor *r) {
+    int sock = handoff_accept(r->handoff);
+    if (sock < 0) return -1;
+    if ((r->ring && ring_quiesce(r) < 0) || reactor_send_state(r, sock) < 0 ||
+        handoff_expect(sock, HANDOFF_ACK) < 0) {
+        perror("handoff");
+        close(sock);
+        if (r->ring) ring_resume(r);
+        return -1;
+    }
+    close(sock);
+    reactor_let_go(r);
+    return 0;
+}
+
+static Player *reactor_restore(Reactor *r, const HandoffPlayer *h, const char *in, int fd) {
+    tune_client(fd);
+    Player *p = player_create(fd);
+    if (!p) {
+        close(fd);
+        return NULL;
+    }
+    reactor_link(r, p);
+    timer_init(&p->timer, reactor_expire, p);
+    // nothing goes out before the old process lets go
+    player_cork(p);
+    p->binary = h->binary;
+    p->has_opened = h->has_opened;
+    p->player_number = h->player_number;
+    player_feed(p, in, h->inbound);
+    if (h->state == P_WATCHING) {
+        // its game came over ahead of it; the NAMEs and the PLAY the game
+        // is at go to it again, frames it had queued here do not
+        char name[NAME_BUF];
+        snprintf(name, sizeof(name), "%s", h->name);
+        if (watch_subscribe(p, name) < 0) return NULL;
+        set_state(p, P_WATCHING);
+        return p;
+    }
+    if (h->state != P_OPENING) {
+        char name[NAME_BUF];
+        snprintf(name, sizeof(name), "%s", h->name);
+        p->name = names_claim(name);
+        p->rating = h->rating;
+        if (!p->name || lobby_add(&r->lobby, p, timer_now_ms() - h->waited_ms) < 0) return NULL;
+        set_state(p, P_WAITING);
+        if (h->state == P_PLAYING) lobby_take(&r->lobby, p);
+    }
+    if (h->timer_ms >= 0) reactor_set_timer(r, p, h->timer_ms > 0 ? h->timer_ms : 1);
+    return p;
+}
+
+static Game *reactor_resume_game(const HandoffGame *h, Player *p1, Player *p2) {
+    if (h->piles < 1 || h->piles > GAME_MAX_PILES || (h->turn != 1 && h->turn != 2)) return NULL;
+    GameLayout layout;
+    layout.count = h->piles;
+    memcpy(layout.piles, h->board, GAME_MAX_PILES);
+    Game *g = game_create_layout(p1, p2, &layout);
+    if (!g) return NULL;
+    // resumed, not started here
+    metrics_add(M_GAMES, -1);
+    g->turn = h->turn;
+    g->started = h->started;
+    g->serial = h->serial;
+    game_serial_floor(h->serial);
+    p1->game = p2->game = g;
+    p1->player_number = 1;
+    p2->player_number = 2;
+    p1->begun = p2->begun = 1;
+    set_state(p1, P_PLAYING);
+    set_state(p2, P_PLAYING);
+    watch_game_start(g);
+    return g;
+}
+
+// a connection taken over is served like an accepted one from here on
+static int reactor_watch(Reactor *r, Player *p) {
+    if (r->ring) {
+        ring_recv(r, p);
+        if (player_queued(p) > 0) ring_queue(r, p);
+        return state_of(p) == P_WATCHING ? ring_watcher(r, p) : 0;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = p;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, p->fd, &ev) < 0) return -1;
+    player_uncork(p);
+    return 0;
+}
+
+// The new process's side: rebuilds every record the old process sends,
+// answers its END and starts serving. Returns the connections taken
+// over; -1 comes before the answer, so the old process serves on.
+int reactor_take_over(Reactor *r, int sock) {
+    static union {
+        uint32_t type;
+        HandoffPlayer player;
+        HandoffGame game;
+        HandoffRating rating;
+        char raw[sizeof(uint32_t) + HANDOFF_CHUNK];
+    } rec;
+    // players handed over are never turned away, the cap is for new ones
+    int capacity = r->lobby.capacity;
+    r->lobby.capacity = 0;
+    HandoffGame game;
+    // the seat in game the next player takes, 0 for none
+    int seat = 0;
+    Player *p1 = NULL, *last = NULL;
+    int count = 0, done = 0;
+
+    for (;;) {
+        int fd, nfds;
+        int n = handoff_recv(sock, &rec, sizeof(rec), &fd, 1, &nfds);
+        if (n < (int)sizeof(uint32_t)) break;
+        if (rec.type == HANDOFF_END) {
+            done = 1;
+            break;
+        }
+        if (rec.type == HANDOFF_RATING && n == (int)sizeof(HandoffRating)) {
+            rec.rating.name[NAME_BUF - 1] = '\0';
+            if (rating_set(rec.rating.name, rec.rating.rating) < 0) break;
+            continue;
+        }
+        if (rec.type == HANDOFF_GAME && n == (int)sizeof(HandoffGame)) {
+            game = rec.game;
+            seat = 1;
+            continue;
+        }
+        if (rec.type == HANDOFF_DATA && last) {
+            if (player_write(last, rec.raw + sizeof(uint32_t), n - sizeof(uint32_t)) < 0) break;
+            continue;
+        }
+        if (rec.type != HANDOFF_PLAYER || nfds != 1 || rec.player.inbound < 0 ||
+            n != (int)sizeof(HandoffPlayer) + rec.player.inbound) {
+            if (nfds) close(fd);
+            errno = EPROTO;
+            break;
+        }
+        last = reactor_restore(r, &rec.player, rec.raw + sizeof(HandoffPlayer), fd);
+        if (!last) break;
+        count++;
+        if (seat == 1 && game.bot) {
+            Player *bot = bot_create();
+            if (!bot || !reactor_resume_game(&game, last, bot)) break;
+            seat = 0;
+        } else if (seat == 1) {
+            p1 = last;
+            seat = 2;
+        } else if (seat == 2) {
+            if (!reactor_resume_game(&game, p1, last)) break;
+            seat = 0;
+        }
+    }
+    r->lobby.capacity = capacity;
+    if (!done || seat != 0) {
+        if (done) errno = EPROTO;
+        return -1;
+    }
+    if (r->lobby.waiting > 1) reactor_arm_sweep(r);
+    if (handoff_send_type(sock, HANDOFF_ACK) < 0) return -1;
+
+    // only now are the sockets this process's to read and write
+    for (Player *p = r->players; p; p = p->conn_next) {
+        if (state_of(p) == P_CLOSED || reactor_watch(r, p) == 0) continue;
+        perror("epoll_ctl");
+        reactor_lost(r, p);
+    }
+    return count;
+}
+
+// sharded mode: one reactor per thread, each with its own SO_REUSEPORT
+// listener and lobby, so a game never leaves the shard that accepted it
+
+typedef struct {
+    Reactor r;
+    pthread_t tid;
+    int cpu;
+} Shard;
+
+static void *shard_main(void *arg) {
+    Shard *s = arg;
+    if (s->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(s->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err) fprintf(stderr, "pin to cpu %d: %s\n", s->cpu, strerror(err));
+    }
+    reactor_run(&s->r);
+    return NULL;
+}
+
+int reactor_run_shards(const char *port, int nshards, int pin, int capacity, int uring) {
+    Shard *shards = calloc(nshards, sizeof(Shard));
+    if (!shards) return -1;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+
+    // only the main thread takes the shutdown signals, the shards
+    // inherit the blocked mask and are woken through their eventfd
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGHUP);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    int started = 0;
+    for (; started < nshards; started++) {
+        Shard *s = &shards[started];
+        int listener = open_listener(port, 1);
+        if (listener < 0) {
+            perror("open_listener");
+            break;
+        }
+        if (reactor_init(&s->r, listener, capacity) < 0) {
+            perror("reactor_init");
+            close(listener);
+            break;
+        }
+        if (uring && reactor_use_uring(&s->r) < 0 && started == 0)
+            perror("io_uring unavailable, using epoll");
+        s->cpu = pin ? started % ncpu : -1;
+        if (pthread_create(&s->tid, NULL, shard_main, s) != 0) {
+            perror("pthread_create");
+            reactor_free(&s->r);
+            close(listener);
+            break;
+        }
+    }
+
+    if (started == nshards) {
+        while (active) sigsuspend(&old);
+    } else {
+        active = 0;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    for (int i = 0; i < started; i++) reactor_wake(&shards[i].r);
+    for (int i = 0; i < started; i++) {
+        Shard *s = &shards[i];
+        pthread_join(s->tid, NULL);
+        printf("shard %d: %ld connections, %ld games\n", i, s->r.accepted, s->r.games);
+        close(s->r.listener);
+        reactor_free(&s->r);
+    }
+    free(shards);
+    return started == nshards ? 0 : -1;
+}
+
+// worker pool mode: one thread polls and accepts, and every readable
+// player becomes a task on the pool. Sockets are armed one shot, so a
+// player is only ever handled by one task at a time; the lobby mutex
+// guards waiting players and a striped lock guards each game.
+
+#define GAME_LOCKS 64
+
+static pthread_mutex_t game_locks[GAME_LOCKS];
+
+static pthread_mutex_t *game_lock(Game *g) {
+    return &game_locks[((uintptr_t)g / sizeof(Game)) % GAME_LOCKS];
+}
+
+// handles one frame for p, or its hang up when msg is NULL, under the
+// lock that guards the state it is in
+static void reactor_shared_step(Reactor *r, Player *p, const NgpMsg *msg) {
+    int state = state_of(p);
+    if (state == P_CLOSED) return;
+    if (state == P_OPENING) {
+        // nobody else touches a player before it joins the lobby
+        if (msg) reactor_open(r, p, msg);
+        else reactor_lost(r, p);
+        return;
+    }
+    if (state == P_WATCHING) {
+        // on the poller, see reactor_watcher_event
+        if (msg) reactor_watch_message(r, p);
+        else reactor_close(r, p);
+        return;
+    }
+
+    lobby_lock(&r->lobby);
+    if (state_of(p) == P_WAITING) {
+        if (msg) reactor_lobby_message(r, p, msg);
+        else reactor_lost(r, p);
+        lobby_unlock(&r->lobby);
+        return;
+    }
+    Game *g = p->game;
+    lobby_unlock(&r->lobby);
+    if (!g) return;
+
+    pthread_mutex_t *lock = game_lock(g);
+    pthread_mutex_lock(lock);
+    if (state_of(p) == P_PLAYING) {
+        if (msg) reactor_game_message(r, p, msg);
+        else reactor_lost(r, p);
+    }
+    pthread_mutex_unlock(lock);
+}
+
+// a closed player is freed by its own task; the players of a game are
+// freed with the game once both of them are done
+static void reactor_finish(Player *p) {
+    Game *g = p->game;
+    if (!g) {
+        player_destroy(p);
+        return;
+    }
+
+    pthread_mutex_t *lock = game_lock(g);
+    pthread_mutex_lock(lock);
+    close(p->fd);
+    p->fd = -1;
+    Player *opp = p == g->p1 ? g->p2 : g->p1;
+    int last = opp->fd < 0;
+    pthread_mutex_unlock(lock);
+
+    if (last) {
+        player_destroy(g->p1);
+        player_destroy(g->p2);
+        game_free(g);
+    }
+}
+
+// Output queued for p is flushed whenever p's task runs, and the task asks
+// for EPOLLOUT only while some is left. Frames the opponent's task queues
+// after that wait for p's next event; the socket only fills up when p
+// stops reading, and p keeps getting events from its own input until the
+// high-water mark or its clock runs out.
+static void reactor_service(void *ctx, void *arg) {
+    Reactor *r = ctx;
+    Player *p = arg;
+
+    if (state_of(p) != P_CLOSED) player_flush(p);
+    reactor_readable(r, p);
+    if (state_of(p) != P_CLOSED) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT | (player_queued(p) ? EPOLLOUT : 0);
+        ev.data.ptr = p;
+        int op = EPOLL_CTL_MOD;
+        if (state_of(p) == P_WATCHING) {
+            // a spectator is the poller's from here on, edge triggered.
+            // Added afresh rather than modified: an add is what the thread
+            // sanitizer takes as handing p over to the poller.
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            epoll_ctl(r->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+            op = EPOLL_CTL_ADD;
+        }
+        // p may be running on another worker as soon as this returns
+        if (epoll_ctl(r->epfd, op, p->fd, &ev) == 0) return;
+        perror("epoll_ctl");
+        reactor_drop(r, p);
+    }
+    reactor_finish(p);
+}
+
+// A spectator only ever flushes its frames or closes, so once it has
+// subscribed its events are edge triggered and handled on the poller
+// instead of as tasks. One it closes is freed after the batch.
+static void reactor_watcher_event(Reactor *r, Player *p, uint32_t what) {
+    if (what & EPOLLOUT) reactor_watch_flush(r, p);
+    if ((what & ~EPOLLOUT) && state_of(p) != P_CLOSED) reactor_readable(r, p);
+    if (state_of(p) == P_CLOSED) {
+        p->next_dead = r->dead;
+        r->dead = p;
+    }
+}
+
+void reactor_run_workers(Reactor *r, WorkerPool *wp) {
+    struct epoll_event events[MAX_EVENTS];
+    r->shared = 1;
+    for (int i = 0; i < GAME_LOCKS; i++) pthread_mutex_init(&game_locks[i], NULL);
+
+    while (active) {
+        pthread_mutex_lock(&r->timer_lock);
+        int timeout = r->accept_more ? 0 : timer_next_ms(&r->timers, timer_now_ms());
+        pthread_mutex_unlock(&r->timer_lock);
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        pthread_mutex_lock(&r->timer_lock);
+        timer_advance(&r->timers, timer_now_ms());
+        pthread_mutex_unlock(&r->timer_lock);
+
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &r->listener) {
+                r->accept_more = 1;
+            } else if (tag == &r->wakefd) {
+                uint64_t count;
+                if (read(r->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("read");
+            } else if (state_of(tag) == P_WATCHING) {
+                reactor_watcher_event(r, tag, events[i].events);
+            } else {
+                Player *p = tag;
+                if (workers_submit(wp, reactor_service, r, p, (unsigned)p->fd) < 0) return;
+            }
+        }
+        if (r->accept_more) reactor_accept(r);
+        while (r->dead) {
+            Player *p = r->dead;
+            r->dead = p->next_dead;
+            reactor_finish(p);
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "lobby.h"
+#include "workers.h"
+#include "timer.h"
+#include "transport.h"
+
+typedef struct {
+    int epfd;
+    int listener;
+    int wakefd;
+    Lobby lobby;
+    Player *dead;
+    long accepted;
+    // the listener may have connections waiting, see reactor_accept
+    int accept_more;
+    long games;
+    // set when the handlers run on a worker pool instead of one thread
+    int shared;
+    // every player's deadline; on the worker pool timer_lock guards it
+    TimerWheel timers;
+    pthread_mutex_t timer_lock;
+    // retries the lobby's waiting players, see reactor_sweep
+    Timer sweep;
+    // comes back to a listener an accept error left, see reactor_accept
+    Timer accept_retry;
+    // the io_uring backend when reactor_use_uring got one, else NULL
+    struct Uring *ring;
+    Player *outbox;
+    int sending;
+    int recv_multishot;
+    uint64_t wakes;
+    int quiescing;
+    int cancel_pending;
+    int cancel_res;
+    // hot upgrade, see handoff.h: every connection r holds (not kept on
+    // the worker pool), and the socket a new process connects to, or -1
+    Player *players;
+    int handoff;
+    int handoff_ready;
+    int handed_off;
+} Reactor;
+
+int reactor_init(Reactor *r, int listener, int capacity);
+int reactor_use_uring(Reactor *r);
+void reactor_run(Reactor *r);
+void reactor_wake(Reactor *r);
+Player *reactor_connect(Reactor *r, const Transport *io, void *chan);
+void reactor_ready(Reactor *r, Player *p);
+void reactor_tick(Reactor *r);
+void reactor_free(Reactor *r);
+int reactor_handoff(Reactor *r, const char *path);
+int reactor_take_over(Reactor *r, int sock);
+int reactor_run_shards(const char *port, int nshards, int pin, int capacity, int uring);
+void reactor_run_workers(Reactor *r, WorkerPool *wp);
+
+#endif
@@ -0,0 +1,664 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "sim.h"
+#include "nimd.h"
+#include "game.h"
+#include "bot.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "transport.h"
+#include "watch.h"
+
+// Deterministic simulation. Scripted clients play whole games against
+// the event loop's own state machines (reactor_open, reactor_game_message
+// and the rest) over memory channels instead of sockets: no kernel, no
+// threads, and a simulated clock that moves SIM_STEP_US each time a client
+// acts and jumps to the next deadline when nobody can. Every choice comes
+// from one generator seeded by --seed, so a seed plays out the same way
+// byte for byte, which the trace digest (FNV-1a over everything the
+// clients received) shows. Each client checks every frame it gets against
+// what it did, so one wrong FAIL, PLAY or OVER in millions of games is
+// reported with the client and connection to replay it by.
+
+#define SIM_STEP_US 100
+// violations reported one by one, after that only counted
+#define SIM_REPORT 10
+
+// what a connection does; the scripts past S_PLAY are the edge cases
+enum {
+    // plays each turn, now and then a move the server has to refuse
+    S_PLAY,
+    // also moves once on the opponent's turn, for 31 Impatient
+    S_IMPATIENT,
+    // hangs up partway through its game
+    S_FORFEIT,
+    // never moves and loses on the move clock
+    S_STALL,
+    // sends a second OPEN once the first is answered, 23 Already Open
+    S_REOPEN,
+    // opens with the name of a player already connected, 22 Already Playing
+    S_DUPLICATE,
+    // follows a game in progress with WATC
+    S_WATCH,
+    S_SCRIPTS
+};
+
+static const char *script_names[S_SCRIPTS] = {
+    "play", "impatient", "forfeit", "stall", "reopen", "duplicate", "watch"
+};
+// percent of connections
+static const int script_mix[S_SCRIPTS] = { 55, 10, 10, 3, 8, 7, 7 };
+
+// the client's side of a connection
+enum { C_IDLE, C_OPENING, C_WAITING, C_PLAYING, C_WATCHING, C_DONE };
+
+typedef struct {
+    MemChan chan;
+    int id;
+    long conn;
+    int script;
+    // the script and the slot, say "forfeit12": the opponent reads the
+    // script off the NAME, and each slot's names rate on their own
+    char name[24];
+    int state;
+    int binary;
+    // the game as this client was last told it
+    int number;
+    int turn;
+    int piles;
+    uint8_t board[GAME_MAX_PILES];
+    int opp_script;
+    // a MOVE of ours is unanswered, and the board it should leave
+    int moved;
+    uint8_t expect_board[GAME_MAX_PILES];
+    int took_last;
+    int moves;
+    int quit_after;
+    // the FAIL the server owes us, NULL for none
+    const char *expect;
+    // the impatient MOVE or the second OPEN has gone
+    int tried;
+    int frames;
+    // on the run list, on the server's list
+    int queued;
+    int serving;
+} SimClient;
+
+// a server frame in either codec
+typedef struct {
+    int type;
+    // NAME's number, PLAY's turn, OVER's winner
+    int num;
+    int forfeit;
+    int piles;
+    uint8_t board[GAME_MAX_PILES];
+    // FAIL's reason, NAME's name
+    char text[NGP_BUF_SIZE];
+} SimFrame;
+
+static Reactor reactor;
+static SimClient *clients;
+static int nclients;
+static long target;
+// clients with something to do, picked from at random
+static int *run;
+static int nrun;
+// channels the server should read, in order
+static int *serve;
+static int serve_head;
+static int nserve;
+static uint64_t rng;
+static uint64_t sim_us;
+static uint64_t trace = 14695981039346656037ULL;
+// time spent in the server's code, apart from the clients checking it
+static uint64_t server_ns;
+
+static long violations;
+static long connections[S_SCRIPTS];
+static long games_over;
+static long forfeits;
+static long timeouts;
+static long lobby_timeouts;
+static long moves;
+static long refused;
+static long frames;
+
+static uint64_t sim_clock(void) {
+    return sim_us / 1000;
+}
+
+// xorshift64*
+static uint32_t next_rand(void) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (rng * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static void enqueue(SimClient *s) {
+    if (s->queued) return;
+    s->queued = 1;
+    run[nrun++] = s->id;
+}
+
+// the channel's hook, see transport.h
+static void sim_notify(MemChan *c, int to_server) {
+    SimClient *s = c->owner;
+    if (!to_server) {
+        enqueue(s);
+    } else if (!s->serving) {
+        s->serving = 1;
+        serve[(serve_head + nserve++) % nclients] = s->id;
+    }
+}
+
+// the server reads every channel that has something for it, which may
+// give others something
+static void drain_server(void) {
+    if (nserve == 0) return;
+    uint64_t start = metrics_now();
+    while (nserve > 0) {
+        SimClient *s = &clients[serve[serve_head]];
+        serve_head = (serve_head + 1) % nclients;
+        nserve--;
+        s->serving = 0;
+        if (s->chan.p) reactor_ready(&reactor, s->chan.p);
+    }
+    server_ns += metrics_now() - start;
+}
+
+// the wheel counts whole milliseconds, so it only moves when they do
+static void tick(void) {
+    static uint64_t ticked;
+    if (sim_clock() == ticked) return;
+    ticked = sim_clock();
+    uint64_t start = metrics_now();
+    reactor_tick(&reactor);
+    server_ns += metrics_now() - start;
+    drain_server();
+}
+
+static void complain(SimClient *s, const char *what) {
+    if (++violations <= SIM_REPORT)
+        fprintf(stderr, "simulate: client %d connection %ld (%s): %s\n", s->id, s->conn,
+                script_names[s->script], what);
+}
+
+// the client stops trusting what it knows and hangs up
+static void violation(SimClient *s, const char *what) {
+    complain(s, what);
+    mem_chan_hang_up(&s->chan);
+    s->state = C_IDLE;
+    enqueue(s);
+}
+
+static int quitter(int script) {
+    return script == S_FORFEIT || script == S_STALL || script == S_REOPEN;
+}
+
+static void send_text(SimClient *s, const char *body) {
+    char frame[NGP_BUF_SIZE];
+    int len = snprintf(frame, sizeof(frame), "0|%02d|%s", (int)strlen(body), body);
+    mem_chan_write(&s->chan, frame, len);
+}
+
+static void send_open(SimClient *s, const char *name) {
+    char body[NGP_BUF_SIZE];
+    if (s->binary && s->state != C_IDLE) {
+        // the OPEN that asked for NGP-B was text, any later one is not
+        int len = strlen(name);
+        body[0] = NGP_OPEN;
+        body[1] = len;
+        memcpy(body + NGPB_HEADER, name, len);
+        mem_chan_write(&s->chan, body, NGPB_HEADER + len);
+        return;
+    }
+    snprintf(body, sizeof(body), s->binary ? "OPEN|%s|" NGPB_OPTION "|" : "OPEN|%s|", name);
+    send_text(s, body);
+}
+
+static void send_move(SimClient *s, int pile, int count) {
+    if (s->binary) {
+        char frame[NGPB_HEADER + 2] = { NGP_MOVE, 2, (char)pile, (char)count };
+        mem_chan_write(&s->chan, frame, sizeof(frame));
+        return;
+    }
+    char body[32];
+    snprintf(body, sizeof(body), "MOVE|%d|%d|", pile, count);
+    send_text(s, body);
+}
+
+// a client that is in the lobby or a game under the server's eye, for
+// the duplicate and the spectator to aim at; NULL when a few random
+// looks find none
+static SimClient *pick_target(SimClient *s, int playing) {
+    for (int i = 0; i < 8; i++) {
+        SimClient *t = &clients[next_rand() % nclients];
+        if (t == s || !t->chan.p || t->chan.read_shut || t->chan.up_closed) continue;
+        if (t->script == S_DUPLICATE || t->script == S_WATCH) continue;
+        if (t->state == C_PLAYING || (!playing && t->state == C_WAITING)) return t;
+    }
+    return NULL;
+}
+
+static int pick_script(void) {
+    int roll = next_rand() % 100;
+    for (int i = 0; i < S_SCRIPTS; i++) {
+        if (roll < script_mix[i]) return i == S_STALL && move_timeout <= 0 ? S_PLAY : i;
+        roll -= script_mix[i];
+    }
+    return S_PLAY;
+}
+
+static void client_connect(SimClient *s) {
+    if (reactor.games >= target) return;
+    if (!mem_chan_done(&s->chan)) {
+        // and the client sits out the rest of the run
+        complain(s, "the server kept a connection the client hung up");
+        return;
+    }
+    mem_chan_reset(&s->chan);
+    s->conn++;
+    s->script = pick_script();
+    s->binary = next_rand() % 4 == 0;
+    s->number = s->turn = s->piles = 0;
+    s->opp_script = -1;
+    s->moved = s->took_last = s->moves = s->tried = s->frames = 0;
+    s->quit_after = next_rand() % 6;
+    s->expect = NULL;
+
+    SimClient *t = NULL;
+    if (s->script == S_DUPLICATE || s->script == S_WATCH) {
+        t = pick_target(s, s->script == S_WATCH);
+        if (!t) s->script = S_PLAY;
+    }
+    connections[s->script]++;
+    Player *p = reactor_connect(&reactor, &mem_transport, &s->chan);
+    if (!p) {
+        fprintf(stderr, "simulate: out of players\n");
+        exit(EXIT_FAILURE);
+    }
+    s->chan.p = p;
+
+    if (s->script == S_WATCH) {
+        char body[NGP_BUF_SIZE];
+        // spectators only speak text
+        s->binary = 0;
+        snprintf(body, sizeof(body), "WATC|%s|", t->name);
+        send_text(s, body);
+        s->state = C_WATCHING;
+        return;
+    }
+    snprintf(s->name, sizeof(s->name), "%s%d", script_names[s->script], s->id);
+    send_open(s, t ? t->name : s->name);
+    s->state = C_OPENING;
+    if (s->script == S_DUPLICATE) s->expect = "22 Already Playing";
+}
+
+// the length of the first whole frame, 0 when it has not all arrived
+static int frame_len(const SimClient *s, const char *buf, int avail) {
+    int len;
+    if (s->binary) {
+        if (avail < NGPB_HEADER) return 0;
+        len = NGPB_HEADER + (unsigned char)buf[1];
+    } else {
+        if (avail < 5) return 0;
+        len = 5 + (buf[2] - '0') * 10 + (buf[3] - '0');
+    }
+    return avail >= len ? len : 0;
+}
+
+// -1 when the frame makes no sense
+static int decode_text(const char *buf, int len, SimFrame *f) {
+    NgpMsg m;
+    if (ngp_parse(buf, len, &m) < 3) return -1;
+    f->type = m.type;
+    // the server's parser has no use for WAIT, nobody sends it one
+    if (f->type == NGP_NONE && m.field[2].len == 4 && memcmp(buf + m.field[2].off, "WAIT", 4) == 0)
+        f->type = NGP_WAIT;
+    char field[NGP_BUF_SIZE] = "";
+    if (m.count > 4) {
+        memcpy(field, buf + m.field[4].off, m.field[4].len);
+        field[m.field[4].len] = '\0';
+    }
+    if (f->type == NGP_FAIL && m.count > 3) {
+        memcpy(f->text, buf + m.field[3].off, m.field[3].len);
+        f->text[m.field[3].len] = '\0';
+    }
+    if (f->type == NGP_NAME || f->type == NGP_PLAY || f->type == NGP_OVER) {
+        if (m.count < 5) return -1;
+        f->num = ngp_int(&m, 3);
+        strcpy(f->text, field);
+    }
+    if (f->type == NGP_PLAY || f->type == NGP_OVER) {
+        char *s = field, *end;
+        f->piles = 0;
+        for (long n = strtol(s, &end, 10); end != s && f->piles < GAME_MAX_PILES; n = strtol(s, &end, 10)) {
+            f->board[f->piles++] = n;
+            s = end;
+        }
+        f->forfeit = f->type == NGP_OVER && m.count > 5 && m.field[5].len > 0;
+    }
+    return 0;
+}
+
+static int decode_binary(const char *buf, int len, SimFrame *f) {
+    const unsigned char *b = (const unsigned char *)buf + NGPB_HEADER;
+    int payload = len - NGPB_HEADER;
+    f->type = (unsigned char)buf[0];
+    if (f->type == NGP_FAIL || f->type == NGP_NAME) {
+        int skip = f->type == NGP_NAME;
+        if (payload < skip) return -1;
+        f->num = skip ? b[0] : 0;
+        memcpy(f->text, b + skip, payload - skip);
+        f->text[payload - skip] = '\0';
+    } else if (f->type == NGP_PLAY || f->type == NGP_OVER) {
+        int head = f->type == NGP_OVER ? 3 : 2;
+        if (payload < head || b[head - 1] > GAME_MAX_PILES || payload != head + b[head - 1]) return -1;
+        f->num = b[0];
+        f->forfeit = f->type == NGP_OVER && b[1];
+        f->piles = b[head - 1];
+        memcpy(f->board, b + head, f->piles);
+    } else if (f->type != NGP_WAIT) {
+        return -1;
+    }
+    return 0;
+}
+
+static int board_total(const uint8_t *board, int piles) {
+    int total = 0;
+    for (int i = 0; i < piles; i++) total += board[i];
+    return total;
+}
+
+// a PLAY or the OVER after someone's move: ours must have left exactly
+// the board we worked out, the opponent's must have taken from one pile
+static int check_board(SimClient *s, const SimFrame *f) {
+    if (f->piles != game_layout.count) return -1;
+    if (s->moved) return memcmp(f->board, s->expect_board, f->piles) == 0 ? 0 : -1;
+    if (s->piles == 0) return memcmp(f->board, game_layout.piles, f->piles) == 0 ? 0 : -1;
+    int changed = 0;
+    for (int i = 0; i < f->piles; i++) {
+        if (f->board[i] > s->board[i]) return -1;
+        changed += f->board[i] != s->board[i];
+    }
+    return changed == 1 ? 0 : -1;
+}
+
+static void on_over(SimClient *s, const SimFrame *f) {
+    if (s->state == C_WATCHING) {
+        if (s->frames < 4) violation(s, "OVER before the intro");
+        else s->state = C_DONE;
+        return;
+    }
+    if (s->state != C_PLAYING) {
+        violation(s, "OVER outside a game");
+        return;
+    }
+    int won = f->num == s->number;
+    if (f->forfeit) {
+        // the one who gives up is always a quitter, and only a staller
+        // is still there to hear it
+        if (won ? !quitter(s->opp_script) && s->opp_script >= 0 : s->script != S_STALL) {
+            violation(s, "forfeit nobody gave");
+            return;
+        }
+        if (!won) timeouts++;
+    } else if (board_total(f->board, f->piles) != 0 || won != s->took_last ||
+               (!won && check_board(s, f) < 0)) {
+        violation(s, "OVER does not match the board");
+        return;
+    }
+    if (won) {
+        games_over++;
+        if (f->forfeit) forfeits++;
+    }
+    s->moved = 0;
+    s->state = C_DONE;
+}
+
+static void on_play(SimClient *s, const SimFrame *f) {
+    if (s->state == C_WATCHING) {
+        if (s->frames < 3) violation(s, "PLAY before the NAMEs");
+        return;
+    }
+    if (s->state != C_PLAYING || s->expect) {
+        violation(s, s->expect ? "PLAY where a FAIL was owed" : "PLAY outside a game");
+        return;
+    }
+    if (check_board(s, f) < 0 || (s->piles > 0 && f->num == s->turn)) {
+        violation(s, "PLAY does not follow from the last one");
+        return;
+    }
+    s->moved = 0;
+    s->turn = f->num;
+    s->piles = f->piles;
+    memcpy(s->board, f->board, f->piles);
+}
+
+static void on_frame(SimClient *s, const SimFrame *f) {
+    s->frames++;
+    switch (f->type) {
+    case NGP_WAIT:
+        if (s->state != C_OPENING || s->expect) violation(s, "unexpected WAIT");
+        else s->state = C_WAITING;
+        break;
+    case NGP_NAME:
+        if (s->state == C_WATCHING) {
+            if (s->frames > 2 || f->num != s->frames) violation(s, "NAME out of order");
+        } else if (s->state != C_WAITING || (f->num != 1 && f->num != 2)) {
+            violation(s, "unexpected NAME");
+        } else {
+            s->state = C_PLAYING;
+            s->number = f->num;
+            s->opp_script = -1;
+            for (int i = 0; i < S_SCRIPTS; i++)
+                if (strncmp(f->text, script_names[i], strlen(script_names[i])) == 0) s->opp_script = i;
+        }
+        break;
+    case NGP_PLAY:
+        on_play(s, f);
+        break;
+    case NGP_OVER:
+        on_over(s, f);
+        break;
+    case NGP_FAIL:
+        if (s->expect && strcmp(f->text, s->expect) == 0) {
+            refused++;
+            // a second OPEN or a taken name ends the connection
+            if (s->expect[0] == '2') s->state = C_DONE;
+            s->expect = NULL;
+        } else if (strcmp(f->text, "Timeout") == 0 && s->state == C_WAITING) {
+            lobby_timeouts++;
+            s->state = C_DONE;
+        } else {
+            violation(s, "unexpected FAIL");
+        }
+        break;
+    default:
+        violation(s, "unknown frame");
+    }
+}
+
+// everything the server has sent, then the end of the stream if it came
+static void client_read(SimClient *s) {
+    int avail;
+    const char *buf = mem_chan_peek(&s->chan, &avail);
+    while (s->state != C_IDLE) {
+        int len = frame_len(s, buf, avail);
+        if (len == 0) break;
+        for (int i = 0; i < len; i++) trace = (trace ^ (unsigned char)buf[i]) * 1099511628211ULL;
+        SimFrame f;
+        if ((s->binary ? decode_binary(buf, len, &f) : decode_text(buf, len, &f)) < 0) {
+            violation(s, "frame does not decode");
+            return;
+        }
+        frames++;
+        mem_chan_consume(&s->chan, len);
+        buf += len;
+        avail -= len;
+        on_frame(s, &f);
+    }
+    if (s->state == C_IDLE || avail > 0 || !s->chan.down_closed) return;
+    if (s->state != C_DONE) {
+        violation(s, "connection ended early");
+        return;
+    }
+    mem_chan_hang_up(&s->chan);
+    s->state = C_IDLE;
+    enqueue(s);
+}
+
+// our turn: a random legal move, or one in twenty the server must refuse
+static void client_move(SimClient *s) {
+    int nonempty[GAME_MAX_PILES], n = 0;
+    for (int i = 0; i < s->piles; i++)
+        if (s->board[i]) nonempty[n++] = i;
+    if (n == 0) return;
+    int pile = nonempty[next_rand() % n];
+    if (next_rand() % 20 == 0) {
+        if (next_rand() % 2) {
+            s->expect = "32 Pile Index";
+            send_move(s, s->piles, 1);
+        } else {
+            s->expect = "33 Quantity";
+            send_move(s, pile, s->board[pile] + 1);
+        }
+        return;
+    }
+    int count = 1 + next_rand() % s->board[pile];
+    memcpy(s->expect_board, s->board, s->piles);
+    s->expect_board[pile] -= count;
+    s->took_last = board_total(s->expect_board, s->piles) == 0;
+    s->moved = 1;
+    s->moves++;
+    moves++;
+    send_move(s, pile, count);
+}
+
+static void client_act(SimClient *s) {
+    if (s->expect || s->moved) return;
+    if (s->script == S_REOPEN && !s->tried && (s->state == C_WAITING || s->state == C_PLAYING)) {
+        s->tried = 1;
+        s->expect = "23 Already Open";
+        send_open(s, s->name);
+        return;
+    }
+    if (s->state != C_PLAYING) return;
+    if (s->turn != s->number) {
+        if (s->script == S_IMPATIENT && !s->tried) {
+            s->tried = 1;
+            s->expect = "31 Impatient";
+            send_move(s, 0, 1);
+        }
+        return;
+    }
+    if (s->script == S_STALL) return;
+    if (s->script == S_FORFEIT && s->moves >= s->quit_after) {
+        mem_chan_hang_up(&s->chan);
+        s->state = C_IDLE;
+        enqueue(s);
+        return;
+    }
+    client_move(s);
+}
+
+static void client_step(SimClient *s) {
+    if (s->state == C_IDLE) {
+        client_connect(s);
+        return;
+    }
+    client_read(s);
+    if (s->state != C_IDLE) client_act(s);
+}
+
+// connections with a game or a spectator still to finish
+static int in_play(void) {
+    for (int i = 0; i < nclients; i++) {
+        int st = clients[i].state;
+        if (st == C_OPENING || st == C_PLAYING || st == C_WATCHING || (st == C_DONE && clients[i].chan.p))
+            return 1;
+    }
+    return 0;
+}
+
+static void report(double secs, long games) {
+    double server = server_ns / 1e9;
+    printf("%ld games, %ld moves, %ld frames in %.3f s (%.0f games/s, %.0f moves/s)\n", games, moves,
+           frames, secs, games / secs, moves / secs);
+    printf("server %.3f s of it: %.2f us a game, %.0f games/s\n", server, server * 1e6 / games,
+           games / server);
+    printf("connections:");
+    for (int i = 0; i < S_SCRIPTS; i++) printf(" %s %ld", script_names[i], connections[i]);
+    printf("\n");
+    printf("%ld over, %ld by forfeit (%ld on the clock), %ld refused moves or OPENs, %ld lobby timeouts\n",
+           games_over, forfeits, timeouts, refused, lobby_timeouts);
+    printf("trace %016llx, %ld violations\n", (unsigned long long)trace, violations);
+}
+
+int sim_run(long games, uint64_t seed, int nclient, int capacity) {
+    nclients = nclient;
+    target = games;
+    rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+    // the house bot (--bot-wait) draws from its own stream, off the same seed
+    bot_seed(seed);
+    sim_us = 0;
+    timer_set_clock(sim_clock);
+    clients = calloc(nclients, sizeof(SimClient));
+    run = malloc(sizeof(int) * nclients);
+    serve = malloc(sizeof(int) * nclients);
+    if (!clients || !run || !serve || reactor_init(&reactor, -1, capacity) < 0) {
+        perror("simulate");
+        return 1;
+    }
+    for (int i = 0; i < nclients; i++) {
+        SimClient *s = &clients[i];
+        mem_chan_init(&s->chan, sim_notify, s);
+        s->chan.up_closed = 1;
+        s->id = i;
+        enqueue(s);
+    }
+
+    uint64_t start = metrics_now();
+    for (;;) {
+        if (nrun > 0) {
+            int at = next_rand() % nrun;
+            SimClient *s = &clients[run[at]];
+            run[at] = run[--nrun];
+            s->queued = 0;
+            sim_us += SIM_STEP_US;
+            client_step(s);
+            drain_server();
+        } else {
+            // everyone is waiting on a clock: the lobby's sweep, a
+            // staller's move clock, an idle lobby
+            int ms = timer_next_ms(&reactor.timers, timer_now_ms());
+            if (ms < 0 || (reactor.games >= target && !in_play())) break;
+            sim_us += (uint64_t)(ms > 0 ? ms : 1) * 1000;
+        }
+        tick();
+    }
+    double secs = (metrics_now() - start) / 1e9;
+
+    // whoever is still in the lobby goes
+    for (int i = 0; i < nclients; i++) mem_chan_hang_up(&clients[i].chan);
+    drain_server();
+    reactor_tick(&reactor);
+    if (player_pool.in_use != 0 || game_pool.in_use != 0 || watcher_pool.in_use != 0) {
+        fprintf(stderr, "simulate: %ld players, %ld games, %ld watchers never freed\n", player_pool.in_use,
+                game_pool.in_use, watcher_pool.in_use);
+        violations++;
+    }
+    report(secs, reactor.games);
+
+    for (int i = 0; i < nclients; i++) mem_chan_free(&clients[i].chan);
+    free(clients);
+    free(run);
+    free(serve);
+    reactor_free(&reactor);
+    timer_set_clock(NULL);
+    return violations ? 1 : 0;
+}
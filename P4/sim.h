@@ -0,0 +1,10 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+// --simulate: scripted games through the event loop over memory channels,
+// see sim.c. 0 when every client saw what it should have, else 1.
+int sim_run(long games, uint64_t seed, int clients, int capacity);
+
+#endif
@@ -0,0 +1,631 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "network.h"
+
+// nimbench: opens N bot clients against nimd and has them play full
+// games back to back (closed loop), or starts new bots at a fixed rate
+// whether or not earlier ones are done (open loop, -r). Latencies are
+// taken from when an action was due, not when the generator got to it,
+// so a stalled server shows up in the tail instead of slowing the load.
+// With -b the bots ask for NGP-B at OPEN and speak it from then on.
+
+#define BUF_SIZE 256
+#define MAX_EVENTS 256
+
+// log-linear histogram of microseconds: exact below 32, then 16 buckets
+// per power of two (about 6% wide)
+#define HIST_BUCKETS 1024
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Hist;
+
+enum { B_IDLE, B_OPENING, B_WAITING, B_PLAYING };
+enum { S_RANDOM, S_SLOW, S_OPTIMAL };
+
+// NGP-B opcodes, as in the server's ngp.h
+enum { OP_MOVE = 2, OP_NAME = 4, OP_PLAY = 5, OP_OVER = 6, OP_WAIT = 7 };
+
+typedef struct Bot {
+    int fd;
+    int state;
+    int me;
+    int board[5];
+    long gen;
+    char buf[BUF_SIZE];
+    int len;
+    // all in ns: when the bot was due to connect, when WAIT came and
+    // when the outstanding MOVE was due (0 when none is outstanding)
+    uint64_t t_start;
+    uint64_t t_wait;
+    uint64_t t_move;
+    // when this bot's last MOVE was due, for its opponent to time its own
+    // PLAY by; the opponent may be on another thread
+    uint64_t t_moved;
+    // the opponent when it is one of ours, else NULL
+    struct Bot *opp;
+    struct Bot *next_idle;
+} Bot;
+
+// a move waiting out its think time; due times only grow, so a FIFO
+// is enough
+typedef struct {
+    Bot *bot;
+    long gen;
+    uint64_t due;
+} Pending;
+
+typedef struct {
+    int id;
+    pthread_t tid;
+    int epfd;
+    Bot *bots;
+    int nbots;
+    Bot *idle;
+    Pending *moves;
+    int moves_cap;
+    int moves_head;
+    int moves_count;
+    uint64_t next_start;
+    uint64_t interval;
+    uint64_t seed;
+    long started;
+    long conns;
+    long games;
+    long moves_sent;
+    long errors;
+    long missed;
+    long bytes_in;
+    long bytes_out;
+    Hist open_wait;
+    Hist wait_name;
+    Hist move_play;
+    Hist move_opp;
+} Thread;
+
+static char *host;
+static char *port;
+static int nbots = 100;
+static int nthreads = 1;
+static int duration = 10;
+static int strategy = S_RANDOM;
+static long think_ms = 0;
+static double rate = 0;
+static int binary = 0;
+// every thread's bots, one array, so a bot can find its opponent by name
+static Bot *all_bots;
+static uint64_t start_ns;
+static uint64_t end_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v) {
+    if (v < 32) return v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - 4;
+    return 32 + (shift - 1) * 16 + (int)((v >> shift) - 16);
+}
+
+// largest value that lands in bucket i
+static uint64_t hist_value(int i) {
+    if (i < 32) return i;
+    int shift = (i - 32) / 16 + 1;
+    uint64_t m = (i - 32) % 16 + 16;
+    return ((m + 1) << shift) - 1;
+}
+
+static void hist_add(Hist *h, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    h->counts[hist_index(us)]++;
+    h->total++;
+    if (us > h->max) h->max = us;
+}
+
+static void hist_merge(Hist *into, const Hist *h) {
+    for (int i = 0; i < HIST_BUCKETS; i++) into->counts[i] += h->counts[i];
+    into->total += h->total;
+    if (h->max > into->max) into->max = h->max;
+}
+
+static uint64_t hist_percentile(const Hist *h, double p) {
+    if (h->total == 0) return 0;
+    uint64_t want = (uint64_t)(p / 100.0 * h->total + 0.5);
+    if (want < 1) want = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want) return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+static void hist_print(const char *name, const Hist *h) {
+    printf("%-12s %10lu %9lu %9lu %9lu %9lu %9lu\n", name,
+           (unsigned long)h->total,
+           (unsigned long)hist_percentile(h, 50),
+           (unsigned long)hist_percentile(h, 90),
+           (unsigned long)hist_percentile(h, 99),
+           (unsigned long)hist_percentile(h, 99.9),
+           (unsigned long)h->max);
+}
+
+static uint64_t next_random(Thread *th) {
+    th->seed ^= th->seed << 13;
+    th->seed ^= th->seed >> 7;
+    th->seed ^= th->seed << 17;
+    return th->seed;
+}
+
+// writes "0|LL|" plus body; returns the frame length
+static int frame(char *out, const char *body) {
+    int len = strlen(body);
+    return sprintf(out, "0|%02d|%s", len, body);
+}
+
+static int send_raw(Thread *th, Bot *b, const char *out, int len) {
+    if (write(b->fd, out, len) != len) {
+        th->errors++;
+        return -1;
+    }
+    th->bytes_out += len;
+    return 0;
+}
+
+static int send_frame(Thread *th, Bot *b, const char *body) {
+    char out[BUF_SIZE];
+    return send_raw(th, b, out, frame(out, body));
+}
+
+static void bot_start(Thread *th, Bot *b, uint64_t due) {
+    b->fd = connect_inet(host, port);
+    if (b->fd < 0) {
+        th->errors++;
+        b->next_idle = th->idle;
+        th->idle = b;
+        return;
+    }
+    int one = 1;
+    setsockopt(b->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(b->fd, F_SETFL, fcntl(b->fd, F_GETFL, 0) | O_NONBLOCK);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = b;
+    epoll_ctl(th->epfd, EPOLL_CTL_ADD, b->fd, &ev);
+
+    b->gen++;
+    b->state = B_OPENING;
+    b->len = 0;
+    b->t_start = due;
+    b->t_move = 0;
+    b->t_moved = 0;
+    b->opp = NULL;
+    th->conns++;
+
+    // the name ends in the bot's index, see bot_named
+    char body[64];
+    snprintf(body, sizeof(body), "OPEN|b%d-%ld.%d|%s", th->id, th->started++, (int)(b - all_bots),
+             binary ? "B|" : "");
+    send_frame(th, b, body);
+}
+
+// in closed loop a finished bot goes straight back in, in open loop it
+// waits for the next scheduled start
+static void bot_finish(Thread *th, Bot *b) {
+    close(b->fd);
+    b->fd = -1;
+    b->state = B_IDLE;
+    uint64_t now = now_ns();
+    if (rate == 0 && now < end_ns) {
+        bot_start(th, b, now);
+    } else {
+        b->next_idle = th->idle;
+        th->idle = b;
+    }
+}
+
+static void choose_move(Thread *th, Bot *b, int *pile, int *count) {
+    int first = 0;
+    while (first < 4 && b->board[first] == 0) first++;
+    *pile = first;
+    *count = 1;
+
+    if (strategy == S_OPTIMAL) {
+        int x = 0;
+        for (int i = 0; i < 5; i++) x ^= b->board[i];
+        for (int i = 0; x && i < 5; i++) {
+            if ((b->board[i] ^ x) < b->board[i]) {
+                *pile = i;
+                *count = b->board[i] - (b->board[i] ^ x);
+                return;
+            }
+        }
+    } else if (strategy == S_RANDOM) {
+        int piles[5], n = 0;
+        for (int i = 0; i < 5; i++) if (b->board[i] > 0) piles[n++] = i;
+        *pile = piles[next_random(th) % n];
+        *count = 1 + next_random(th) % b->board[*pile];
+    }
+}
+
+static void send_move(Thread *th, Bot *b, uint64_t due) {
+    int pile, count;
+    char body[32];
+    choose_move(th, b, &pile, &count);
+    b->t_move = due;
+    __atomic_store_n(&b->t_moved, due, __ATOMIC_RELAXED);
+    int status;
+    if (binary) {
+        char out[4] = { OP_MOVE, 2, pile, count };
+        status = send_raw(th, b, out, 4);
+    } else {
+        snprintf(body, sizeof(body), "MOVE|%d|%d|", pile, count);
+        status = send_frame(th, b, body);
+    }
+    if (status == 0) th->moves_sent++;
+}
+
+static void queue_move(Thread *th, Bot *b, uint64_t due) {
+    if (th->moves_count == th->moves_cap) {
+        int cap = th->moves_cap ? th->moves_cap * 2 : 64;
+        Pending *grown = malloc(sizeof(Pending) * cap);
+        for (int i = 0; i < th->moves_count; i++)
+            grown[i] = th->moves[(th->moves_head + i) % th->moves_cap];
+        free(th->moves);
+        th->moves = grown;
+        th->moves_cap = cap;
+        th->moves_head = 0;
+    }
+    Pending *m = &th->moves[(th->moves_head + th->moves_count) % th->moves_cap];
+    m->bot = b;
+    m->gen = b->gen;
+    m->due = due;
+    th->moves_count++;
+}
+
+// splits a frame into its fields in place; returns the field count
+static int split(char *msg, char **fields, int max) {
+    int n = 0;
+    char *p = msg;
+    while (n < max) {
+        char *bar = strchr(p, '|');
+        if (!bar) break;
+        *bar = '\0';
+        fields[n++] = p;
+        p = bar + 1;
+    }
+    return n;
+}
+
+static void bot_board(Bot *b, const char *text) {
+    sscanf(text, "%d %d %d %d %d", &b->board[0], &b->board[1], &b->board[2],
+           &b->board[3], &b->board[4]);
+}
+
+static void on_wait(Thread *th, Bot *b, uint64_t now) {
+    hist_add(&th->open_wait, now - b->t_start);
+    b->t_wait = now;
+    b->state = B_WAITING;
+}
+
+// the bot an opponent's name of len bytes belongs to, NULL when it is
+// not one of ours (the house bot, another client)
+static Bot *bot_named(const char *name, int len) {
+    char copy[64];
+    if (len <= 0 || len >= (int)sizeof(copy) || name[0] != 'b') return NULL;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    char *dot = strrchr(copy, '.');
+    if (!dot || !dot[1]) return NULL;
+    char *end;
+    long i = strtol(dot + 1, &end, 10);
+    return *end == '\0' && i >= 0 && i < nbots ? &all_bots[i] : NULL;
+}
+
+static void on_name(Thread *th, Bot *b, int me, const char *opp, int len, uint64_t now) {
+    hist_add(&th->wait_name, now - b->t_wait);
+    b->me = me;
+    b->opp = bot_named(opp, len);
+    b->state = B_PLAYING;
+}
+
+// the board is already in b->board. The PLAY that hands b its turn
+// answers the opponent's MOVE and is timed from when that was due; the
+// server may send it after the mover's own.
+static void on_play(Thread *th, Bot *b, int turn, uint64_t now) {
+    if (b->t_move) {
+        hist_add(&th->move_play, now - b->t_move);
+        b->t_move = 0;
+    }
+    if (turn == b->me && b->opp) {
+        uint64_t moved = __atomic_load_n(&b->opp->t_moved, __ATOMIC_RELAXED);
+        if (moved && now > moved) hist_add(&th->move_opp, now - moved);
+    }
+    if (turn == b->me) {
+        if (think_ms == 0) send_move(th, b, now);
+        else queue_move(th, b, now + think_ms * 1000000);
+    }
+}
+
+static int on_over(Thread *th, Bot *b) {
+    if (b->t_move) hist_add(&th->move_play, now_ns() - b->t_move);
+    // both players are usually ours, so only player 1 counts a game
+    if (b->me == 1) th->games++;
+    return -1;
+}
+
+static int on_other(Thread *th, Bot *b) {
+    th->errors++;
+    return b->state != B_PLAYING ? -1 : 0;
+}
+
+// returns -1 once the bot is done with its connection
+static int bot_frame(Thread *th, Bot *b, char *msg, uint64_t now) {
+    char *f[6];
+    int n = split(msg, f, 6);
+    if (n < 3) return -1;
+
+    if (strcmp(f[2], "WAIT") == 0) {
+        on_wait(th, b, now);
+    } else if (strcmp(f[2], "NAME") == 0 && n >= 4) {
+        on_name(th, b, atoi(f[3]), n >= 5 ? f[4] : "", n >= 5 ? (int)strlen(f[4]) : 0, now);
+    } else if (strcmp(f[2], "PLAY") == 0 && n >= 5) {
+        bot_board(b, f[4]);
+        on_play(th, b, atoi(f[3]), now);
+    } else if (strcmp(f[2], "OVER") == 0) {
+        return on_over(th, b);
+    } else {
+        return on_other(th, b);
+    }
+    return 0;
+}
+
+// the same for an NGP-B frame of len bytes, header included
+static int bot_frame_binary(Thread *th, Bot *b, const unsigned char *msg, int len, uint64_t now) {
+    if (msg[0] == OP_WAIT) {
+        on_wait(th, b, now);
+    } else if (msg[0] == OP_NAME && len >= 3) {
+        on_name(th, b, msg[2], (const char *)msg + 3, len - 3, now);
+    } else if (msg[0] == OP_PLAY && len >= 4 && len >= 4 + msg[3]) {
+        for (int i = 0; i < 5; i++) b->board[i] = i < msg[3] ? msg[4 + i] : 0;
+        on_play(th, b, msg[2], now);
+    } else if (msg[0] == OP_OVER) {
+        return on_over(th, b);
+    } else {
+        return on_other(th, b);
+    }
+    return 0;
+}
+
+static void bot_readable(Thread *th, Bot *b) {
+    for (;;) {
+        int n = read(b->fd, b->buf + b->len, BUF_SIZE - 1 - b->len);
+        if (n < 0 && errno == EAGAIN) return;
+        if (n <= 0) {
+            th->errors++;
+            bot_finish(th, b);
+            return;
+        }
+        b->len += n;
+        th->bytes_in += n;
+        uint64_t now = now_ns();
+
+        // every complete "0|LL|...|" frame in the buffer; with -b the
+        // server answers the OPEN in NGP-B already, so every reply is an
+        // opcode, length, payload frame (a text FAIL counts as an error)
+        int off = 0;
+        while (binary && b->len - off >= 2) {
+            unsigned char *msg = (unsigned char *)b->buf + off;
+            int len = 2 + msg[1];
+            if (b->len - off < len) break;
+            off += len;
+            if (bot_frame_binary(th, b, msg, len, now) < 0) {
+                bot_finish(th, b);
+                return;
+            }
+        }
+        while (!binary && b->len - off >= 5) {
+            char *msg = b->buf + off;
+            int body = atoi(msg + 2);
+            if (b->len - off < 5 + body) break;
+            char saved = msg[5 + body];
+            msg[5 + body] = '\0';
+            int done = bot_frame(th, b, msg, now) < 0;
+            msg[5 + body] = saved;
+            off += 5 + body;
+            if (done) {
+                bot_finish(th, b);
+                return;
+            }
+        }
+        memmove(b->buf, b->buf + off, b->len - off);
+        b->len -= off;
+    }
+}
+
+static int poll_timeout(Thread *th, uint64_t now) {
+    uint64_t next = end_ns;
+    if (th->moves_count && th->moves[th->moves_head].due < next)
+        next = th->moves[th->moves_head].due;
+    if (rate > 0 && th->next_start < next) next = th->next_start;
+    if (next <= now) return 0;
+    return (next - now + 999999) / 1000000;
+}
+
+static void *thread_main(void *arg) {
+    Thread *th = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    th->epfd = epoll_create1(0);
+    if (th->epfd < 0) {
+        perror("epoll_create1");
+        return NULL;
+    }
+    th->idle = NULL;
+    for (int i = th->nbots - 1; i >= 0; i--) {
+        th->bots[i].fd = -1;
+        th->bots[i].next_idle = th->idle;
+        th->idle = &th->bots[i];
+    }
+    if (rate == 0) {
+        while (th->idle) {
+            Bot *b = th->idle;
+            th->idle = b->next_idle;
+            bot_start(th, b, now_ns());
+        }
+    }
+
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= end_ns) break;
+        int n = epoll_wait(th->epfd, events, MAX_EVENTS, poll_timeout(th, now));
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) bot_readable(th, events[i].data.ptr);
+
+        now = now_ns();
+        while (th->moves_count && th->moves[th->moves_head].due <= now) {
+            Pending m = th->moves[th->moves_head];
+            th->moves_head = (th->moves_head + 1) % th->moves_cap;
+            th->moves_count--;
+            // skip moves for games that ended while the bot was thinking
+            if (m.bot->gen == m.gen && m.bot->state == B_PLAYING) send_move(th, m.bot, m.due);
+        }
+
+        // every start that has come due, each timed from its own slot
+        while (rate > 0 && th->next_start <= now && th->next_start < end_ns) {
+            if (th->idle) {
+                Bot *b = th->idle;
+                th->idle = b->next_idle;
+                bot_start(th, b, th->next_start);
+            } else {
+                th->missed++;
+            }
+            th->next_start += th->interval;
+        }
+    }
+
+    for (int i = 0; i < th->nbots; i++)
+        if (th->bots[i].fd >= 0) close(th->bots[i].fd);
+    close(th->epfd);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n bots] [-t threads] [-d seconds] [-s random|slow|optimal]\n"
+                    "          [-k think_ms] [-r connections_per_sec] [-b] host port\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "n:t:d:s:k:r:b")) != -1) {
+        if (c == 'n') nbots = atoi(optarg);
+        else if (c == 'b') binary = 1;
+        else if (c == 't') nthreads = atoi(optarg);
+        else if (c == 'd') duration = atoi(optarg);
+        else if (c == 'k') think_ms = atol(optarg);
+        else if (c == 'r') rate = atof(optarg);
+        else if (c == 's') {
+            if (strcmp(optarg, "random") == 0) strategy = S_RANDOM;
+            else if (strcmp(optarg, "slow") == 0) strategy = S_SLOW;
+            else if (strcmp(optarg, "optimal") == 0) strategy = S_OPTIMAL;
+            else usage(argv[0]);
+        } else usage(argv[0]);
+    }
+    if (optind != argc - 2 || nbots < 1 || nthreads < 1 || nthreads > nbots ||
+        duration < 1 || think_ms < 0 || rate < 0)
+        usage(argv[0]);
+    host = argv[optind];
+    port = argv[optind + 1];
+
+    Thread *threads = calloc(nthreads, sizeof(Thread));
+    Bot *bots = calloc(nbots, sizeof(Bot));
+    all_bots = bots;
+    if (!threads || !bots) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    start_ns = now_ns();
+    end_ns = start_ns + (uint64_t)duration * 1000000000;
+    int given = 0;
+    for (int i = 0; i < nthreads; i++) {
+        Thread *th = &threads[i];
+        th->id = i;
+        th->nbots = nbots / nthreads + (i < nbots % nthreads);
+        th->bots = bots + given;
+        given += th->nbots;
+        th->seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (rate > 0) {
+            // the threads share the rate and take turns within a period
+            th->interval = (uint64_t)(1e9 * nthreads / rate);
+            th->next_start = start_ns + th->interval * i / nthreads;
+        }
+        if (pthread_create(&th->tid, NULL, thread_main, th) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Thread total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < nthreads; i++) {
+        Thread *th = &threads[i];
+        pthread_join(th->tid, NULL);
+        total.conns += th->conns;
+        total.games += th->games;
+        total.moves_sent += th->moves_sent;
+        total.errors += th->errors;
+        total.missed += th->missed;
+        total.bytes_in += th->bytes_in;
+        total.bytes_out += th->bytes_out;
+        hist_merge(&total.open_wait, &th->open_wait);
+        hist_merge(&total.wait_name, &th->wait_name);
+        hist_merge(&total.move_play, &th->move_play);
+        hist_merge(&total.move_opp, &th->move_opp);
+        free(th->moves);
+    }
+    double secs = (now_ns() - start_ns) / 1e9;
+
+    printf("%s loop, %d bots on %d threads, %s, %.1f s\n",
+           rate > 0 ? "open" : "closed", nbots, nthreads, binary ? "NGP-B" : "NGP", secs);
+    printf("connections %10ld %10.1f/s\n", total.conns, total.conns / secs);
+    printf("games       %10ld %10.1f/s\n", total.games, total.games / secs);
+    printf("moves       %10ld %10.1f/s\n", total.moves_sent, total.moves_sent / secs);
+    printf("bytes in    %10ld %10.1f/move\n", total.bytes_in,
+           total.moves_sent ? (double)total.bytes_in / total.moves_sent : 0.0);
+    printf("bytes out   %10ld %10.1f/move\n", total.bytes_out,
+           total.moves_sent ? (double)total.bytes_out / total.moves_sent : 0.0);
+    printf("errors      %10ld\n", total.errors);
+    if (rate > 0) printf("missed      %10ld (no idle bot when a start was due)\n", total.missed);
+    printf("\nlatency us        count       p50       p90       p99     p99.9       max\n");
+    hist_print("open->wait", &total.open_wait);
+    hist_print("wait->name", &total.wait_name);
+    hist_print("move->play", &total.move_play);
+    hist_print("move->opp", &total.move_opp);
+
+    free(threads);
+    free(bots);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,82 @@
+#include <stdlib.h>
+#include <string.h>
+#include "strtab.h"
+
+#define STRTAB_BUCKETS 16
+
+// -1 when out of memory
+int strtab_init(StrTable *t, int nshards) {
+    t->nshards = nshards;
+    t->shards = calloc(nshards, sizeof(StrShard));
+    if (!t->shards) return -1;
+    for (int i = 0; i < nshards; i++) {
+        StrShard *s = &t->shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->nbuckets = STRTAB_BUCKETS;
+        s->buckets = calloc(STRTAB_BUCKETS, sizeof(StrNode *));
+        if (!s->buckets) return -1;
+    }
+    return 0;
+}
+
+// FNV-1a
+uint32_t strtab_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+StrShard *strtab_shard(StrTable *t, uint32_t hash) {
+    return &t->shards[hash % t->nshards];
+}
+
+static StrNode **bucket(const StrTable *t, const StrShard *s, uint32_t hash) {
+    return &s->buckets[(hash / t->nshards) & (s->nbuckets - 1)];
+}
+
+// a shard past one node a bucket doubles; with no memory for that it
+// just stays as it is, longer chains and all
+static void grow(StrTable *t, StrShard *s) {
+    int nb = s->nbuckets * 2;
+    StrNode **buckets = calloc(nb, sizeof(StrNode *));
+    if (!buckets) return;
+    for (int i = 0; i < s->nbuckets; i++) {
+        StrNode *n = s->buckets[i];
+        while (n) {
+            StrNode *next = n->next;
+            int b = (n->hash / t->nshards) & (nb - 1);
+            n->next = buckets[b];
+            buckets[b] = n;
+            n = next;
+        }
+    }
+    free(s->buckets);
+    s->buckets = buckets;
+    s->nbuckets = nb;
+}
+
+StrNode *strtab_find(StrTable *t, StrShard *s, const char *str, size_t len, uint32_t hash) {
+    for (StrNode *n = *bucket(t, s, hash); n; n = n->next) {
+        if (n->hash == hash && n->len == len && memcmp(n->str, str, len) == 0) return n;
+    }
+    return NULL;
+}
+
+void strtab_insert(StrTable *t, StrShard *s, StrNode *n) {
+    StrNode **b = bucket(t, s, n->hash);
+    n->next = *b;
+    *b = n;
+    if (++s->count > s->nbuckets) grow(t, s);
+}
+
+// n must be in s
+void strtab_remove(StrTable *t, StrShard *s, StrNode *n) {
+    StrNode **link = bucket(t, s, n->hash);
+    while (*link && *link != n) link = &(*link)->next;
+    if (!*link) return;
+    *link = n->next;
+    s->count--;
+}
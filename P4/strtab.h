@@ -0,0 +1,42 @@
+#ifndef STRTAB_H
+#define STRTAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// A hash table of strings split into independently locked shards, under
+// names.c's names in use and rating.c's ratings. The low bits of a
+// string's hash pick its shard and the rest its bucket. The table only
+// links nodes: each user embeds a StrNode first in its own entries, which
+// it allocates, keys and frees as it likes. Everything but strtab_init
+// and strtab_hash runs with the shard's lock held.
+
+typedef struct StrNode {
+    struct StrNode *next;
+    // the key, the entry's own copy; set before strtab_insert
+    const char *str;
+    uint32_t hash;
+    uint32_t len;
+} StrNode;
+
+typedef struct {
+    pthread_mutex_t lock;
+    StrNode **buckets;
+    int nbuckets;
+    long count;
+} StrShard;
+
+typedef struct {
+    StrShard *shards;
+    int nshards;
+} StrTable;
+
+int strtab_init(StrTable *t, int nshards);
+uint32_t strtab_hash(const char *s, size_t len);
+StrShard *strtab_shard(StrTable *t, uint32_t hash);
+StrNode *strtab_find(StrTable *t, StrShard *s, const char *str, size_t len, uint32_t hash);
+void strtab_insert(StrTable *t, StrShard *s, StrNode *n);
+void strtab_remove(StrTable *t, StrShard *s, StrNode *n);
+
+#endif
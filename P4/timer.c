@@ -0,0 +1,165 @@
+#include <time.h>
+#include "timer.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+// furthest a timer can be armed, in ticks
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+// a simulation's clock when set, see timer_set_clock
+static uint64_t (*clock_ms)(void);
+
+uint64_t timer_now_ms(void) {
+    if (clock_ms) return clock_ms();
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// every deadline, lobby window and wheel from here on runs on now_ms
+// instead of CLOCK_MONOTONIC; NULL goes back to the real clock
+void timer_set_clock(uint64_t (*now_ms)(void)) {
+    clock_ms = now_ms;
+}
+
+static void list_init(Timer *head) {
+    head->next = head->prev = head;
+}
+
+static void list_add(Timer *head, Timer *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void list_del(Timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+void timer_wheel_init(TimerWheel *w, int tick_ms, void *ctx) {
+    for (int l = 0; l < WHEEL_LEVELS; l++)
+        for (int s = 0; s < WHEEL_SLOTS; s++) list_init(&w->slots[l][s]);
+    w->now = 0;
+    w->base_ms = timer_now_ms();
+    w->tick_ms = tick_ms;
+    w->armed = 0;
+    w->ctx = ctx;
+}
+
+void timer_init(Timer *t, TimerFn fn, void *arg) {
+    t->next = t->prev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+int timer_armed(const Timer *t) {
+    return t->next != NULL;
+}
+
+// level l holds timers due within 64^(l+1) ticks, slotted by the bits
+// of their expiry that belong to that level
+static void wheel_insert(TimerWheel *w, Timer *t) {
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+        level++;
+    int slot = (t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    list_add(&w->slots[level][slot], t);
+}
+
+// fires after at least delay_ms, rounded up to the next tick
+void timer_arm(TimerWheel *w, Timer *t, long delay_ms) {
+    if (timer_armed(t)) timer_cancel(w, t);
+    uint64_t ticks = delay_ms > 0 ? ((uint64_t)delay_ms + w->tick_ms - 1) / w->tick_ms : 1;
+    if (ticks >= WHEEL_SPAN) ticks = WHEEL_SPAN - 1;
+    t->expires = w->now + ticks;
+    wheel_insert(w, t);
+    w->armed++;
+}
+
+void timer_cancel(TimerWheel *w, Timer *t) {
+    if (!timer_armed(t)) return;
+    list_del(t);
+    w->armed--;
+}
+
+// pulls the current slot of every level above 0 down once the level
+// below it has wrapped
+static void wheel_cascade(TimerWheel *w) {
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        int slot = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        Timer *head = &w->slots[level][slot];
+        Timer moving;
+        list_init(&moving);
+        if (head->next != head) {
+            moving.next = head->next;
+            moving.prev = head->prev;
+            moving.next->prev = &moving;
+            moving.prev->next = &moving;
+            list_init(head);
+        }
+        while (moving.next != &moving) {
+            Timer *t = moving.next;
+            list_del(t);
+            wheel_insert(w, t);
+        }
+        if (slot != 0) break;
+    }
+}
+
+// callbacks may arm or cancel any timer, including ones due this tick
+static void wheel_fire(TimerWheel *w, Timer *head) {
+    Timer due;
+    list_init(&due);
+    if (head->next == head) return;
+    due.next = head->next;
+    due.prev = head->prev;
+    due.next->prev = &due;
+    due.prev->next = &due;
+    list_init(head);
+
+    while (due.next != &due) {
+        Timer *t = due.next;
+        list_del(t);
+        w->armed--;
+        t->fn(w->ctx, t->arg);
+    }
+}
+
+void timer_advance(TimerWheel *w, uint64_t now_ms) {
+    uint64_t target = (now_ms - w->base_ms) / w->tick_ms;
+    // with nothing armed there is nothing to walk
+    if (w->armed == 0 && target > w->now) w->now = target;
+    while (w->now < target) {
+        w->now++;
+        if ((w->now & WHEEL_MASK) == 0) wheel_cascade(w);
+        wheel_fire(w, &w->slots[0][w->now & WHEEL_MASK]);
+    }
+}
+
+// how long until t fires, -1 when it is not armed
+long timer_left_ms(const TimerWheel *w, const Timer *t, uint64_t now_ms) {
+    if (!timer_armed(t)) return -1;
+    uint64_t due_ms = w->base_ms + t->expires * w->tick_ms;
+    return due_ms > now_ms ? (long)(due_ms - now_ms) : 0;
+}
+
+// how long a poll may sleep before the wheel next needs to advance, -1
+// when nothing is armed; timers further out than level 0 only need a
+// wake up when level 0 wraps and they move down
+int timer_next_ms(TimerWheel *w, uint64_t now_ms) {
+    if (w->armed == 0) return -1;
+    uint64_t ticks = WHEEL_SLOTS - (w->now & WHEEL_MASK);
+    for (uint64_t i = 1; i < ticks; i++) {
+        Timer *head = &w->slots[0][(w->now + i) & WHEEL_MASK];
+        if (head->next != head) {
+            ticks = i;
+            break;
+        }
+    }
+    uint64_t due_ms = w->base_ms + (w->now + ticks) * w->tick_ms;
+    return due_ms > now_ms ? (int)(due_ms - now_ms) : 0;
+}
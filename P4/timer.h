@@ -0,0 +1,46 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// Hierarchical timing wheel. Four levels of 64 slots; a timer sits in
+// the level that matches how far away it is and moves down a level each
+// time the level below wraps. Arming and cancelling unlink or link one
+// node, and expiry costs one slot walk per tick, so timers are cheap
+// enough to keep one per connection.
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef void (*TimerFn)(void *ctx, void *arg);
+
+typedef struct Timer {
+    struct Timer *next;
+    struct Timer *prev;
+    uint64_t expires;
+    TimerFn fn;
+    void *arg;
+} Timer;
+
+typedef struct {
+    Timer slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t now;
+    uint64_t base_ms;
+    int tick_ms;
+    long armed;
+    void *ctx;
+} TimerWheel;
+
+uint64_t timer_now_ms(void);
+void timer_set_clock(uint64_t (*now_ms)(void));
+void timer_wheel_init(TimerWheel *w, int tick_ms, void *ctx);
+void timer_init(Timer *t, TimerFn fn, void *arg);
+int timer_armed(const Timer *t);
+void timer_arm(TimerWheel *w, Timer *t, long delay_ms);
+void timer_cancel(TimerWheel *w, Timer *t);
+void timer_advance(TimerWheel *w, uint64_t now_ms);
+int timer_next_ms(TimerWheel *w, uint64_t now_ms);
+long timer_left_ms(const TimerWheel *w, const Timer *t, uint64_t now_ms);
+
+#endif
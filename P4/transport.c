@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "transport.h"
+#include "player.h"
+
+static ssize_t tcp_recv(Player *p, char *buf, size_t len) {
+    return read(p->fd, buf, len);
+}
+
+// one frame is a plain send, several are one sendmsg
+static ssize_t tcp_sendv(Player *p, const struct iovec *iov, int count) {
+    if (count == 1) return send(p->fd, iov[0].iov_base, iov[0].iov_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = (struct iovec *)iov;
+    mh.msg_iovlen = count;
+    return sendmsg(p->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static void tcp_shutdown(Player *p, int how) {
+    shutdown(p->fd, how);
+}
+
+static void tcp_close(Player *p) {
+    close(p->fd);
+    p->fd = -1;
+}
+
+const Transport tcp_transport = { "tcp", tcp_recv, tcp_sendv, tcp_shutdown, tcp_close };
+
+// room for len more bytes at the end of q; -1 when out of memory
+static int queue_grow(MemQueue *q, int len) {
+    if (q->start == q->end) q->start = q->end = 0;
+    if (q->end + len <= q->cap) return 0;
+    if (q->start > 0) {
+        memmove(q->data, q->data + q->start, q->end - q->start);
+        q->end -= q->start;
+        q->start = 0;
+        if (q->end + len <= q->cap) return 0;
+    }
+    int cap = q->cap ? q->cap : 256;
+    while (cap < q->end + len) cap *= 2;
+    char *grown = realloc(q->data, cap);
+    if (!grown) return -1;
+    q->data = grown;
+    q->cap = cap;
+    return 0;
+}
+
+static ssize_t mem_recv(Player *p, char *buf, size_t len) {
+    MemChan *c = p->chan;
+    if (c->read_shut) return 0;
+    int avail = c->up.end - c->up.start;
+    if (avail == 0) {
+        if (c->up_closed) return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    if ((size_t)avail > len) avail = len;
+    memcpy(buf, c->up.data + c->up.start, avail);
+    c->up.start += avail;
+    return avail;
+}
+
+static ssize_t mem_sendv(Player *p, const struct iovec *iov, int count) {
+    MemChan *c = p->chan;
+    if (c->up_closed || c->down_closed) {
+        errno = EPIPE;
+        return -1;
+    }
+    int len = 0;
+    for (int i = 0; i < count; i++) len += iov[i].iov_len;
+    if (queue_grow(&c->down, len) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        memcpy(c->down.data + c->down.end, iov[i].iov_base, iov[i].iov_len);
+        c->down.end += iov[i].iov_len;
+    }
+    c->notify(c, 0);
+    return len;
+}
+
+// as a socket would, a shut read side ends the stream for the server's
+// next read, and a shut write side for the client's
+static void mem_shutdown(Player *p, int how) {
+    MemChan *c = p->chan;
+    if (!c) return;
+    if (how != SHUT_WR && !c->read_shut) {
+        c->read_shut = 1;
+        c->notify(c, 1);
+    }
+    if (how != SHUT_RD && !c->down_closed) {
+        c->down_closed = 1;
+        c->notify(c, 0);
+    }
+}
+
+static void mem_close(Player *p) {
+    MemChan *c = p->chan;
+    c->p = NULL;
+    p->chan = NULL;
+    if (!c->down_closed) {
+        c->down_closed = 1;
+        c->notify(c, 0);
+    }
+}
+
+const Transport mem_transport = { "mem", mem_recv, mem_sendv, mem_shutdown, mem_close };
+
+void mem_chan_init(MemChan *c, void (*notify)(MemChan *c, int to_server), void *owner) {
+    memset(c, 0, sizeof(*c));
+    c->notify = notify;
+    c->owner = owner;
+}
+
+// for the next connection, keeping the queues' memory
+void mem_chan_reset(MemChan *c) {
+    c->up.start = c->up.end = 0;
+    c->down.start = c->down.end = 0;
+    c->p = NULL;
+    c->up_closed = c->down_closed = c->read_shut = 0;
+}
+
+void mem_chan_free(MemChan *c) {
+    free(c->up.data);
+    free(c->down.data);
+    c->up.data = c->down.data = NULL;
+    c->up.cap = c->down.cap = 0;
+}
+
+// the client's send: len, or -1 once either side has hung up
+int mem_chan_write(MemChan *c, const char *buf, int len) {
+    if (c->up_closed || c->read_shut || !c->p) return -1;
+    if (queue_grow(&c->up, len) < 0) return -1;
+    memcpy(c->up.data + c->up.end, buf, len);
+    c->up.end += len;
+    c->notify(c, 1);
+    return len;
+}
+
+// what the server has sent and the client has not consumed yet
+const char *mem_chan_peek(MemChan *c, int *len) {
+    *len = c->down.end - c->down.start;
+    return c->down.data + c->down.start;
+}
+
+void mem_chan_consume(MemChan *c, int len) {
+    c->down.start += len;
+}
+
+void mem_chan_hang_up(MemChan *c) {
+    if (c->up_closed) return;
+    c->up_closed = 1;
+    if (c->p) c->notify(c, 1);
+}
+
+// both ends have closed, so the channel can carry another connection
+int mem_chan_done(const MemChan *c) {
+    return c->up_closed && !c->p;
+}
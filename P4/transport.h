@@ -0,0 +1,68 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct Player;
+
+// How a player's bytes move. player.c frames, queues and sends through
+// p->io and never touches the connection itself, so the lobby and game
+// state machines above it run the same over TCP and over the in-memory
+// loopback below. Every call is non blocking and answers as the socket
+// call would: the bytes moved, 0 at the end of the stream, or -1 with
+// errno set, EAGAIN when nothing can move yet.
+typedef struct Transport {
+    const char *name;
+    ssize_t (*recv)(struct Player *p, char *buf, size_t len);
+    ssize_t (*sendv)(struct Player *p, const struct iovec *iov, int count);
+    // SHUT_RD, SHUT_WR or SHUT_RDWR
+    void (*shutdown)(struct Player *p, int how);
+    // the server's end goes, and p is no longer connected
+    void (*close)(struct Player *p);
+} Transport;
+
+// p->fd, a socket; what every accepted connection speaks
+extern const Transport tcp_transport;
+
+// The in-memory loopback: a connection that is two byte queues in the
+// process, with the client's end driven by whoever made the channel (see
+// sim.c). Sends always take everything, so nothing ever waits for room.
+// The channel's notify hook hears each time one side has something new:
+// to_server when the server should read p again (the client wrote or hung
+// up, or the server shut its own read side), else the client's turn.
+
+typedef struct {
+    char *data;
+    int start;
+    int end;
+    int cap;
+} MemQueue;
+
+typedef struct MemChan {
+    // client to server, server to client
+    MemQueue up;
+    MemQueue down;
+    // the server's player, NULL once the server has closed it
+    struct Player *p;
+    // the client hung up; the server reads what is left of up, then the end
+    int up_closed;
+    // the server closed or shut its write side; the same for the client
+    int down_closed;
+    int read_shut;
+    void (*notify)(struct MemChan *c, int to_server);
+    void *owner;
+} MemChan;
+
+extern const Transport mem_transport;
+
+void mem_chan_init(MemChan *c, void (*notify)(MemChan *c, int to_server), void *owner);
+void mem_chan_reset(MemChan *c);
+void mem_chan_free(MemChan *c);
+int mem_chan_write(MemChan *c, const char *buf, int len);
+const char *mem_chan_peek(MemChan *c, int *len);
+void mem_chan_consume(MemChan *c, int len);
+void mem_chan_hang_up(MemChan *c);
+int mem_chan_done(const MemChan *c);
+
+#endif
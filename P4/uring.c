@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// the build leaves the backend out with -DNO_URING, see reactor_use_uring
+#ifndef NO_URING
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t size) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned count) {
+    return syscall(__NR_io_uring_register, fd, op, arg, count);
+}
+
+// -1 with errno set when the kernel is missing something the event loop
+// relies on: one mapping for both rings (5.4), waits with a timeout (5.11)
+// or provided buffer rings (5.19)
+int uring_init(Uring *u, unsigned entries, unsigned nbufs, unsigned buf_size) {
+    memset(u, 0, sizeof(*u));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    u->fd = sys_setup(entries, &params);
+    if (u->fd < 0) return -1;
+
+    unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & need) != need) {
+        uring_free(u);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    u->ring = mmap(NULL, u->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED) {
+        u->ring = NULL;
+        goto fail;
+    }
+    u->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    char *ring = u->ring;
+    u->sq_head = (unsigned *)(ring + params.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    u->sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+    u->sq_entries = params.sq_entries;
+    u->sq_local = *u->sq_tail;
+    // slot i always holds sqe i, so the index array is filled in once
+    unsigned *array = (unsigned *)(ring + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) array[i] = i;
+    u->cq_head = (unsigned *)(ring + params.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    u->cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+    u->cq_entries = params.cq_entries;
+    u->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    // the buffer ring has to be page aligned, which mmap gives for free
+    u->br_len = nbufs * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        goto fail;
+    }
+    u->bufs = malloc((size_t)nbufs * buf_size);
+    if (!u->bufs) goto fail;
+    u->nbufs = nbufs;
+    u->buf_size = buf_size;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)u->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = URING_BGID;
+    if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) goto fail;
+    for (unsigned i = 0; i < nbufs; i++) uring_buf_return(u, i);
+    return 0;
+
+fail:;
+    int err = errno;
+    uring_free(u);
+    errno = err;
+    return -1;
+}
+
+void uring_free(Uring *u) {
+    if (u->fd >= 0) close(u->fd);
+    if (u->sqes) munmap(u->sqes, u->sqes_len);
+    if (u->ring) munmap(u->ring, u->ring_len);
+    if (u->br) munmap(u->br, u->br_len);
+    free(u->bufs);
+    free(u->stash);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+// the next free sqe, zeroed; a full ring is submitted first to make room
+struct io_uring_sqe *uring_sqe(Uring *u) {
+    while (u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        if (uring_enter(u, 0, 0) < 0 && errno != EINTR) return NULL;
+    }
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_local & u->sq_mask];
+    u->sq_local++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Submits every sqe handed out since the last call and, when wait is set,
+// sleeps until that many completions are ready or timeout_ms passes (-1
+// for no limit). One syscall either way; a timeout is not an error.
+int uring_enter(Uring *u, unsigned wait, int timeout_ms) {
+    unsigned submit = u->sq_local - *u->sq_tail;
+    __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+
+    // the stashed ones are ready already, and the ring holds no more
+    // than cq_entries; past that the kernel returns once it is full
+    unsigned stashed = u->stash_len - u->stash_head;
+    wait = wait > stashed ? wait - stashed : 0;
+    if (wait > u->cq_entries) wait = u->cq_entries;
+
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void *argp = NULL;
+    size_t size = 0;
+    if (wait && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uintptr_t)&ts;
+        argp = &arg;
+        size = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    int n = sys_enter(u->fd, submit, wait, flags, argp, size);
+    if (n < 0 && errno == ETIME) return 0;
+    return n;
+}
+
+// completions are read in place from the head, then released; any
+// stashed ones come first
+unsigned uring_cq_ready(Uring *u) {
+    unsigned stashed = u->stash_len - u->stash_head;
+    return stashed + __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) - *u->cq_head;
+}
+
+struct io_uring_cqe *uring_cqe_at(Uring *u, unsigned i) {
+    unsigned stashed = u->stash_len - u->stash_head;
+    if (i < stashed) return &u->stash[u->stash_head + i];
+    return &u->cqes[(*u->cq_head + i - stashed) & u->cq_mask];
+}
+
+void uring_cq_advance(Uring *u, unsigned n) {
+    unsigned stashed = u->stash_len - u->stash_head;
+    unsigned from_stash = n < stashed ? n : stashed;
+    u->stash_head += from_stash;
+    if (u->stash_head == u->stash_len) u->stash_head = u->stash_len = 0;
+    n -= from_stash;
+    if (n > 0) __atomic_store_n(u->cq_head, *u->cq_head + n, __ATOMIC_RELEASE);
+}
+
+// With IORING_FEAT_NODROP a completion that finds the ring full is held
+// in the kernel until there is room, and a wait for it never ends while
+// the ring stays full.
+int uring_cq_full(Uring *u) {
+    return __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) - *u->cq_head >= u->cq_entries;
+}
+
+// Moves what the ring holds aside, in order, so the held back completions
+// can come in without the ones ahead of them being handled yet; -1 when
+// there is no memory for them.
+int uring_cq_stash(Uring *u) {
+    unsigned ready = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) - *u->cq_head;
+    if (u->stash_len + ready > u->stash_cap) {
+        unsigned cap = u->stash_cap ? u->stash_cap : u->cq_entries;
+        while (cap < u->stash_len + ready) cap *= 2;
+        struct io_uring_cqe *stash = realloc(u->stash, cap * sizeof(*stash));
+        if (!stash) return -1;
+        u->stash = stash;
+        u->stash_cap = cap;
+    }
+    for (unsigned i = 0; i < ready; i++)
+        u->stash[u->stash_len++] = u->cqes[(*u->cq_head + i) & u->cq_mask];
+    __atomic_store_n(u->cq_head, *u->cq_head + ready, __ATOMIC_RELEASE);
+    return 0;
+}
+
+char *uring_buf(Uring *u, int bid) {
+    return u->bufs + (size_t)bid * u->buf_size;
+}
+
+// hands buffer bid back to the kernel once its bytes have been copied out
+void uring_buf_return(Uring *u, int bid) {
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (u->nbufs - 1)];
+    b->addr = (uintptr_t)uring_buf(u, bid);
+    b->len = u->buf_size;
+    b->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// A bare io_uring for the event loop: the two rings mapped straight from
+// the kernel, driven with the raw syscalls (no liburing), plus one ring of
+// provided buffers that receives draw on, group URING_BGID.
+
+#define URING_BGID 0
+
+typedef struct Uring {
+    int fd;
+    // submission ring; sq_local runs ahead of the shared tail until submit
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local;
+    struct io_uring_sqe *sqes;
+    // completion ring
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    unsigned cq_entries;
+    struct io_uring_cqe *cqes;
+    // completions moved off a full ring by uring_cq_stash, read first
+    struct io_uring_cqe *stash;
+    unsigned stash_head;
+    unsigned stash_len;
+    unsigned stash_cap;
+    void *ring;
+    size_t ring_len;
+    size_t sqes_len;
+    // provided buffers
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    char *bufs;
+    unsigned nbufs;
+    unsigned buf_size;
+    unsigned short br_tail;
+} Uring;
+
+int uring_init(Uring *u, unsigned entries, unsigned nbufs, unsigned buf_size);
+void uring_free(Uring *u);
+struct io_uring_sqe *uring_sqe(Uring *u);
+int uring_enter(Uring *u, unsigned wait, int timeout_ms);
+unsigned uring_cq_ready(Uring *u);
+struct io_uring_cqe *uring_cqe_at(Uring *u, unsigned i);
+void uring_cq_advance(Uring *u, unsigned n);
+int uring_cq_full(Uring *u);
+int uring_cq_stash(Uring *u);
+char *uring_buf(Uring *u, int bid);
+void uring_buf_return(Uring *u, int bid);
+
+#endif
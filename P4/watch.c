@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "watch.h"
+#include "names.h"
+#include "metrics.h"
+
+Pool watcher_pool = POOL_INITIALIZER("watcher", Watcher);
+Pool watch_frame_pool = POOL_INITIALIZER("wframe", WatchFrame);
+
+// an event loop's games whose frames are queued but not yet sent, see
+// watch_defer
+static __thread int deferring;
+static __thread Game *deferred[WATCH_DEFER];
+static __thread int ndeferred;
+
+static WatchFrame *frame_new(void) {
+    WatchFrame *f = pool_alloc(&watch_frame_pool);
+    if (f) f->refs = 1;
+    return f;
+}
+
+static void frame_put(WatchFrame *f) {
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) pool_free(&watch_frame_pool, f);
+}
+
+// with wlock held; -1 when the queue is full
+static int queue_push(Watcher *w, WatchFrame *f) {
+    if (w->count == WATCH_QUEUE) return -1;
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+    w->queue[(w->head + w->count) % WATCH_QUEUE] = f;
+    w->count++;
+    return 0;
+}
+
+static void queue_pop(Watcher *w) {
+    frame_put(w->queue[w->head]);
+    w->head = (w->head + 1) % WATCH_QUEUE;
+    w->count--;
+    w->off = 0;
+}
+
+// with wlock held: the whole queue in one send, straight from the
+// shared frames; the frames left, or -1 when the connection has failed
+static int queue_send(Watcher *w) {
+    while (w->count > 0) {
+        struct iovec iov[WATCH_QUEUE];
+        for (int i = 0; i < w->count; i++) {
+            WatchFrame *f = w->queue[(w->head + i) % WATCH_QUEUE];
+            int skip = i == 0 ? w->off : 0;
+            iov[i].iov_base = f->data + skip;
+            iov[i].iov_len = f->len - skip;
+        }
+        ssize_t n = w->p->io->sendv(w->p, iov, w->count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? w->count : -1;
+        }
+        n += w->off;
+        while (w->count > 0 && n >= w->queue[w->head]->len) {
+            n -= w->queue[w->head]->len;
+            queue_pop(w);
+        }
+        w->off = n;
+    }
+    return 0;
+}
+
+// with watch_lock held
+static void unlink_watcher(Game *g, Watcher *w) {
+    if (w->prev) w->prev->next = w->next;
+    else g->watchers = w->next;
+    if (w->next) w->next->prev = w->prev;
+    w->prev = w->next = NULL;
+    w->subscribed = 0;
+    metrics_add(M_WATCHERS, -1);
+}
+
+// with watch_lock held: w gets nothing more, and its owner sees the
+// shut down socket and lets go of it
+static void cut_off(Game *g, Watcher *w, int slow) {
+    unlink_watcher(g, w);
+    pthread_mutex_lock(&w->p->wlock);
+    w->done = 1;
+    pthread_mutex_unlock(&w->p->wlock);
+    if (slow) metrics_add(M_SLOW_WATCHERS, 1);
+    player_shutdown(w->p, SHUT_RDWR);
+}
+
+// a thread-mode watcher's own thread sends what this one could not
+static void kick(Watcher *w) {
+    uint64_t one = 1;
+    if (w->p->wake >= 0 && write(w->p->wake, &one, sizeof(one)) < 0) perror("eventfd");
+}
+
+// with watch_lock held: a failed send cuts w off, a short one leaves the
+// rest for the owner
+static void send_to(Game *g, Watcher *w) {
+    pthread_mutex_lock(&w->p->wlock);
+    int left = queue_send(w);
+    pthread_mutex_unlock(&w->p->wlock);
+    if (left < 0) cut_off(g, w, 0);
+    else if (left > 0) kick(w);
+}
+
+// with watch_lock held: f goes on every watcher's queue, and out now
+// unless the calling event loop holds sends back to the end of its batch
+static void publish(Game *g, WatchFrame *f) {
+    int later = deferring && (g->watch_deferred || ndeferred < WATCH_DEFER);
+    Watcher *next;
+    for (Watcher *w = g->watchers; w; w = next) {
+        next = w->next;
+        pthread_mutex_lock(&w->p->wlock);
+        int full = queue_push(w, f) < 0;
+        pthread_mutex_unlock(&w->p->wlock);
+        if (full) cut_off(g, w, 1);
+        else if (!later) send_to(g, w);
+    }
+    if (later && !g->watch_deferred) {
+        g->watch_deferred = 1;
+        deferred[ndeferred++] = g;
+    }
+}
+
+// with the name's shard locked, so g cannot end meanwhile: w starts
+// with the NAMEs and the PLAY the game is at
+static int subscribe(void *owner, void *arg) {
+    Game *g = owner;
+    Watcher *w = arg;
+    pthread_mutex_lock(&g->watch_lock);
+    WatchFrame *play = g->watch_intro ? frame_new() : NULL;
+    if (!play) {
+        pthread_mutex_unlock(&g->watch_lock);
+        return -1;
+    }
+    play->len = ngp_play(play->data, g->watch_turn, g->watch_board, g->piles);
+    pthread_mutex_lock(&w->p->wlock);
+    queue_push(w, g->watch_intro);
+    queue_push(w, play);
+    pthread_mutex_unlock(&w->p->wlock);
+    frame_put(play);
+    w->game = g;
+    w->subscribed = 1;
+    w->prev = NULL;
+    w->next = g->watchers;
+    if (w->next) w->next->prev = w;
+    g->watchers = w;
+    metrics_add(M_WATCHERS, 1);
+    pthread_mutex_unlock(&g->watch_lock);
+    return 0;
+}
+
+// p follows the game name is playing; nothing is sent until the owner's
+// first watch_flush. -1 when name is in no game.
+int watch_subscribe(Player *p, const char *name) {
+    if (strlen(name) >= NAME_BUF) return -1;
+    Watcher *w = pool_alloc(&watcher_pool);
+    if (!w) return -1;
+    w->p = p;
+    w->game = NULL;
+    w->subscribed = 0;
+    w->done = 0;
+    w->prev = w->next = NULL;
+    w->head = w->count = w->off = 0;
+    strcpy(w->name, name);
+    if (names_visit(name, subscribe, w) < 0) {
+        pool_free(&watcher_pool, w);
+        return -1;
+    }
+    p->watch = w;
+    return 0;
+}
+
+// a WATC as a connection's first frame; -1 with the FAIL sent
+int watch_open(Player *p, const NgpMsg *m) {
+    if (m->count != 4 || m->field[3].len == 0) {
+        player_send_fail(p, "10 Invalid");
+        return -1;
+    }
+    char name[NAME_BUF];
+    int len = m->field[3].len < NAME_BUF - 1 ? m->field[3].len : NAME_BUF - 1;
+    memcpy(name, m->buf + m->field[3].off, len);
+    name[len] = '\0';
+    if (watch_subscribe(p, name) < 0) {
+        player_send_fail(p, "25 No Game");
+        return -1;
+    }
+    return 0;
+}
+
+// the owner, once p's socket has room: the frames still queued, or -1
+// when the connection has failed
+int watch_flush(Player *p) {
+    pthread_mutex_lock(&p->wlock);
+    int left = p->watch ? queue_send(p->watch) : -1;
+    pthread_mutex_unlock(&p->wlock);
+    return left;
+}
+
+// everything p will ever get has been sent
+int watch_finished(Player *p) {
+    pthread_mutex_lock(&p->wlock);
+    int finished = !p->watch || (p->watch->done && p->watch->count == 0);
+    pthread_mutex_unlock(&p->wlock);
+    return finished;
+}
+
+// p's game has not ended and p has not been cut off
+int watch_following(Player *p) {
+    Watcher *w = p->watch;
+    if (!w) return 0;
+    pthread_mutex_lock(&w->game->watch_lock);
+    int following = w->subscribed;
+    pthread_mutex_unlock(&w->game->watch_lock);
+    return following;
+}
+
+// the owner is closing p; after this no game touches it
+void watch_leave(Player *p) {
+    Watcher *w = p->watch;
+    if (!w) return;
+    Game *g = w->game;
+    pthread_mutex_lock(&g->watch_lock);
+    if (w->subscribed) unlink_watcher(g, w);
+    pthread_mutex_unlock(&g->watch_lock);
+    while (w->count > 0) queue_pop(w);
+    p->watch = NULL;
+    pool_free(&watcher_pool, w);
+}
+
+static void bind_names(Game *g, void *owner) {
+    if (!g->p1->bot && g->p1->name) names_bind(g->p1->name, owner);
+    if (!g->p2->bot && g->p2->name) names_bind(g->p2->name, owner);
+}
+
+// g can be watched from here on, through either player's name
+void watch_game_start(Game *g) {
+    WatchFrame *intro = frame_new();
+    if (intro) {
+        int len = ngp_name(intro->data, 1, g->p1->name);
+        intro->len = len + ngp_name(intro->data + len, 2, g->p2->name);
+    }
+    pthread_mutex_lock(&g->watch_lock);
+    g->watch_intro = intro;
+    g->watch_turn = g->turn;
+    memcpy(g->watch_board, game_board(g), GAME_MAX_PILES);
+    pthread_mutex_unlock(&g->watch_lock);
+    // without an intro nobody can watch this one
+    if (intro) bind_names(g, g);
+}
+
+// after each PLAY the players are sent; one encode whoever is watching
+void watch_play(Game *g) {
+    pthread_mutex_lock(&g->watch_lock);
+    g->watch_turn = g->turn;
+    memcpy(g->watch_board, game_board(g), GAME_MAX_PILES);
+    WatchFrame *f = g->watchers ? frame_new() : NULL;
+    if (f) {
+        f->len = ngp_play(f->data, g->turn, game_board(g), game_piles(g));
+        publish(g, f);
+        frame_put(f);
+    }
+    pthread_mutex_unlock(&g->watch_lock);
+}
+
+// the OVER goes out at once and every watcher is let go of, shut down
+// when it has nothing left to send. A winner of 0 sends nothing and
+// leaves the sockets be, for a game handed to another process.
+void watch_game_end(Game *g, int winner, int forfeit) {
+    bind_names(g, NULL);
+    pthread_mutex_lock(&g->watch_lock);
+    WatchFrame *f = winner && g->watchers ? frame_new() : NULL;
+    if (f) f->len = ngp_over(f->data, winner, game_board(g), game_piles(g), forfeit);
+    Watcher *next;
+    for (Watcher *w = g->watchers; w; w = next) {
+        next = w->next;
+        pthread_mutex_lock(&w->p->wlock);
+        int full = f && queue_push(w, f) < 0;
+        int left = f && !full ? queue_send(w) : 0;
+        w->done = 1;
+        pthread_mutex_unlock(&w->p->wlock);
+        unlink_watcher(g, w);
+        if (!winner) continue;
+        if (full) metrics_add(M_SLOW_WATCHERS, 1);
+        if (full || left <= 0) player_shutdown(w->p, SHUT_RDWR);
+        else kick(w);
+    }
+    if (f) frame_put(f);
+    if (g->watch_intro) frame_put(g->watch_intro);
+    g->watch_intro = NULL;
+    // the loop frees g as soon as this returns, so it cannot wait on the
+    // deferred list; the loop that deferred it is the one ending it
+    if (g->watch_deferred) {
+        for (int i = 0; i < ndeferred; i++) {
+            if (deferred[i] != g) continue;
+            deferred[i] = deferred[--ndeferred];
+            break;
+        }
+        g->watch_deferred = 0;
+    }
+    pthread_mutex_unlock(&g->watch_lock);
+}
+
+// An event loop calls this once on its thread: a PLAY is queued for the
+// watchers at once but sent by watch_send_deferred, which the loop calls
+// after the players' own frames have gone out.
+void watch_defer(void) {
+    deferring = 1;
+}
+
+int watch_deferred(void) {
+    return ndeferred > 0;
+}
+
+void watch_send_deferred(void) {
+    for (int i = 0; i < ndeferred; i++) {
+        Game *g = deferred[i];
+        pthread_mutex_lock(&g->watch_lock);
+        g->watch_deferred = 0;
+        Watcher *next;
+        for (Watcher *w = g->watchers; w; w = next) {
+            next = w->next;
+            send_to(g, w);
+        }
+        pthread_mutex_unlock(&g->watch_lock);
+    }
+    ndeferred = 0;
+}
@@ -0,0 +1,68 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "ngp.h"
+#include "player.h"
+#include "game.h"
+
+// Spectators. A connection whose first frame is "WATC|name|" follows the
+// game that name is playing: it gets the two NAME frames and the PLAY the
+// game is at, then every PLAY and the OVER, always as text. Each frame is
+// encoded once into a refcounted WatchFrame and every watcher's queue
+// takes a reference, so N watchers cost N sends of the same bytes and no
+// copies. Sends never block. A watcher whose socket is full keeps up to
+// WATCH_QUEUE frames queued, and past that it is cut off; the players
+// never wait on it.
+//
+// Locks: a game's watch_lock, then a watcher's wlock. The game's side
+// touches a Watcher only under watch_lock and only while it is
+// subscribed; the connection's owner flushes under wlock whenever the
+// socket drains and leaves with watch_leave before the Player is freed.
+
+#define WATCH_QUEUE 16
+// games with sends held back until the end of an event loop's batch
+#define WATCH_DEFER 64
+
+typedef struct WatchFrame {
+    int refs;
+    int len;
+    // the intro is both NAME frames
+    char data[2 * NGP_BUF_SIZE];
+} WatchFrame;
+
+typedef struct Watcher {
+    Player *p;
+    // Games are never unmapped, so this stays safe to lock after the
+    // game has ended
+    Game *game;
+    int subscribed;
+    // nothing more is coming: the game is over or this watcher was cut off
+    int done;
+    struct Watcher *prev;
+    struct Watcher *next;
+    // frames not yet sent, the first of them off bytes in
+    WatchFrame *queue[WATCH_QUEUE];
+    int head;
+    int count;
+    int off;
+    // the name asked for, which the hot upgrade subscribes to again
+    char name[NAME_BUF];
+} Watcher;
+
+extern Pool watcher_pool;
+extern Pool watch_frame_pool;
+
+int watch_open(Player *p, const NgpMsg *m);
+int watch_subscribe(Player *p, const char *name);
+int watch_flush(Player *p);
+int watch_finished(Player *p);
+int watch_following(Player *p);
+void watch_leave(Player *p);
+void watch_game_start(Game *g);
+void watch_play(Game *g);
+void watch_game_end(Game *g, int winner, int forfeit);
+void watch_defer(void);
+int watch_deferred(void);
+void watch_send_deferred(void);
+
+#endif
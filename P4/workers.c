@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <signal.h>
+#include "workers.h"
+
+// at most this many tasks move in one steal
+#define STEAL_MAX 32
+
+// callers hold w->lock
+static int queue_put(Worker *w, const Task *t) {
+    int depth = w->pool->depth;
+    if (w->count == depth) return -1;
+    w->ring[(w->head + w->count) % depth] = *t;
+    w->count++;
+    if (w->count > w->high_water) w->high_water = w->count;
+    return 0;
+}
+
+static int queue_push(Worker *w, const Task *t) {
+    pthread_mutex_lock(&w->lock);
+    int err = queue_put(w, t);
+    pthread_mutex_unlock(&w->lock);
+    return err;
+}
+
+// the owner takes tasks oldest first
+static int queue_pop(Worker *w, Task *t) {
+    pthread_mutex_lock(&w->lock);
+    int found = w->count > 0;
+    if (found) {
+        *t = w->ring[w->head];
+        w->head = (w->head + 1) % w->pool->depth;
+        w->count--;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+// thieves take the newest half of a victim's queue, so the victim keeps
+// the sessions it has been running and the thief gets a batch it can
+// work through without coming back; returns how many tasks were taken
+static int queue_steal(Worker *victim, Task *batch) {
+    int depth = victim->pool->depth;
+    pthread_mutex_lock(&victim->lock);
+    int n = (victim->count + 1) / 2;
+    if (n > STEAL_MAX) n = STEAL_MAX;
+    int first = victim->head + victim->count - n;
+    for (int i = 0; i < n; i++) batch[i] = victim->ring[(first + i) % depth];
+    victim->count -= n;
+    pthread_mutex_unlock(&victim->lock);
+    return n;
+}
+
+static void run_task(Worker *w, Task *t) {
+    WorkerPool *wp = w->pool;
+    __atomic_sub_fetch(&wp->pending, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&wp->blocked, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&wp->lock);
+        pthread_cond_broadcast(&wp->space);
+        pthread_mutex_unlock(&wp->lock);
+    }
+    t->fn(t->ctx, t->arg);
+    w->executed++;
+}
+
+// tries every other worker once, starting next door
+static int worker_steal(Worker *w) {
+    WorkerPool *wp = w->pool;
+    Task batch[STEAL_MAX];
+    for (int i = 1; i < wp->nworkers; i++) {
+        Worker *victim = &wp->workers[(w->id + i) % wp->nworkers];
+        int n = queue_steal(victim, batch);
+        if (n == 0) continue;
+        w->steals++;
+        w->stolen += n;
+        // the rest of the batch stays stealable from our own queue
+        for (int j = 1; j < n; j++)
+            if (queue_push(w, &batch[j]) < 0) run_task(w, &batch[j]);
+        run_task(w, &batch[0]);
+        return 1;
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    WorkerPool *wp = w->pool;
+    Task t;
+
+    for (;;) {
+        if (queue_pop(w, &t)) {
+            run_task(w, &t);
+            continue;
+        }
+        if (worker_steal(w)) continue;
+
+        // nothing anywhere, sleep until a submit bumps pending
+        pthread_mutex_lock(&wp->lock);
+        __atomic_add_fetch(&wp->idle, 1, __ATOMIC_SEQ_CST);
+        while (wp->running && __atomic_load_n(&wp->pending, __ATOMIC_SEQ_CST) <= 0)
+            pthread_cond_wait(&wp->wake, &wp->lock);
+        __atomic_sub_fetch(&wp->idle, 1, __ATOMIC_SEQ_CST);
+        int running = wp->running;
+        pthread_mutex_unlock(&wp->lock);
+        if (!running) break;
+    }
+    return NULL;
+}
+
+int workers_init(WorkerPool *wp, int nworkers, int depth) {
+    wp->nworkers = nworkers;
+    wp->depth = depth;
+    wp->started = 0;
+    wp->running = 1;
+    wp->idle = 0;
+    wp->blocked = 0;
+    wp->pending = 0;
+    wp->full_waits = 0;
+    pthread_mutex_init(&wp->lock, NULL);
+    pthread_cond_init(&wp->wake, NULL);
+    pthread_cond_init(&wp->space, NULL);
+
+    wp->workers = calloc(nworkers, sizeof(Worker));
+    if (!wp->workers) return -1;
+    for (int i = 0; i < nworkers; i++) {
+        Worker *w = &wp->workers[i];
+        w->pool = wp;
+        w->id = i;
+        pthread_mutex_init(&w->lock, NULL);
+        w->ring = malloc(sizeof(Task) * depth);
+        if (!w->ring) return -1;
+    }
+
+    // signals stay with the thread that started the pool
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGHUP);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    for (; wp->started < nworkers; wp->started++) {
+        Worker *w = &wp->workers[wp->started];
+        if (pthread_create(&w->tid, NULL, worker_main, w) != 0) break;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return wp->started == nworkers ? 0 : -1;
+}
+
+// queues the task on the hinted worker, or the next one with room; when
+// every queue is full the caller waits, which pushes back on whoever is
+// producing the work
+int workers_submit(WorkerPool *wp, TaskFn fn, void *ctx, void *arg, unsigned hint) {
+    Task t = { fn, ctx, arg };
+    int n = wp->nworkers;
+
+    for (;;) {
+        for (int i = 0; i < n; i++) {
+            if (queue_push(&wp->workers[(hint + i) % n], &t) == 0) {
+                __atomic_add_fetch(&wp->pending, 1, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&wp->idle, __ATOMIC_SEQ_CST) > 0) {
+                    pthread_mutex_lock(&wp->lock);
+                    pthread_cond_signal(&wp->wake);
+                    pthread_mutex_unlock(&wp->lock);
+                }
+                return 0;
+            }
+        }
+
+        pthread_mutex_lock(&wp->lock);
+        wp->full_waits++;
+        __atomic_add_fetch(&wp->blocked, 1, __ATOMIC_SEQ_CST);
+        while (wp->running && __atomic_load_n(&wp->pending, __ATOMIC_SEQ_CST) >= (long)n * wp->depth)
+            pthread_cond_wait(&wp->space, &wp->lock);
+        __atomic_sub_fetch(&wp->blocked, 1, __ATOMIC_SEQ_CST);
+        int running = wp->running;
+        pthread_mutex_unlock(&wp->lock);
+        if (!running) return -1;
+    }
+}
+
+// queued tasks that have not started are dropped
+void workers_stop(WorkerPool *wp) {
+    pthread_mutex_lock(&wp->lock);
+    wp->running = 0;
+    pthread_cond_broadcast(&wp->wake);
+    pthread_cond_broadcast(&wp->space);
+    pthread_mutex_unlock(&wp->lock);
+    for (int i = 0; i < wp->started; i++) pthread_join(wp->workers[i].tid, NULL);
+    wp->started = 0;
+}
+
+void workers_report(WorkerPool *wp, FILE *out) {
+    long executed = 0, stolen = 0;
+    for (int i = 0; i < wp->nworkers; i++) {
+        Worker *w = &wp->workers[i];
+        pthread_mutex_lock(&w->lock);
+        int queued = w->count, high = w->high_water;
+        pthread_mutex_unlock(&w->lock);
+        fprintf(out, "worker %d: %ld tasks, %ld stolen in %ld steals, queue %d/%d (high water %d)\n",
+                i, w->executed, w->stolen, w->steals, queued, wp->depth, high);
+        executed += w->executed;
+        stolen += w->stolen;
+    }
+    fprintf(out, "workers: %ld tasks, %ld stolen, %ld waits on full queues\n",
+            executed, stolen, wp->full_waits);
+}
+
+void workers_free(WorkerPool *wp) {
+    for (int i = 0; i < wp->nworkers; i++) {
+        pthread_mutex_destroy(&wp->workers[i].lock);
+        free(wp->workers[i].ring);
+    }
+    free(wp->workers);
+    pthread_mutex_destroy(&wp->lock);
+    pthread_cond_destroy(&wp->wake);
+    pthread_cond_destroy(&wp->space);
+}
@@ -0,0 +1,56 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+// Fixed pool of worker threads. Every worker owns a bounded run queue;
+// tasks are submitted to the queue picked by a hint, so the same session
+// tends to stay on the same worker, and an idle worker steals half of a
+// busy worker's queue.
+
+typedef void (*TaskFn)(void *ctx, void *arg);
+
+typedef struct {
+    TaskFn fn;
+    void *ctx;
+    void *arg;
+} Task;
+
+typedef struct Worker {
+    struct WorkerPool *pool;
+    int id;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    Task *ring;
+    int head;
+    int count;
+    int high_water;
+    // written only by the worker itself
+    long executed;
+    long stolen;
+    long steals;
+} Worker;
+
+typedef struct WorkerPool {
+    Worker *workers;
+    int nworkers;
+    int depth;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t space;
+    int running;
+    int idle;
+    int blocked;
+    long pending;
+    long full_waits;
+} WorkerPool;
+
+int workers_init(WorkerPool *wp, int nworkers, int depth);
+int workers_submit(WorkerPool *wp, TaskFn fn, void *ctx, void *arg, unsigned hint);
+void workers_stop(WorkerPool *wp);
+void workers_report(WorkerPool *wp, FILE *out);
+void workers_free(WorkerPool *wp);
+
+#endif